@@ -1,31 +1,140 @@
 #include <ctype.h>
 #include <curl/curl.h>
+#include <errno.h>
 #include <jansson.h>
 #include <lauxlib.h>
 #include <lua.h>
 #include <lualib.h>
+#include <math.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <pthread.h>
+#include <signal.h>
+#include <sys/time.h>
+
+#ifdef API_HAVE_MICROHTTPD
+#include <microhttpd.h>
+#endif
 
 #include "apinette.h"
+#include "apinette_internal.h"
 #include "base64.h"
+#include "cache.h"
+#include "compress.h"
+#include "diskcache.h"
+#include "folded.h"
+#include "jwt.h"
+#include "sigv4.h"
+#include "timeline.h"
+#include "trace.h"
 #include "utlist.h"
 #include "utstring.h"
 
 #define API_HEADER_ACCEPT "Accept"
 #define API_HEADER_AUTHORIZATION "Authorization"
+#define API_HEADER_CACHE_CONTROL "Cache-Control"
+#define API_HEADER_CONTENT_ENCODING "Content-Encoding"
 #define API_HEADER_CONTENT_TYPE "Content-Type"
+#define API_HEADER_ETAG "ETag"
+#define API_HEADER_EXPIRES "Expires"
+#define API_HEADER_IF_MODIFIED_SINCE "If-Modified-Since"
+#define API_HEADER_IF_NONE_MATCH "If-None-Match"
+#define API_HEADER_LAST_MODIFIED "Last-Modified"
+#define API_HEADER_VARY "Vary"
+#define API_HEADER_RATELIMIT_REMAINING "X-RateLimit-Remaining"
+#define API_HEADER_RATELIMIT_RESET "X-RateLimit-Reset"
+#define API_HEADER_AMZ_DATE "X-Amz-Date"
+#define API_HEADER_AMZ_CONTENT_SHA256 "X-Amz-Content-Sha256"
+#define API_HEADER_AMZ_SECURITY_TOKEN "X-Amz-Security-Token"
 
 #define API_MIME_JSON "application/json"
 
+#define API_HEADER_CONTENT_TYPE_JSON API_HEADER_CONTENT_TYPE ": " API_MIME_JSON
+
 #define API_PROTO_HTTP_STR "http"
 #define API_PROTO_HTTPS_STR "https"
 
 #define API_METHOD_GET_STR "GET"
 #define API_METHOD_POST_STR "POST"
 #define API_METHOD_PUT_STR "PUT"
-#define API_METHOD_DELETE_STR "GET"
+#define API_METHOD_DELETE_STR "DELETE"
+
+#define API_REQUEST_METATABLE "apinette.request"
+#define API_TEMPLATE_METATABLE "apinette.template"
+#define API_AUTH_METATABLE "apinette.auth"
+#define API_SERVER_METATABLE "apinette.server"
+
+/* registry field of server thread state with handlers of routes */
+#define API_SERVER_HANDLERS "apinette.handlers"
+#define API_SERVER_PORT 8000
+
+#define API_OAUTH2_TIMEOUT 30L
+#define API_OAUTH2_EXPIRES_IN 3600
+#define API_OAUTH2_REFRESH_BEFORE 60
+/* longest wait of the send loop in ms, while a token refresh is running */
+#define API_OAUTH2_REFRESH_POLL 10
+
+#define API_RETRY_MAX 3
+#define API_RETRY_DELAY 0.1
+#define API_RETRY_MAX_DELAY 30.0
+
+/* transport errors to retry on */
+#define API_RETRY_TIMEOUT 0x1
+#define API_RETRY_CONNECT 0x2
+#define API_RETRY_ERROR 0x4
+/* timeouts of idempotent requests only, the default */
+#define API_RETRY_IDEMPOTENT_TIMEOUT 0x8
+
+#define API_HEDGE_MAX_EXTRA 1
+/* adaptive hedge threshold needs this many latency samples */
+#define API_HEDGE_MIN_SAMPLES 20
+/* adaptive hedge threshold is recomputed after this many samples */
+#define API_HEDGE_RECOMPUTE 16
+#define API_LATENCY_SAMPLES 256
+
+/* CPU time between samples of the Lua profiler in microseconds */
+#define API_LUA_PROFILE_INTERVAL 1000
+/* frames nearest to the sampled function, which are kept */
+#define API_LUA_PROFILE_DEPTH 64
+#define API_LUA_PROFILE_STACKS 65536
+#define API_LUA_PROFILE_BYTES (16 * 1024 * 1024)
+
+/* events kept by the timeline of --trace, the oldest are overwritten */
+#define API_TIMELINE_EVENTS (1 << 18)
+
+/* upper bounds of latency buckets of endpoint stats in seconds */
+#define API_STATS_BUCKETS 11
+#define API_METRICS_CONTENT_TYPE                                               \
+  "application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+#define API_BREAKER_FAILURES 20
+#define API_BREAKER_WINDOW 10.0
+#define API_BREAKER_COOLDOWN 30.0
+#define API_BREAKER_PROBES 1
+
+#define API_DISK_CACHE_SIZE (1024L * 1024 * 1024)
+#define API_DISK_CACHE_MAGIC 0x31435041 // "APC1"
+
+/* default timeout of replayed requests in seconds */
+#define API_REPLAY_TIMEOUT 30L
+
+#define API_JWT_TTL 60
+#define API_JWT_REUSE_BEFORE 10
+
+/* authorization, date, payload hash and security token */
+#define API_SIGNATURE_HEADERS 4
+/* if-none-match and if-modified-since */
+#define API_VALIDATOR_HEADERS 2
+/* content type, content encoding, authorization, signature and validator
+ * headers */
+#define API_IMPLICIT_HEADERS                                                   \
+  (3 + API_SIGNATURE_HEADERS + API_VALIDATOR_HEADERS)
 
 #define api_getstringfield(L, dst, name, table_index, tmp)                     \
   lua_getfield((L), (table_index), (name));                                    \
@@ -47,7 +156,9 @@
 typedef enum {
   API_TYPE_ENDPOINT,
   API_TYPE_AUTH,
-  API_TYPE_REQUEST
+  API_TYPE_REQUEST,
+  API_TYPE_TEMPLATE,
+  API_TYPE_SERVER
 } api_userdata_type;
 
 typedef enum { API_PROTO_HTTP, API_PROTO_HTTPS } api_proto_t;
@@ -60,55 +171,420 @@ typedef enum {
   API_METHOD_CUSTOM
 } api_method_t;
 
-typedef enum { API_AUTH_BASIC } api_auth_type;
+typedef enum {
+  API_BACKOFF_NONE,
+  API_BACKOFF_FIXED,
+  API_BACKOFF_EXP
+} api_backoff_t;
+
+typedef struct {
+  int max;
+  int *statuses;
+  int statuses_len;
+  unsigned errors;
+  api_backoff_t backoff;
+  double delay;
+  double max_delay;
+  int jitter;
+} api_retry_t;
+
+/* Transfer limits, zero means the curl default */
+typedef struct {
+  long timeout;         // milliseconds
+  long connect_timeout; // milliseconds
+  long low_speed_limit; // bytes per second
+  long low_speed_time;  // seconds
+} api_limits_t;
+
+/* Token bucket shared by all requests of an endpoint. Tokens may go negative,
+ * the debt is the number of requests waiting for a slot. */
+typedef struct {
+  double rps;
+  double burst;
+  double tokens;
+  double last;         // time of the last refill, may be in the future
+  double server_rps;   // rate advertised by X-RateLimit headers
+  double server_until; // end of the window of server_rps
+} api_rate_limit_t;
+
+typedef enum {
+  API_BREAKER_CLOSED,
+  API_BREAKER_OPEN,
+  API_BREAKER_HALF_OPEN
+} api_breaker_state;
+
+/* Circuit breaker opens after a number of failures within a window. After
+ * the cooldown it lets a number of probe requests through (half-open) and
+ * closes if they succeed. */
+typedef struct {
+  int failures;
+  double window;
+  double cooldown;
+  int probes;
+  api_breaker_state state;
+  double *failed_at; // ring of times of the last failures
+  int failed_pos;
+  double opened_at;
+  int probing; // probe requests in flight
+} api_breaker_t;
+
+typedef enum {
+  API_CACHE_NONE,
+  API_CACHE_MISS,
+  API_CACHE_HIT,
+  API_CACHE_REVALIDATED,
+  API_CACHE_DISK
+} api_cache_status;
+
+/* Cached response, shared by the cache and requests revalidating it */
+typedef struct {
+  int refs;
+  int status;
+  struct curl_slist *headers;
+  char *body;
+  size_t body_len;
+  curl_off_t size_download;
+  char *etag;
+  char *last_modified;
+  char *vary;     // Vary of the response
+  char *vary_key; // values of the request headers named by vary
+  double expires;
+} api_cached_t;
+
+/* Disk cache of endpoint, the key of a response includes the listed request
+ * headers (lower case names) */
+typedef struct {
+  diskcache *dc;
+  char **headers;
+  int headers_len;
+} api_disk_cache_t;
+
+/* File of disk cache is this header followed by response headers separated
+ * by nul characters and the body */
+typedef struct {
+  uint32_t magic;
+  int32_t status;
+  uint64_t headers_len;
+  uint64_t body_len;
+  int64_t size_download;
+} api_disk_entry_t;
+
+/* Hedge is sent after a fixed delay or after a percentile of latency */
+typedef struct {
+  double after;
+  double percentile;
+  int max_extra;
+} api_hedge_t;
+
+typedef enum {
+  API_AUTH_BASIC,
+  API_AUTH_BEARER,
+  API_AUTH_OAUTH2,
+  API_AUTH_SIGV4,
+  API_AUTH_JWT
+} api_auth_type;
 
 typedef struct {
   char *user;
   char *passwd;
+  char *header;
 } api_basic_auth_t;
 
+typedef struct {
+  char *header;
+} api_bearer_auth_t;
+
+typedef struct {
+  char *token_url;
+  char *token_request;
+  double refresh_before;
+  char *header;
+  char *stale_header; // header of previous token, requests may still use it
+  double expires;
+  double refresh_at;
+  CURL *refresh;
+  char *buf;
+  size_t buf_len;
+} api_oauth2_auth_t;
+
+typedef struct {
+  jwt_key *key;
+  json_t *claims;
+  int claims_ref; // claims function or LUA_NOREF
+  lua_Integer ttl;
+  int reuse;
+  char *header; // header of reused token
+  time_t reuse_until;
+} api_jwt_auth_t;
+
+/* Auth is shared by auth object and all endpoints using it */
 typedef struct {
   api_auth_type type;
+  int refs;
   union {
     api_basic_auth_t *basic;
+    api_bearer_auth_t *bearer;
+    api_oauth2_auth_t *oauth2;
+    sigv4_credentials *sigv4;
+    api_jwt_auth_t *jwt;
   };
 } api_auth_t;
 
+/* Phases of the client time measured by api_profile */
+typedef enum {
+  API_PHASE_SCRIPT,  // Lua script outside of the phases below
+  API_PHASE_WAIT,    // waiting for the network
+  API_PHASE_CURL,    // preparing, starting and finishing transfers
+  API_PHASE_JSON,    // json decoding and encoding
+  API_PHASE_RESULT,  // building result tables
+  API_PHASE_HANDLER, // handle_response functions
+  API_PHASES
+} api_phase_t;
+
+static const char *api_phase_names[API_PHASES] = {
+    "script", "wait", "curl", "json", "result", "handler"};
+
+typedef struct {
+  double wall;
+  double cpu;
+  long count; // times the phase was entered
+} api_phase_time_t;
+
+/* Profile of the endpoints of the same base url */
+typedef struct api_profile_endpoint_t {
+  char *url;
+  long requests;
+  double response_time;
+  api_phase_time_t phases[API_PHASES];
+  struct api_profile_endpoint_t *next;
+} api_profile_endpoint_t;
+
+typedef enum {
+  API_ERROR_TIMEOUT,
+  API_ERROR_DNS,
+  API_ERROR_CONNECT,
+  API_ERROR_TLS,
+  API_ERROR_OTHER,
+  API_ERROR_KINDS
+} api_error_kind;
+
+/* Counters of attempts of an endpoint. They are updated by the send loop and
+ * read by metrics, which may run on threads of the embedded server, so both
+ * hold api_stats_lock. */
+typedef struct api_stats_t {
+  char *url; // base url of the endpoint, label of the metrics
+  long requests;
+  long in_flight;
+  long errors[API_ERROR_KINDS];
+  long statuses[5]; // 1xx to 5xx
+  curl_off_t bytes_in;
+  curl_off_t bytes_out;
+  long buckets[API_STATS_BUCKETS + 1]; // the last one is +Inf
+  double latency_sum;
+  struct api_stats_t *next;
+} api_stats_t;
+
 typedef struct {
   api_proto_t proto;
   char *host;
   char *path;
+  char *base_url;
+  char *ca_file;
+  api_profile_endpoint_t *profile; // NULL unless profiling
   api_auth_t *auth;
   int verbose;
+  int http2;
+  char *accept_encoding;
+  compress_type compress;
+  int compress_level;
+  compress_dict *zstd_dict;
+  api_limits_t limits;
+  api_rate_limit_t *rate_limit;
+  api_breaker_t *breaker;
+  cache *cache;
+  api_disk_cache_t *disk_cache;
+  api_retry_t *retry;
+  api_hedge_t *hedge;
+  api_stats_t *stats; // NULL unless enabled
+  double latencies[API_LATENCY_SAMPLES]; // ring of recent response times
+  int latencies_len;
+  int latencies_pos;
+  int latencies_new; // samples added since hedge threshold was computed
+  double hedge_percentile;
+  double hedge_threshold;
   char *handle_response_chunk;
   size_t handle_response_chunk_len;
 } api_endpoint_t;
 
-typedef struct {
+struct api_request_t;
+
+/* Response of a single attempt, there may be more attempts of a request in
+ * flight when it is hedged. */
+typedef struct api_response_t {
+  struct api_request_t *req;
+  CURL *c;
+  struct api_response_t *next; // next attempt of the request in flight
   int status;
   struct curl_slist *headers;
   char *body;
   size_t body_len;
   char *err;
-  char *url;
   double total_time;
+  curl_off_t size_download;
+  void *map; // file of disk cache, the body points into it
+  size_t map_len;
+  double started; // start of the attempt if it is in the timeline
+  int lane;       // row of the attempt in the timeline, 0 if none
 } api_response_t;
 
+/* Binary heap of requests waiting for a retry or a hedge ordered by due time */
+typedef struct {
+  struct api_request_t **items;
+  int len;
+  int size;
+} api_timers_t;
+
+typedef struct api_template_t api_template_t;
+
 typedef struct api_request_t {
   api_endpoint_t *endpoint;
+  api_template_t *tpl;
   api_method_t method;
   char *custom_method;
   char *path;
+  char *url;
   struct curl_slist *headers;
+  const char *content_type;
+  const char *content_encoding;
+  struct curl_slist implicit_headers[API_IMPLICIT_HEADERS];
+  char *signature_headers[API_SIGNATURE_HEADERS];
+  char *validator_headers[API_VALIDATOR_HEADERS];
   char *body;
   size_t body_len;
+  char payload_hash[SIGV4_HEX_LEN + 1];
+  char *accept_encoding;
+  int uncompressed; // 'compressed' is false, endpoint's encoding is not used
+  api_limits_t limits;
+  api_retry_t *retry;
+  api_hedge_t *hedge;
   char *handle_response_chunk;
   size_t handle_response_chunk_len;
   api_response_t *resp;
+  api_response_t *inflight; // attempts in flight
+  int attempts;
+  int hedges;
+  double due;
+  int timer; // position in timers + 1, 0 if not waiting
+  int admitted; // waiting for a slot reserved by the rate limit
+  int probe;    // sent by half-open circuit breaker
+  int no_cache;
+  api_cache_status cache_status;
+  api_cached_t *cached; // stale response being revalidated
+  char *disk_key;       // key of the response in disk cache
   struct api_request_t *prev;
   struct api_request_t *next;
 } api_request_t;
 
+typedef struct {
+  char *literal;
+  size_t literal_len;
+  char *param;
+} api_template_segment_t;
+
+/* Request template created by prepare function of endpoint. Requests created
+ * from the template share all fields of proto except of url and body. */
+struct api_template_t {
+  api_request_t proto;
+  compress_type compress;
+  int compress_level;
+  api_template_segment_t *segments;
+  int segments_len;
+  int params_len;
+  int refs;
+};
+
+#ifdef API_HAVE_MICROHTTPD
+/* Route of embedded server. Static response is built once and served without
+ * entering Lua, handler runs in a Lua state of the server thread. */
+typedef struct {
+  char *method; // NULL matches any method
+  char **segments;
+  int segments_len;
+  int params_len; // segments starting with colon
+  struct MHD_Response *response;
+  unsigned int status;
+  int metrics; // serves the metrics function
+  char *handler_chunk;
+  size_t handler_chunk_len;
+} api_route_t;
+
+typedef struct {
+  struct MHD_Daemon *daemon;
+  api_route_t *routes;
+  int routes_len;
+  struct MHD_Response *not_found;
+  pthread_key_t state; // Lua state of a server thread
+  int has_state;
+  int port;
+} api_server_t;
+
+/* Request of a route, which is receiving its body */
+typedef struct {
+  api_route_t *route;
+  UT_string *body; // NULL for static response
+} api_server_request_t;
+#endif
+
+/* Trace of exchanges written by api_record or responses replayed to scripts
+ * by api_replay */
+static trace_writer *api_recorder;
+static double api_record_start;
+static trace_record *api_replayed;
+static char *api_replayed_used;
+static size_t api_replayed_len;
+static size_t api_replayed_next; // first unused record
+static trace_reader *api_replay_reader;
+
+/* Background token refreshes outlive the send, which started them, they
+ * progress during the following sends */
+static CURLM *api_refresh_multi;
+static int api_refreshes; // token requests in api_refresh_multi
+
+/* Every moment of the profiled run belongs to exactly one phase, the time of
+ * the current phase is accounted when the phase changes. Only the thread of
+ * the script is profiled, not the threads of the embedded server. */
+static pthread_t api_main_thread;
+static int api_profiling;
+static double api_profile_wall, api_profile_cpu; // start of the profile
+static api_phase_time_t api_phases[API_PHASES];
+static api_profile_endpoint_t *api_profile_endpoints;
+static api_phase_t api_phase;
+static api_profile_endpoint_t *api_phase_endpoint; // of the current result
+static double api_phase_wall, api_phase_cpu;       // start of the phase
+
+/* Timeline of attempts, JSON conversions and handlers. Attempts in flight
+ * take the lowest free lane, lane 0 is the script. */
+static timeline *api_timeline;
+static char *api_timeline_path;
+static double api_timeline_origin;
+static char *api_timeline_lanes; // busy lanes
+static int api_timeline_lanes_len;
+static long api_timeline_in_flight;
+
+/* Sampling profiler of Lua code. The timer signal arms a count hook, which
+ * samples the stack at the next instruction of the script. */
+static lua_State *api_lua_profile_state;
+static folded *api_lua_profile_stacks;
+static char *api_lua_profile_path;
+
+/* Stats of all endpoints with stats enabled */
+static api_stats_t *api_stats_list;
+static pthread_mutex_t api_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static const double api_stats_bounds[API_STATS_BUCKETS] = {
+    0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+static const char *api_error_kind_names[API_ERROR_KINDS] = {
+    "timeout", "dns", "connect", "tls", "other"};
+
 char *api_printf(char *format, ...) {
   va_list va;
   UT_string *s;
@@ -127,12 +603,99 @@ char *api_printf(char *format, ...) {
   return buf;
 }
 
+static double api_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double api_cpu_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Accounts the time of the current phase and switches to the phase */
+static void api_phase_switch(api_phase_t phase, int count) {
+  double wall = api_now(), cpu = api_cpu_now();
+  api_phase_time_t *t = &api_phases[api_phase];
+
+  t->wall += wall - api_phase_wall;
+  t->cpu += cpu - api_phase_cpu;
+  if (api_phase_endpoint) {
+    t = &api_phase_endpoint->phases[api_phase];
+    t->wall += wall - api_phase_wall;
+    t->cpu += cpu - api_phase_cpu;
+  }
+  api_phase_wall = wall;
+  api_phase_cpu = cpu;
+  api_phase = phase;
+  if (count) {
+    api_phases[phase].count++;
+    if (api_phase_endpoint) {
+      api_phase_endpoint->phases[phase].count++;
+    }
+  }
+}
+
+/* Returns true on the thread running the script */
+static int api_on_main_thread(void) {
+  return pthread_equal(pthread_self(), api_main_thread);
+}
+
+/* Enters the phase, it returns the previous phase for api_phase_leave */
+static api_phase_t api_phase_enter(api_phase_t phase) {
+  api_phase_t prev = api_phase;
+
+  if (api_profiling && api_on_main_thread()) {
+    api_phase_switch(phase, 1);
+  }
+  return prev;
+}
+
+static void api_phase_leave(api_phase_t prev) {
+  if (api_profiling && api_on_main_thread()) {
+    api_phase_switch(prev, 0);
+  }
+}
+
+/* Calls function like lua_call. Errors would skip api_phase_leave, so
+ * the phase and the endpoint are restored before they are propagated. */
+static void api_phase_call(lua_State *L, int nargs, int nresults,
+                           api_phase_t prev,
+                           api_profile_endpoint_t *endpoint) {
+  if (lua_pcall(L, nargs, nresults, 0) != LUA_OK) {
+    api_phase_leave(prev);
+    if (api_on_main_thread()) {
+      api_phase_endpoint = endpoint;
+    }
+    lua_error(L);
+  }
+}
+
+/* Returns the profile of the endpoint url, it is created if it is missing */
+static api_profile_endpoint_t *api_profile_endpoint(const char *url) {
+  api_profile_endpoint_t *p;
+
+  LL_FOREACH(api_profile_endpoints, p) {
+    if (strcmp(p->url, url) == 0) {
+      return p;
+    }
+  }
+  p = calloc(1, sizeof(api_profile_endpoint_t));
+  p->url = api_printf("%s", url);
+  LL_APPEND(api_profile_endpoints, p);
+  return p;
+}
+
 static char *api_proto_t_str(api_proto_t p) {
   switch (p) {
   case API_PROTO_HTTP:
     return API_PROTO_HTTP_STR;
   case API_PROTO_HTTPS:
-    return API_PROTO_HTTP_STR;
+    return API_PROTO_HTTPS_STR;
   }
   return NULL;
 }
@@ -153,19 +716,9 @@ static char *api_method_str(api_request_t *req) {
   return NULL;
 }
 
-static void api_add_header(api_request_t *req, char *name, char *val) {
-  UT_string *s;
-
-  utstring_new(s);
-  utstring_printf(s, "%s: %s", name, val);
-  req->headers = curl_slist_append(req->headers, utstring_body(s));
-
-  utstring_free(s);
-}
-
-static void api_add_basic_auth(api_request_t *req, api_basic_auth_t *auth) {
+static char *api_basic_auth_header(api_basic_auth_t *auth) {
   UT_string *s;
-  char *base64;
+  char *base64, *header;
   size_t base64_len;
 
   utstring_new(s);
@@ -173,199 +726,1887 @@ static void api_add_basic_auth(api_request_t *req, api_basic_auth_t *auth) {
   base64 = (char *)base64_encode((const unsigned char *)utstring_body(s),
                                  utstring_len(s), &base64_len);
   utstring_clear(s);
-  utstring_printf(s, "Basic ");
+  utstring_printf(s, "%s: Basic ", API_HEADER_AUTHORIZATION);
   utstring_bincpy(s, base64, base64_len);
-
-  api_add_header(req, API_HEADER_AUTHORIZATION, utstring_body(s));
+  header = api_printf("%s", utstring_body(s));
 
   utstring_free(s);
   free(base64);
+
+  return header;
 }
 
-static void api_add_auth(api_request_t *req) {
-  if (req->endpoint->auth) {
-    switch (req->endpoint->auth->type) {
+static void api_basic_auth_free(api_basic_auth_t *auth) {
+  if (auth) {
+    free(auth->user);
+    free(auth->passwd);
+    free(auth->header);
+    free(auth);
+  }
+}
+
+static void api_oauth2_auth_free(api_oauth2_auth_t *auth) {
+  if (auth) {
+    if (auth->refresh) {
+      curl_multi_remove_handle(api_refresh_multi, auth->refresh);
+      curl_easy_cleanup(auth->refresh);
+      api_refreshes--;
+    }
+    free(auth->token_url);
+    free(auth->token_request);
+    free(auth->header);
+    free(auth->stale_header);
+    free(auth->buf);
+    free(auth);
+  }
+}
+
+static void api_auth_release(lua_State *L, api_auth_t *auth) {
+  if (--auth->refs > 0) {
+    return;
+  }
+  switch (auth->type) {
+  case API_AUTH_BASIC:
+    api_basic_auth_free(auth->basic);
+    break;
+  case API_AUTH_BEARER:
+    if (auth->bearer) {
+      free(auth->bearer->header);
+      free(auth->bearer);
+    }
+    break;
+  case API_AUTH_OAUTH2:
+    api_oauth2_auth_free(auth->oauth2);
+    break;
+  case API_AUTH_SIGV4:
+    if (auth->sigv4) {
+      free(auth->sigv4->access_key);
+      free(auth->sigv4->secret_key);
+      free(auth->sigv4->region);
+      free(auth->sigv4->service);
+      free(auth->sigv4->session_token);
+      free(auth->sigv4);
+    }
+    break;
+  case API_AUTH_JWT:
+    if (auth->jwt) {
+      jwt_key_free(auth->jwt->key);
+      json_decref(auth->jwt->claims);
+      luaL_unref(L, LUA_REGISTRYINDEX, auth->jwt->claims_ref);
+      free(auth->jwt->header);
+      free(auth->jwt);
+    }
+    break;
+  }
+  free(auth);
+}
+
+static char *api_auth_header(api_auth_t *auth) {
+  if (auth) {
+    switch (auth->type) {
     case API_AUTH_BASIC:
-      api_add_basic_auth(req, req->endpoint->auth->basic);
-      break;
+      return auth->basic->header;
+    case API_AUTH_BEARER:
+      return auth->bearer->header;
+    case API_AUTH_OAUTH2:
+      return auth->oauth2->header;
+    case API_AUTH_SIGV4:
+    case API_AUTH_JWT:
+      // signature headers are created for each request
+      return NULL;
     }
   }
+  return NULL;
 }
 
-static size_t api_write_body(char *ptr, size_t n, size_t l,
-                             api_request_t *req) {
-  size_t len = n * l;
+static void api_free_signature(api_request_t *req) {
+  int i;
+
+  for (i = 0; i < API_SIGNATURE_HEADERS; i++) {
+    free(req->signature_headers[i]);
+    req->signature_headers[i] = NULL;
+  }
+}
 
-  req->resp->body = realloc(req->resp->body, req->resp->body_len + len);
-  memcpy(req->resp->body + req->resp->body_len, ptr, len);
-  req->resp->body_len += len;
+/* Signs the request when it is sent. The payload hash is computed only once
+ * and the signing key is cached by the auth. */
+static void api_sign_request(api_request_t *req) {
+  api_auth_t *auth = req->endpoint->auth;
+  char timestamp[SIGV4_TIMESTAMP_LEN + 1], *authorization;
 
-  return len;
+  if (!auth || auth->type != API_AUTH_SIGV4) {
+    return;
+  }
+  api_free_signature(req);
+
+  if (!req->payload_hash[0]) {
+    sigv4_payload_hash(req->body ? req->body : "", req->body_len,
+                       req->payload_hash);
+  }
+  sigv4_timestamp(time(NULL), timestamp);
+  authorization = sigv4_authorization(auth->sigv4, api_method_str(req),
+                                      req->url, req->payload_hash, timestamp);
+
+  req->signature_headers[0] =
+      api_printf("%s: %s", API_HEADER_AUTHORIZATION, authorization);
+  req->signature_headers[1] =
+      api_printf("%s: %s", API_HEADER_AMZ_DATE, timestamp);
+  req->signature_headers[2] =
+      api_printf("%s: %s", API_HEADER_AMZ_CONTENT_SHA256, req->payload_hash);
+  if (auth->sigv4->session_token) {
+    req->signature_headers[3] =
+        api_printf("%s: %s", API_HEADER_AMZ_SECURITY_TOKEN,
+                   auth->sigv4->session_token);
+  }
+  free(authorization);
 }
 
-static size_t api_write_header(char *buf, size_t l, size_t n,
-                               api_request_t *req) {
+static size_t api_oauth2_write(char *ptr, size_t n, size_t l,
+                               api_oauth2_auth_t *auth) {
   size_t len = n * l;
-  char *tmp;
 
-  tmp = malloc(len + 1);
-  memcpy(tmp, buf, len);
-  tmp[len] = 0;
-  req->resp->headers = curl_slist_append(req->resp->headers, tmp);
-  free(tmp);
+  auth->buf = realloc(auth->buf, auth->buf_len + len);
+  memcpy(auth->buf + auth->buf_len, ptr, len);
+  auth->buf_len += len;
 
   return len;
 }
 
-static void api_add_request(CURLM *cm, api_request_t *req, char **err) {
+/* Creates token request (client credentials grant) */
+static CURL *api_oauth2_handle(api_oauth2_auth_t *auth) {
   CURL *c;
 
   c = curl_easy_init();
   if (!c) {
-    *err = api_printf(*err, "Cannot init request");
+    return NULL;
   }
 
-  req->resp = calloc(1, sizeof(api_response_t));
+  free(auth->buf);
+  auth->buf = NULL;
+  auth->buf_len = 0;
 
-  curl_easy_setopt(c, CURLOPT_VERBOSE, (long)req->endpoint->verbose);
-  curl_easy_setopt(c, CURLOPT_WRITEFUNCTION, api_write_body);
-  curl_easy_setopt(c, CURLOPT_WRITEDATA, req);
-  curl_easy_setopt(c, CURLOPT_HEADERFUNCTION, api_write_header);
-  curl_easy_setopt(c, CURLOPT_HEADERDATA, req);
-  req->resp->url = api_printf(
-      "%s://%s%s%s", api_proto_t_str(req->endpoint->proto), req->endpoint->host,
-      req->endpoint->path ? req->endpoint->path : "",
-      req->path ? req->path : "");
-  curl_easy_setopt(c, CURLOPT_URL, req->resp->url);
-  curl_easy_setopt(c, CURLOPT_PRIVATE, req);
+  curl_easy_setopt(c, CURLOPT_URL, auth->token_url);
+  curl_easy_setopt(c, CURLOPT_POSTFIELDS, auth->token_request);
+  curl_easy_setopt(c, CURLOPT_WRITEFUNCTION, api_oauth2_write);
+  curl_easy_setopt(c, CURLOPT_WRITEDATA, auth);
+  curl_easy_setopt(c, CURLOPT_TIMEOUT, API_OAUTH2_TIMEOUT);
+  curl_easy_setopt(c, CURLOPT_PRIVATE, auth);
 
-  switch (req->method) {
-  case API_METHOD_GET:
-    break;
-  case API_METHOD_POST:
-    curl_easy_setopt(c, CURLOPT_POST, 1L);
-    curl_easy_setopt(c, CURLOPT_POSTFIELDS, req->body);
-    curl_easy_setopt(c, CURLOPT_POSTFIELDSIZE, (long)req->body_len);
-    break;
-  case API_METHOD_PUT:
-    curl_easy_setopt(c, CURLOPT_POST, 1L);
-    curl_easy_setopt(c, CURLOPT_POSTFIELDS, req->body);
-    curl_easy_setopt(c, CURLOPT_POSTFIELDSIZE, (long)req->body_len);
-    curl_easy_setopt(c, CURLOPT_CUSTOMREQUEST, "PUT");
-    break;
-  case API_METHOD_DELETE:
-    curl_easy_setopt(c, CURLOPT_CUSTOMREQUEST, "DELETE");
-    break;
-  case API_METHOD_CUSTOM:
-    if (req->body) {
-      curl_easy_setopt(c, CURLOPT_POST, 1L);
-      curl_easy_setopt(c, CURLOPT_POSTFIELDS, req->body);
-      curl_easy_setopt(c, CURLOPT_POSTFIELDSIZE, (long)req->body_len);
-    }
-    curl_easy_setopt(c, CURLOPT_CUSTOMREQUEST, req->custom_method);
-    break;
+  return c;
+}
+
+/* Reads the token from finished token request */
+static void api_oauth2_token(api_oauth2_auth_t *auth, CURL *c, CURLcode res,
+                             char **err) {
+  long status;
+  json_t *json, *token, *expires_in;
+  json_error_t json_err;
+  double lifetime, refresh_before;
+
+  if (res != CURLE_OK) {
+    *err = api_printf("oauth2: %s", curl_easy_strerror(res));
+    return;
+  }
+  curl_easy_getinfo(c, CURLINFO_RESPONSE_CODE, &status);
+  if (status != 200) {
+    *err = api_printf("oauth2: token request failed with status %ld", status);
+    return;
   }
 
-  api_add_auth(req);
-  curl_easy_setopt(c, CURLOPT_HTTPHEADER, req->headers);
-  curl_multi_add_handle(cm, c);
+  json = json_loadb(auth->buf, auth->buf_len, 0, &json_err);
+  token = json_object_get(json, "access_token");
+  if (!json_is_string(token)) {
+    *err = api_printf("oauth2: token response without access_token");
+    json_decref(json);
+    return;
+  }
+  expires_in = json_object_get(json, "expires_in");
+  lifetime = json_is_number(expires_in) ? json_number_value(expires_in)
+                                        : API_OAUTH2_EXPIRES_IN;
+
+  free(auth->stale_header);
+  auth->stale_header = auth->header;
+  auth->header = api_printf("%s: Bearer %s", API_HEADER_AUTHORIZATION,
+                            json_string_value(token));
+  refresh_before = auth->refresh_before < lifetime / 2 ? auth->refresh_before
+                                                       : lifetime / 2;
+  auth->expires = api_now() + lifetime;
+  auth->refresh_at = auth->expires - refresh_before;
+
+  json_decref(json);
 }
 
-static void api_send_requests(api_request_t *head, char **err) {
-  CURLM *cm;
+/* Progresses background token refreshes without waiting for them */
+static void api_refresh_perform(void) {
+  api_oauth2_auth_t *auth;
   CURLMsg *msg;
-  int running = 1;
-  int msgs_left = -1;
-  api_request_t *req;
+  int running, msgs_left;
+  char *err = NULL;
 
-  cm = curl_multi_init();
-  if (!cm) {
-    *err = api_printf("Cannot init transfer");
+  if (!api_refresh_multi) {
     return;
   }
+  curl_multi_perform(api_refresh_multi, &running);
+  while ((msg = curl_multi_info_read(api_refresh_multi, &msgs_left))) {
+    curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &auth);
+    // on failure the current token is kept until it expires
+    api_oauth2_token(auth, msg->easy_handle, msg->data.result, &err);
+    free(err);
+    err = NULL;
+    curl_multi_remove_handle(api_refresh_multi, msg->easy_handle);
+    curl_easy_cleanup(msg->easy_handle);
+    auth->refresh = NULL;
+    api_refreshes--;
+  }
+}
 
-  DL_FOREACH(head, req) {
-    api_add_request(cm, req, err);
-    if (*err) {
-      return;
-    }
+/* Fetches a token synchronously if there is no valid token. Refresh of
+ * the expired token is waited for instead of starting another request. */
+static void api_prepare_auth(api_auth_t *auth, char **err) {
+  CURL *c;
+  CURLcode res;
+  api_phase_t prev;
+
+  if (!auth || auth->type != API_AUTH_OAUTH2) {
+    return;
+  }
+  if (auth->oauth2->header && api_now() < auth->oauth2->expires) {
+    return;
   }
 
-  while (running) {
-    curl_multi_perform(cm, &running);
+  prev = api_phase_enter(API_PHASE_WAIT);
+  while (auth->oauth2->refresh) {
+    curl_multi_wait(api_refresh_multi, NULL, 0, 100, NULL);
+    api_refresh_perform();
+  }
+  api_phase_leave(prev);
+  if (auth->oauth2->header && api_now() < auth->oauth2->expires) {
+    return;
+  }
 
-    while ((msg = curl_multi_info_read(cm, &msgs_left))) {
-      CURL *c = msg->easy_handle;
-      api_request_t *req;
-      curl_easy_getinfo(c, CURLINFO_PRIVATE, &req);
-      curl_easy_getinfo(c, CURLINFO_TOTAL_TIME, &req->resp->total_time);
-      if (msg->msg == CURLMSG_DONE) {
-        long status;
-        curl_easy_getinfo(c, CURLINFO_RESPONSE_CODE, &status);
-        req->resp->status = (int)status;
-        if (msg->data.result > 0) {
-          req->resp->err =
-              api_printf("%s", curl_easy_strerror(msg->data.result));
-        }
-        curl_multi_remove_handle(cm, c);
-        curl_easy_cleanup(c);
-      } else {
-        req->resp->err = api_printf("Unexpected message type: %d", msg->msg);
-      }
+  c = api_oauth2_handle(auth->oauth2);
+  if (!c) {
+    *err = api_printf("Cannot init token request");
+    return;
+  }
+  prev = api_phase_enter(API_PHASE_WAIT);
+  res = curl_easy_perform(c);
+  api_phase_leave(prev);
+  api_oauth2_token(auth->oauth2, c, res, err);
+  curl_easy_cleanup(c);
+}
+
+/* Starts a token refresh in background, if the token expires soon. Requests
+ * keep using the current token until the new one arrives. */
+static void api_refresh_auth(api_auth_t *auth) {
+  if (!auth || auth->type != API_AUTH_OAUTH2) {
+    return;
+  }
+  if (auth->oauth2->refresh || api_now() < auth->oauth2->refresh_at) {
+    return;
+  }
+
+  if (!api_refresh_multi) {
+    api_refresh_multi = curl_multi_init();
+    if (!api_refresh_multi) {
+      return;
     }
-    if (running) {
-      curl_multi_wait(cm, NULL, 0, 100, NULL);
+  }
+  auth->oauth2->refresh = api_oauth2_handle(auth->oauth2);
+  if (auth->oauth2->refresh) {
+    curl_multi_add_handle(api_refresh_multi, auth->oauth2->refresh);
+    api_refreshes++;
+  }
+}
+
+/* Links implicit headers in front of the request headers. The list nodes are
+ * owned by the request, so nothing is allocated when the request is sent. */
+static struct curl_slist *api_link_headers(api_request_t *req) {
+  const char *implicit[API_IMPLICIT_HEADERS];
+  struct curl_slist *head = req->headers;
+  int i;
+
+  implicit[0] = req->content_type;
+  implicit[1] = req->content_encoding;
+  implicit[2] = api_auth_header(req->endpoint->auth);
+  for (i = 0; i < API_SIGNATURE_HEADERS; i++) {
+    implicit[3 + i] = req->signature_headers[i];
+  }
+  for (i = 0; i < API_VALIDATOR_HEADERS; i++) {
+    implicit[3 + API_SIGNATURE_HEADERS + i] = req->validator_headers[i];
+  }
+  for (i = 0; i < API_IMPLICIT_HEADERS; i++) {
+    if (implicit[i]) {
+      req->implicit_headers[i].data = (char *)implicit[i];
+      req->implicit_headers[i].next = head;
+      head = &req->implicit_headers[i];
     }
   }
 
-  curl_multi_cleanup(cm);
+  return head;
 }
 
-static int api_endpoint_gc(lua_State *L) {
-  api_endpoint_t *ep = lua_touserdata(L, -1);
-
-  free(ep->handle_response_chunk);
-  if (ep->auth) {
-    switch (ep->auth->type) {
-    case API_AUTH_BASIC:
-      if (ep->auth->basic) {
-        free(ep->auth->basic->user);
-        free(ep->auth->basic->passwd);
-        free(ep->auth->basic);
-      }
-      break;
+static void api_response_free(api_response_t *resp) {
+  if (resp) {
+    curl_slist_free_all(resp->headers);
+    if (resp->map) {
+      diskcache_unmap(resp->map, resp->map_len);
+    } else {
+      free(resp->body);
     }
-    free(ep->auth);
+    free(resp->err);
+    free(resp);
   }
-  free(ep->host);
-  free(ep->path);
-
-  return 0;
 }
 
-static int api_request_gc(lua_State *L) {
-  api_request_t *req = lua_touserdata(L, -1);
+/* Returns pseudo-random number in [0, 1). It doesn't use rand() to keep
+ * the sequence of math.random intact. */
+static double api_random(void) {
+  static uint64_t x;
 
-  free(req->custom_method);
-  free(req->path);
-  curl_slist_free_all(req->headers);
-  free(req->body);
-  free(req->handle_response_chunk);
-  if (req->resp) {
-    curl_slist_free_all(req->resp->headers);
-    free(req->resp->body);
-    free(req->resp->err);
-    free(req->resp->url);
-    free(req->resp);
+  if (!x) {
+    x = (uint64_t)time(NULL) ^ (uint64_t)(uintptr_t)&x;
+    x |= 1;
   }
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return (x >> 11) * (1.0 / 9007199254740992.0);
+}
 
-  return 0;
+static void api_retry_free(api_retry_t *retry) {
+  if (retry) {
+    free(retry->statuses);
+    free(retry);
+  }
 }
 
-static void api_read_json(lua_State *L, json_t *json) {
-  json_t *value;
-  const char *key;
-  size_t i;
+static int api_retry_idempotent(api_request_t *req) {
+  switch (req->method) {
+  case API_METHOD_GET:
+  case API_METHOD_PUT:
+  case API_METHOD_DELETE:
+    return 1;
+  case API_METHOD_CUSTOM:
+    return strcmp(req->custom_method, "HEAD") == 0 ||
+           strcmp(req->custom_method, "OPTIONS") == 0;
+  default:
+    return 0;
+  }
+}
+
+/* A timed out request may have reached the server, so it is re-sent only if
+ * that is safe, unless the script asked for 'timeout' explicitly. */
+static int api_retry_on(api_retry_t *retry, api_request_t *req, int status,
+                        CURLcode res) {
+  int i;
+
+  switch (res) {
+  case CURLE_OK:
+    for (i = 0; i < retry->statuses_len; i++) {
+      if (retry->statuses[i] == status) {
+        return 1;
+      }
+    }
+    return 0;
+  case CURLE_OPERATION_TIMEDOUT:
+    if (retry->errors & (API_RETRY_TIMEOUT | API_RETRY_ERROR)) {
+      return 1;
+    }
+    return (retry->errors & API_RETRY_IDEMPOTENT_TIMEOUT) &&
+           api_retry_idempotent(req);
+  case CURLE_COULDNT_RESOLVE_HOST:
+  case CURLE_COULDNT_CONNECT:
+    return retry->errors & (API_RETRY_CONNECT | API_RETRY_ERROR);
+  default:
+    return retry->errors & API_RETRY_ERROR;
+  }
+}
+
+/* Returns delay in seconds before the next attempt of finished request or -1
+ * if it shouldn't be retried. Retry-After of the response takes precedence
+ * over the backoff, but it is not waited for longer than max_delay. */
+static double api_retry_delay(api_request_t *req, api_response_t *resp,
+                              CURLcode res) {
+  api_retry_t *retry = req->retry ? req->retry : req->endpoint->retry;
+  curl_off_t retry_after = 0;
+  double delay;
+  int i;
+
+  if (!retry || req->attempts > retry->max ||
+      !api_retry_on(retry, req, resp->status, res)) {
+    return -1;
+  }
+
+  curl_easy_getinfo(resp->c, CURLINFO_RETRY_AFTER, &retry_after);
+  if (retry_after > 0) {
+    return retry_after <= retry->max_delay ? (double)retry_after : -1;
+  }
+
+  switch (retry->backoff) {
+  case API_BACKOFF_NONE:
+    return 0;
+  case API_BACKOFF_FIXED:
+    delay = retry->delay;
+    break;
+  case API_BACKOFF_EXP:
+  default:
+    delay = retry->delay;
+    for (i = 1; i < req->attempts && delay < retry->max_delay; i++) {
+      delay *= 2;
+    }
+    break;
+  }
+  if (delay > retry->max_delay) {
+    delay = retry->max_delay;
+  }
+  if (retry->jitter) {
+    delay = delay / 2 + api_random() * delay / 2;
+  }
+  return delay;
+}
+
+static void api_timers_set(api_timers_t *t, int i, api_request_t *req) {
+  t->items[i] = req;
+  req->timer = i + 1;
+}
+
+static void api_timers_up(api_timers_t *t, int i) {
+  api_request_t *req = t->items[i];
+  int parent;
+
+  while (i > 0) {
+    parent = (i - 1) / 2;
+    if (t->items[parent]->due <= req->due) {
+      break;
+    }
+    api_timers_set(t, i, t->items[parent]);
+    i = parent;
+  }
+  api_timers_set(t, i, req);
+}
+
+static void api_timers_down(api_timers_t *t, int i) {
+  api_request_t *req = t->items[i];
+  int child;
+
+  while ((child = 2 * i + 1) < t->len) {
+    if (child + 1 < t->len &&
+        t->items[child + 1]->due < t->items[child]->due) {
+      child++;
+    }
+    if (req->due <= t->items[child]->due) {
+      break;
+    }
+    api_timers_set(t, i, t->items[child]);
+    i = child;
+  }
+  api_timers_set(t, i, req);
+}
+
+/* Schedules the request at its due time */
+static void api_timers_add(api_timers_t *t, api_request_t *req) {
+  if (t->len == t->size) {
+    t->size = t->size ? t->size * 2 : 16;
+    t->items = realloc(t->items, t->size * sizeof(api_request_t *));
+  }
+  t->items[t->len++] = req;
+  api_timers_up(t, t->len - 1);
+}
+
+static void api_timers_remove(api_timers_t *t, api_request_t *req) {
+  int i = req->timer - 1;
+
+  if (!req->timer) {
+    return;
+  }
+  req->timer = 0;
+  if (i == --t->len) {
+    return;
+  }
+  t->items[i] = t->items[t->len];
+  api_timers_down(t, i);
+  api_timers_up(t, t->items[i]->timer - 1);
+}
+
+static void api_hedge_free(api_hedge_t *hedge) { free(hedge); }
+
+/* Takes a token of the endpoint and returns how long the request has to wait
+ * for it. Requests are spaced by the rate, so each one waits exactly once. */
+static double api_rate_acquire(api_rate_limit_t *rate, double now) {
+  double rps, at;
+
+  if (!rate) {
+    return 0;
+  }
+  rps = rate->rps;
+  if (now < rate->server_until && rate->server_rps < rps) {
+    rps = rate->server_rps;
+  }
+
+  if (now > rate->last) {
+    rate->tokens += (now - rate->last) * rps;
+    if (rate->tokens > rate->burst) {
+      rate->tokens = rate->burst;
+    }
+    rate->last = now;
+  }
+  rate->tokens--;
+
+  at = rate->last + (rate->tokens < 0 ? -rate->tokens / rps : 0);
+  return at > now ? at - now : 0;
+}
+
+/* Returns the slot taken by a request, which isn't sent */
+static void api_rate_release(api_rate_limit_t *rate) {
+  if (rate && rate->tokens < rate->burst) {
+    rate->tokens++;
+  }
+}
+
+/* Pauses the endpoint until time until */
+static void api_rate_pause(api_rate_limit_t *rate, double until) {
+  if (until > rate->last) {
+    rate->last = until;
+    rate->tokens = 0;
+  }
+}
+
+static void api_breaker_free(api_breaker_t *breaker) {
+  if (breaker) {
+    free(breaker->failed_at);
+    free(breaker);
+  }
+}
+
+static void api_breaker_open(api_breaker_t *breaker, double now) {
+  breaker->state = API_BREAKER_OPEN;
+  breaker->opened_at = now;
+}
+
+/* Returns true if the breaker is open and stays open at time now */
+static int api_breaker_rejects(api_breaker_t *breaker, double now) {
+  return breaker && breaker->state == API_BREAKER_OPEN &&
+         now < breaker->opened_at + breaker->cooldown;
+}
+
+/* Returns whether an attempt of the request may be sent. Hedges are sent only
+ * by closed breaker. */
+static int api_breaker_allow(api_breaker_t *breaker, api_request_t *req,
+                             int hedge, double now) {
+  if (!breaker) {
+    return 1;
+  }
+  if (breaker->state == API_BREAKER_OPEN &&
+      now >= breaker->opened_at + breaker->cooldown) {
+    breaker->state = API_BREAKER_HALF_OPEN;
+    breaker->probing = 0;
+  }
+  switch (breaker->state) {
+  case API_BREAKER_CLOSED:
+    return 1;
+  case API_BREAKER_HALF_OPEN:
+    if (!hedge && !req->probe && breaker->probing < breaker->probes) {
+      breaker->probing++;
+      req->probe = 1;
+      return 1;
+    }
+    return 0;
+  case API_BREAKER_OPEN:
+  default:
+    return 0;
+  }
+}
+
+/* Records result of a finished attempt. Transport errors and server errors
+ * are failures. */
+static void api_breaker_record(api_breaker_t *breaker, api_request_t *req,
+                               api_response_t *resp, double now) {
+  int failed = resp->err || resp->status >= 500;
+
+  if (!breaker) {
+    return;
+  }
+  if (req->probe) {
+    req->probe = 0;
+    breaker->probing--;
+    if (breaker->state == API_BREAKER_HALF_OPEN) {
+      if (failed) {
+        api_breaker_open(breaker, now);
+      } else if (!breaker->probing) {
+        breaker->state = API_BREAKER_CLOSED;
+        memset(breaker->failed_at, 0, breaker->failures * sizeof(double));
+      }
+      return;
+    }
+  }
+  if (!failed || breaker->state != API_BREAKER_CLOSED) {
+    return;
+  }
+
+  // the oldest failure is overwritten, the breaker opens if it is recent
+  breaker->failed_at[breaker->failed_pos] = now;
+  breaker->failed_pos = (breaker->failed_pos + 1) % breaker->failures;
+  if (breaker->failed_at[breaker->failed_pos] > 0 &&
+      now - breaker->failed_at[breaker->failed_pos] <= breaker->window) {
+    api_breaker_open(breaker, now);
+  }
+}
+
+/* Returns value of response header or NULL */
+static const char *api_response_header(api_response_t *resp,
+                                       const char *name) {
+  struct curl_slist *h;
+  size_t len = strlen(name);
+  const char *v;
+
+  for (h = resp->headers; h; h = h->next) {
+    if (strncasecmp(h->data, name, len) == 0 && h->data[len] == ':') {
+      for (v = h->data + len + 1; *v == ' ' || *v == '\t'; v++)
+        ;
+      return v;
+    }
+  }
+  return NULL;
+}
+
+/* Adapts pacing of the endpoint to Retry-After and X-RateLimit headers */
+static void api_rate_update(api_rate_limit_t *rate, api_response_t *resp,
+                            double now) {
+  curl_off_t retry_after = 0;
+  const char *remaining, *reset;
+  double left, window;
+
+  if (!rate) {
+    return;
+  }
+
+  curl_easy_getinfo(resp->c, CURLINFO_RETRY_AFTER, &retry_after);
+  if (retry_after > 0) {
+    api_rate_pause(rate, now + retry_after);
+  }
+
+  remaining = api_response_header(resp, API_HEADER_RATELIMIT_REMAINING);
+  reset = api_response_header(resp, API_HEADER_RATELIMIT_RESET);
+  if (!remaining || !reset) {
+    return;
+  }
+  left = strtod(remaining, NULL);
+  window = strtod(reset, NULL);
+  if (window > 1e9) {
+    // epoch time instead of seconds
+    window -= time(NULL);
+  }
+  if (window <= 0) {
+    return;
+  }
+  if (left < 1) {
+    api_rate_pause(rate, now + window);
+  } else {
+    rate->server_rps = left / window;
+    rate->server_until = now + window;
+  }
+}
+
+static int api_latency_cmp(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+static void api_record_latency(api_endpoint_t *ep, double latency) {
+  ep->latencies[ep->latencies_pos] = latency;
+  ep->latencies_pos = (ep->latencies_pos + 1) % API_LATENCY_SAMPLES;
+  if (ep->latencies_len < API_LATENCY_SAMPLES) {
+    ep->latencies_len++;
+  }
+  ep->latencies_new++;
+}
+
+static api_stats_t *api_stats_create(const char *url) {
+  api_stats_t *stats = calloc(1, sizeof(api_stats_t));
+
+  stats->url = api_printf("%s", url);
+  pthread_mutex_lock(&api_stats_lock);
+  LL_APPEND(api_stats_list, stats);
+  pthread_mutex_unlock(&api_stats_lock);
+  return stats;
+}
+
+static void api_stats_free(api_stats_t *stats) {
+  if (!stats) {
+    return;
+  }
+  pthread_mutex_lock(&api_stats_lock);
+  LL_DELETE(api_stats_list, stats);
+  pthread_mutex_unlock(&api_stats_lock);
+  free(stats->url);
+  free(stats);
+}
+
+static void api_stats_start(api_stats_t *stats) {
+  if (stats) {
+    pthread_mutex_lock(&api_stats_lock);
+    stats->in_flight++;
+    pthread_mutex_unlock(&api_stats_lock);
+  }
+}
+
+static void api_stats_cancel(api_stats_t *stats) {
+  if (stats) {
+    pthread_mutex_lock(&api_stats_lock);
+    stats->in_flight--;
+    pthread_mutex_unlock(&api_stats_lock);
+  }
+}
+
+static api_error_kind api_error_kind_of(CURLcode res) {
+  switch (res) {
+  case CURLE_OPERATION_TIMEDOUT:
+    return API_ERROR_TIMEOUT;
+  case CURLE_COULDNT_RESOLVE_HOST:
+  case CURLE_COULDNT_RESOLVE_PROXY:
+    return API_ERROR_DNS;
+  case CURLE_COULDNT_CONNECT:
+    return API_ERROR_CONNECT;
+  case CURLE_SSL_CONNECT_ERROR:
+  case CURLE_PEER_FAILED_VERIFICATION:
+  case CURLE_SSL_CERTPROBLEM:
+  case CURLE_SSL_CIPHER:
+  case CURLE_SSL_CACERT_BADFILE:
+    return API_ERROR_TLS;
+  default:
+    return API_ERROR_OTHER;
+  }
+}
+
+/* Counts finished attempt, latency is observed for attempts with a response */
+static void api_stats_done(api_stats_t *stats, api_response_t *resp,
+                           CURLcode res) {
+  curl_off_t uploaded = 0;
+  int i;
+
+  if (!stats) {
+    return;
+  }
+  curl_easy_getinfo(resp->c, CURLINFO_SIZE_UPLOAD_T, &uploaded);
+  pthread_mutex_lock(&api_stats_lock);
+  stats->requests++;
+  stats->in_flight--;
+  stats->bytes_in += resp->size_download;
+  stats->bytes_out += uploaded;
+  if (resp->err) {
+    stats->errors[res ? api_error_kind_of(res) : API_ERROR_OTHER]++;
+  } else {
+    if (resp->status >= 100 && resp->status < 600) {
+      stats->statuses[resp->status / 100 - 1]++;
+    }
+    for (i = 0; i < API_STATS_BUCKETS; i++) {
+      if (resp->total_time <= api_stats_bounds[i]) {
+        break;
+      }
+    }
+    stats->buckets[i]++;
+    stats->latency_sum += resp->total_time;
+  }
+  pthread_mutex_unlock(&api_stats_lock);
+}
+
+/* Takes a lane for the attempt */
+static void api_timeline_start(api_response_t *resp) {
+  int i;
+
+  if (!api_timeline) {
+    return;
+  }
+  for (i = 0; i < api_timeline_lanes_len && api_timeline_lanes[i]; i++) {
+  }
+  if (i == api_timeline_lanes_len) {
+    api_timeline_lanes_len = api_timeline_lanes_len * 2 + 16;
+    api_timeline_lanes = realloc(api_timeline_lanes, api_timeline_lanes_len);
+    memset(api_timeline_lanes + i, 0, api_timeline_lanes_len - i);
+  }
+  api_timeline_lanes[i] = 1;
+  resp->lane = i + 1;
+  resp->started = api_now();
+  timeline_counter(api_timeline, "in_flight", resp->started,
+                   ++api_timeline_in_flight);
+}
+
+/* Adds slice of the attempt with its phases and frees its lane. Timings of
+ * libcurl are relative to the start of the attempt. */
+static void api_timeline_done(api_response_t *resp, const char *name) {
+  CURL *c = resp->c;
+  double t = resp->started, dns = 0, connect = 0, tls = 0, pretransfer = 0,
+         ttfb = 0, end = api_now();
+  char label[TIMELINE_NAME_LEN];
+
+  if (!resp->lane) {
+    return;
+  }
+  if (name) {
+    // cancelled attempt has no timings
+    timeline_slice(api_timeline, name, "request", resp->lane, t, end, 0);
+  } else {
+    curl_easy_getinfo(c, CURLINFO_NAMELOOKUP_TIME, &dns);
+    curl_easy_getinfo(c, CURLINFO_CONNECT_TIME, &connect);
+    curl_easy_getinfo(c, CURLINFO_APPCONNECT_TIME, &tls);
+    curl_easy_getinfo(c, CURLINFO_PRETRANSFER_TIME, &pretransfer);
+    curl_easy_getinfo(c, CURLINFO_STARTTRANSFER_TIME, &ttfb);
+    snprintf(label, sizeof(label), "%s %s", api_method_str(resp->req),
+             resp->req->url);
+    timeline_slice(api_timeline, label, "request", resp->lane, t,
+                   t + resp->total_time, resp->status);
+    if (dns > 0) {
+      timeline_slice(api_timeline, "dns", "http", resp->lane, t, t + dns, 0);
+    }
+    if (connect > dns) {
+      timeline_slice(api_timeline, "connect", "http", resp->lane, t + dns,
+                     t + connect, 0);
+    }
+    if (tls > connect) {
+      timeline_slice(api_timeline, "tls", "http", resp->lane, t + connect,
+                     t + tls, 0);
+    }
+    if (ttfb > pretransfer) {
+      timeline_slice(api_timeline, "ttfb", "http", resp->lane, t + pretransfer,
+                     t + ttfb, 0);
+    }
+    if (resp->total_time > ttfb && ttfb > 0) {
+      timeline_slice(api_timeline, "transfer", "http", resp->lane, t + ttfb,
+                     t + resp->total_time, 0);
+    }
+  }
+  api_timeline_lanes[resp->lane - 1] = 0;
+  resp->lane = 0;
+  timeline_counter(api_timeline, "in_flight", end, --api_timeline_in_flight);
+}
+
+/* Appends label of the endpoint, quotes and backslashes are escaped */
+static void api_metrics_label(UT_string *s, const char *url) {
+  utstring_printf(s, "{endpoint=\"");
+  for (; *url; url++) {
+    if (*url == '"' || *url == '\\') {
+      utstring_printf(s, "\\");
+    }
+    utstring_printf(s, "%c", *url);
+  }
+  utstring_printf(s, "\"");
+}
+
+/* Appends OpenMetrics text of stats of all endpoints with stats enabled */
+static void api_metrics_text(UT_string *s) {
+  api_stats_t *st;
+  long count;
+  int i;
+
+  pthread_mutex_lock(&api_stats_lock);
+  utstring_printf(s, "# TYPE apinette_requests counter\n"
+                     "# HELP apinette_requests Finished attempts.\n");
+  LL_FOREACH(api_stats_list, st) {
+    utstring_printf(s, "apinette_requests_total");
+    api_metrics_label(s, st->url);
+    utstring_printf(s, "} %ld\n", st->requests);
+  }
+  utstring_printf(s, "# TYPE apinette_in_flight gauge\n"
+                     "# HELP apinette_in_flight Attempts in flight.\n");
+  LL_FOREACH(api_stats_list, st) {
+    utstring_printf(s, "apinette_in_flight");
+    api_metrics_label(s, st->url);
+    utstring_printf(s, "} %ld\n", st->in_flight);
+  }
+  utstring_printf(s, "# TYPE apinette_errors counter\n"
+                     "# HELP apinette_errors Transport errors by kind.\n");
+  LL_FOREACH(api_stats_list, st) {
+    for (i = 0; i < API_ERROR_KINDS; i++) {
+      utstring_printf(s, "apinette_errors_total");
+      api_metrics_label(s, st->url);
+      utstring_printf(s, ",kind=\"%s\"} %ld\n", api_error_kind_names[i],
+                      st->errors[i]);
+    }
+  }
+  utstring_printf(s, "# TYPE apinette_responses counter\n"
+                     "# HELP apinette_responses Responses by status class.\n");
+  LL_FOREACH(api_stats_list, st) {
+    for (i = 0; i < 5; i++) {
+      utstring_printf(s, "apinette_responses_total");
+      api_metrics_label(s, st->url);
+      utstring_printf(s, ",class=\"%dxx\"} %ld\n", i + 1, st->statuses[i]);
+    }
+  }
+  utstring_printf(s, "# TYPE apinette_received_bytes counter\n"
+                     "# UNIT apinette_received_bytes bytes\n");
+  LL_FOREACH(api_stats_list, st) {
+    utstring_printf(s, "apinette_received_bytes_total");
+    api_metrics_label(s, st->url);
+    utstring_printf(s, "} %" CURL_FORMAT_CURL_OFF_T "\n", st->bytes_in);
+  }
+  utstring_printf(s, "# TYPE apinette_sent_bytes counter\n"
+                     "# UNIT apinette_sent_bytes bytes\n");
+  LL_FOREACH(api_stats_list, st) {
+    utstring_printf(s, "apinette_sent_bytes_total");
+    api_metrics_label(s, st->url);
+    utstring_printf(s, "} %" CURL_FORMAT_CURL_OFF_T "\n", st->bytes_out);
+  }
+  utstring_printf(s, "# TYPE apinette_latency_seconds histogram\n"
+                     "# UNIT apinette_latency_seconds seconds\n");
+  LL_FOREACH(api_stats_list, st) {
+    count = 0;
+    for (i = 0; i <= API_STATS_BUCKETS; i++) {
+      count += st->buckets[i];
+      utstring_printf(s, "apinette_latency_seconds_bucket");
+      api_metrics_label(s, st->url);
+      if (i < API_STATS_BUCKETS) {
+        utstring_printf(s, ",le=\"%g\"} %ld\n", api_stats_bounds[i], count);
+      } else {
+        utstring_printf(s, ",le=\"+Inf\"} %ld\n", count);
+      }
+    }
+    utstring_printf(s, "apinette_latency_seconds_count");
+    api_metrics_label(s, st->url);
+    utstring_printf(s, "} %ld\n", count);
+    utstring_printf(s, "apinette_latency_seconds_sum");
+    api_metrics_label(s, st->url);
+    utstring_printf(s, "} %.6f\n", st->latency_sum);
+  }
+  pthread_mutex_unlock(&api_stats_lock);
+  utstring_printf(s, "# EOF\n");
+}
+
+/* Returns delay of the next hedge of the request or -1 if it shouldn't be
+ * hedged. Percentile of endpoint latency is cached until enough new samples
+ * are recorded. */
+static double api_hedge_delay(api_request_t *req) {
+  api_endpoint_t *ep = req->endpoint;
+  api_hedge_t *hedge = req->hedge ? req->hedge : ep->hedge;
+  double sorted[API_LATENCY_SAMPLES];
+  api_response_t *resp;
+  int inflight, i;
+
+  // only idempotent requests are hedged
+  if (!hedge || (req->method != API_METHOD_GET &&
+                 req->method != API_METHOD_PUT &&
+                 req->method != API_METHOD_DELETE)) {
+    return -1;
+  }
+  LL_COUNT(req->inflight, resp, inflight);
+  if (inflight > hedge->max_extra) {
+    return -1;
+  }
+  if (!hedge->percentile) {
+    return hedge->after;
+  }
+
+  if (ep->latencies_len < API_HEDGE_MIN_SAMPLES) {
+    return -1;
+  }
+  if (ep->hedge_percentile != hedge->percentile ||
+      ep->latencies_new >= API_HEDGE_RECOMPUTE) {
+    memcpy(sorted, ep->latencies, ep->latencies_len * sizeof(double));
+    qsort(sorted, ep->latencies_len, sizeof(double), api_latency_cmp);
+    // nearest rank
+    i = (int)(hedge->percentile * ep->latencies_len);
+    if (i < hedge->percentile * ep->latencies_len) {
+      i++;
+    }
+    ep->hedge_threshold = sorted[i > 0 ? i - 1 : 0];
+    ep->hedge_percentile = hedge->percentile;
+    ep->latencies_new = 0;
+  }
+  return ep->hedge_threshold;
+}
+
+/* Schedules the next hedge of the request */
+static void api_arm_hedge(api_timers_t *timers, api_request_t *req,
+                          double now) {
+  double delay = api_hedge_delay(req);
+
+  if (delay >= 0) {
+    req->due = now + delay;
+    api_timers_add(timers, req);
+  }
+}
+
+/* Cancels all attempts of the request in flight */
+static void api_cancel_attempts(CURLM *cm, api_request_t *req) {
+  api_response_t *resp, *tmp;
+
+  LL_FOREACH_SAFE(req->inflight, resp, tmp) {
+    LL_DELETE(req->inflight, resp);
+    api_stats_cancel(req->endpoint->stats);
+    api_timeline_done(resp, "cancelled");
+    curl_multi_remove_handle(cm, resp->c);
+    curl_easy_cleanup(resp->c);
+    api_response_free(resp);
+  }
+}
+
+static void api_set_accept_encoding(CURL *c, api_request_t *req) {
+  char *encoding;
+
+  encoding = req->accept_encoding ? req->accept_encoding
+                                  : req->endpoint->accept_encoding;
+  if (encoding && !req->uncompressed) {
+    // curl decodes the body before it reaches api_write_body
+    curl_easy_setopt(c, CURLOPT_ACCEPT_ENCODING, encoding);
+  }
+}
+
+static size_t api_write_body(char *ptr, size_t n, size_t l, void *data) {
+  api_response_t *resp = data;
+  size_t len = n * l;
+
+  resp->body = realloc(resp->body, resp->body_len + len);
+  memcpy(resp->body + resp->body_len, ptr, len);
+  resp->body_len += len;
+
+  return len;
+}
+
+static size_t api_write_header(char *buf, size_t l, size_t n, void *data) {
+  api_response_t *resp = data;
+  size_t len = n * l;
+  char *tmp;
+
+  tmp = malloc(len + 1);
+  memcpy(tmp, buf, len);
+  tmp[len] = 0;
+  resp->headers = curl_slist_append(resp->headers, tmp);
+  free(tmp);
+
+  return len;
+}
+
+static void api_set_limits(CURL *c, api_request_t *req) {
+  api_limits_t *r = &req->limits, *e = &req->endpoint->limits;
+
+  if (r->timeout || e->timeout) {
+    curl_easy_setopt(c, CURLOPT_TIMEOUT_MS,
+                     r->timeout ? r->timeout : e->timeout);
+  }
+  if (r->connect_timeout || e->connect_timeout) {
+    curl_easy_setopt(c, CURLOPT_CONNECTTIMEOUT_MS,
+                     r->connect_timeout ? r->connect_timeout
+                                        : e->connect_timeout);
+  }
+  if (r->low_speed_time || e->low_speed_time) {
+    r = r->low_speed_time ? r : e;
+    curl_easy_setopt(c, CURLOPT_LOW_SPEED_LIMIT, r->low_speed_limit);
+    curl_easy_setopt(c, CURLOPT_LOW_SPEED_TIME, r->low_speed_time);
+  }
+}
+
+/* Starts an attempt of the request. Hedge is a duplicate of the attempt in
+ * flight, it shares its headers and signature. */
+static void api_add_request(CURLM *cm, api_request_t *req, int hedge,
+                            char **err) {
+  api_response_t *resp;
+  CURL *c;
+
+  c = curl_easy_init();
+  if (!c) {
+    *err = api_printf("Cannot init request");
+    return;
+  }
+
+  resp = calloc(1, sizeof(api_response_t));
+  resp->req = req;
+  resp->c = c;
+  LL_PREPEND(req->inflight, resp);
+  if (hedge) {
+    req->hedges++;
+  } else {
+    api_response_free(req->resp);
+    req->resp = NULL;
+    req->attempts++;
+    api_sign_request(req);
+  }
+
+  curl_easy_setopt(c, CURLOPT_VERBOSE, (long)req->endpoint->verbose);
+  if (req->endpoint->ca_file) {
+    curl_easy_setopt(c, CURLOPT_CAINFO, req->endpoint->ca_file);
+  }
+  if (req->endpoint->http2) {
+    // plain http has to assume the server speaks HTTP/2 (h2c)
+    curl_easy_setopt(c, CURLOPT_HTTP_VERSION,
+                     req->endpoint->proto == API_PROTO_HTTP
+                         ? (long)CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE
+                         : (long)CURL_HTTP_VERSION_2TLS);
+    // parallel requests wait to be multiplexed over one connection
+    curl_easy_setopt(c, CURLOPT_PIPEWAIT, 1L);
+  }
+  curl_easy_setopt(c, CURLOPT_WRITEFUNCTION, api_write_body);
+  curl_easy_setopt(c, CURLOPT_WRITEDATA, resp);
+  curl_easy_setopt(c, CURLOPT_HEADERFUNCTION, api_write_header);
+  curl_easy_setopt(c, CURLOPT_HEADERDATA, resp);
+  curl_easy_setopt(c, CURLOPT_URL, req->url);
+  curl_easy_setopt(c, CURLOPT_PRIVATE, resp);
+  api_set_accept_encoding(c, req);
+  api_set_limits(c, req);
+
+  switch (req->method) {
+  case API_METHOD_GET:
+  case API_METHOD_DELETE:
+    // body is sent like the one of a custom method
+    if (req->body) {
+      curl_easy_setopt(c, CURLOPT_POST, 1L);
+      curl_easy_setopt(c, CURLOPT_POSTFIELDS, req->body);
+      curl_easy_setopt(c, CURLOPT_POSTFIELDSIZE, (long)req->body_len);
+    }
+    if (req->body || req->method == API_METHOD_DELETE) {
+      curl_easy_setopt(c, CURLOPT_CUSTOMREQUEST, api_method_str(req));
+    }
+    break;
+  case API_METHOD_POST:
+    curl_easy_setopt(c, CURLOPT_POST, 1L);
+    curl_easy_setopt(c, CURLOPT_POSTFIELDS, req->body);
+    curl_easy_setopt(c, CURLOPT_POSTFIELDSIZE, (long)req->body_len);
+    break;
+  case API_METHOD_PUT:
+    curl_easy_setopt(c, CURLOPT_POST, 1L);
+    curl_easy_setopt(c, CURLOPT_POSTFIELDS, req->body);
+    curl_easy_setopt(c, CURLOPT_POSTFIELDSIZE, (long)req->body_len);
+    curl_easy_setopt(c, CURLOPT_CUSTOMREQUEST, "PUT");
+    break;
+  case API_METHOD_CUSTOM:
+    if (req->body) {
+      curl_easy_setopt(c, CURLOPT_POST, 1L);
+      curl_easy_setopt(c, CURLOPT_POSTFIELDS, req->body);
+      curl_easy_setopt(c, CURLOPT_POSTFIELDSIZE, (long)req->body_len);
+    }
+    curl_easy_setopt(c, CURLOPT_CUSTOMREQUEST, req->custom_method);
+    break;
+  }
+
+  curl_easy_setopt(c, CURLOPT_HTTPHEADER, api_link_headers(req));
+  curl_multi_add_handle(cm, c);
+  api_stats_start(req->endpoint->stats);
+  api_timeline_start(resp);
+}
+
+static const char *api_cache_status_str(api_cache_status status) {
+  switch (status) {
+  case API_CACHE_MISS:
+    return "miss";
+  case API_CACHE_HIT:
+    return "hit";
+  case API_CACHE_REVALIDATED:
+    return "revalidated";
+  case API_CACHE_DISK:
+    return "disk";
+  case API_CACHE_NONE:
+    break;
+  }
+  return NULL;
+}
+
+static void api_cached_release(void *value) {
+  api_cached_t *cached = value;
+
+  if (cached && --cached->refs == 0) {
+    curl_slist_free_all(cached->headers);
+    free(cached->body);
+    free(cached->etag);
+    free(cached->last_modified);
+    free(cached->vary);
+    free(cached->vary_key);
+    free(cached);
+  }
+}
+
+static struct curl_slist *api_copy_headers(struct curl_slist *headers,
+                                           size_t *size) {
+  struct curl_slist *copy = NULL;
+
+  for (; headers; headers = headers->next) {
+    copy = curl_slist_append(copy, headers->data);
+    *size += strlen(headers->data) + 1;
+  }
+  return copy;
+}
+
+/* Releases stale response and its validators */
+static void api_cache_forget(api_request_t *req) {
+  int i;
+
+  for (i = 0; i < API_VALIDATOR_HEADERS; i++) {
+    free(req->validator_headers[i]);
+    req->validator_headers[i] = NULL;
+  }
+  api_cached_release(req->cached);
+  req->cached = NULL;
+}
+
+/* Finds directive name in Cache-Control value cc. It returns its argument,
+ * an empty string if it has none or NULL if the directive is missing. */
+static const char *api_cache_directive(const char *cc, const char *name) {
+  size_t len = strlen(name), n;
+  const char *p = cc, *end;
+
+  while (*p) {
+    p += strspn(p, " \t,");
+    n = strcspn(p, " \t=,\r\n");
+    end = p + n;
+    end += strspn(end, " \t");
+    if (n == len && strncasecmp(p, name, len) == 0) {
+      return *end == '=' ? end + 1 + strspn(end + 1, " \t") : "";
+    }
+    if (*end == '=') {
+      // quoted argument may contain commas
+      end += 1 + strspn(end + 1, " \t");
+      if (*end == '"' && !(end = strchr(end + 1, '"'))) {
+        return NULL;
+      }
+    }
+    p = end + strcspn(end, ",\r\n");
+    if (*p != ',') {
+      break;
+    }
+  }
+  return NULL;
+}
+
+/* Returns values of the request headers named by Vary of a response. Response
+ * bodies are stored decoded, so Accept-Encoding set by curl doesn't matter. */
+static char *api_cache_vary_key(api_request_t *req, const char *vary) {
+  struct curl_slist *h;
+  const char *v;
+  UT_string *s;
+  char *key;
+  size_t len;
+
+  utstring_new(s);
+  while (*vary) {
+    vary += strspn(vary, " \t,");
+    len = strcspn(vary, " \t,");
+    if (!len) {
+      break;
+    }
+    for (h = req->headers; h; h = h->next) {
+      if (strncasecmp(h->data, vary, len) == 0 && h->data[len] == ':') {
+        for (v = h->data + len + 1; *v == ' ' || *v == '\t'; v++)
+          ;
+        utstring_printf(s, "%.*s:%s\n", (int)len, vary, v);
+      }
+    }
+    vary += len;
+  }
+  key = api_printf("%s", utstring_body(s));
+  utstring_free(s);
+  return key;
+}
+
+/* Returns freshness lifetime of response in seconds, 0 if it has to be
+ * revalidated or -1 if it mustn't be stored. */
+static double api_cache_lifetime(api_response_t *resp) {
+  const char *cc, *p, *v;
+  time_t expires;
+  double lifetime = -1;
+
+  v = api_response_header(resp, API_HEADER_VARY);
+  if (v && v[0] == '*') {
+    return -1;
+  }
+
+  cc = api_response_header(resp, API_HEADER_CACHE_CONTROL);
+  if (cc) {
+    if (api_cache_directive(cc, "no-store")) {
+      return -1;
+    }
+    if (api_cache_directive(cc, "no-cache")) {
+      return 0;
+    }
+    p = api_cache_directive(cc, "max-age");
+    if (p && *p) {
+      lifetime = strtod(p, NULL);
+    }
+  }
+  if (lifetime < 0) {
+    v = api_response_header(resp, API_HEADER_EXPIRES);
+    if (v && (expires = curl_getdate(v, NULL)) > 0) {
+      lifetime = difftime(expires, time(NULL));
+    }
+  }
+  if (lifetime <= 0) {
+    // stale responses are useful only if they can be revalidated
+    lifetime = api_response_header(resp, API_HEADER_ETAG) ||
+                       api_response_header(resp, API_HEADER_LAST_MODIFIED)
+                   ? 0
+                   : -1;
+  }
+  return lifetime;
+}
+
+/* Copies a header value without the trailing line break */
+static char *api_header_value(api_response_t *resp, const char *name) {
+  const char *v = api_response_header(resp, name);
+  size_t len;
+
+  if (!v) {
+    return NULL;
+  }
+  len = strcspn(v, "\r\n");
+  return api_printf("%.*s", (int)len, v);
+}
+
+/* Serves a fresh response from cache of endpoint or adds validators of a stale
+ * one to the request. It returns 1 if the request doesn't need to be sent. */
+static int api_cache_lookup(api_request_t *req, double now) {
+  cache *c = req->endpoint->cache;
+  api_cached_t *cached;
+  api_response_t *resp;
+  size_t size = 0;
+  char *key;
+  int match;
+
+  api_cache_forget(req);
+  req->cache_status = API_CACHE_NONE;
+  if (!c || req->no_cache || req->method != API_METHOD_GET || req->body) {
+    return 0;
+  }
+
+  req->cache_status = API_CACHE_MISS;
+  cached = cache_get(c, req->url);
+  if (!cached) {
+    return 0;
+  }
+  if (cached->vary) {
+    // a response for other values of the Vary headers is replaced when the
+    // request is stored
+    key = api_cache_vary_key(req, cached->vary);
+    match = strcmp(key, cached->vary_key) == 0;
+    free(key);
+    if (!match) {
+      return 0;
+    }
+  }
+
+  if (now < cached->expires) {
+    resp = calloc(1, sizeof(api_response_t));
+    resp->status = cached->status;
+    resp->headers = api_copy_headers(cached->headers, &size);
+    resp->body = malloc(cached->body_len);
+    memcpy(resp->body, cached->body, cached->body_len);
+    resp->body_len = cached->body_len;
+    resp->size_download = cached->size_download;
+    api_response_free(req->resp);
+    req->resp = resp;
+    req->cache_status = API_CACHE_HIT;
+    return 1;
+  }
+
+  cached->refs++;
+  req->cached = cached;
+  if (cached->etag) {
+    req->validator_headers[0] =
+        api_printf("%s: %s", API_HEADER_IF_NONE_MATCH, cached->etag);
+  }
+  if (cached->last_modified) {
+    req->validator_headers[1] = api_printf(
+        "%s: %s", API_HEADER_IF_MODIFIED_SINCE, cached->last_modified);
+  }
+  return 0;
+}
+
+/* Stores the final response of the request in cache or turns 304 response
+ * into the revalidated one */
+static void api_cache_response(api_request_t *req, double now) {
+  api_response_t *resp = req->resp;
+  api_cached_t *cached = req->cached;
+  double lifetime;
+  size_t size = 0;
+
+  if (req->cache_status == API_CACHE_NONE || resp->err) {
+    api_cache_forget(req);
+    return;
+  }
+
+  if (cached && resp->status == 304) {
+    lifetime = api_cache_lifetime(resp);
+    cached->expires = now + (lifetime > 0 ? lifetime : 0);
+    resp->status = cached->status;
+    curl_slist_free_all(resp->headers);
+    resp->headers = api_copy_headers(cached->headers, &size);
+    free(resp->body);
+    resp->body = malloc(cached->body_len);
+    memcpy(resp->body, cached->body, cached->body_len);
+    resp->body_len = cached->body_len;
+    req->cache_status = API_CACHE_REVALIDATED;
+  } else if (resp->status == 200 && (lifetime = api_cache_lifetime(resp)) >= 0) {
+    cached = calloc(1, sizeof(api_cached_t));
+    cached->refs = 1;
+    cached->status = resp->status;
+    size = sizeof(api_cached_t) + resp->body_len;
+    cached->headers = api_copy_headers(resp->headers, &size);
+    cached->body = malloc(resp->body_len);
+    memcpy(cached->body, resp->body, resp->body_len);
+    cached->body_len = resp->body_len;
+    cached->size_download = resp->size_download;
+    cached->etag = api_header_value(resp, API_HEADER_ETAG);
+    cached->last_modified = api_header_value(resp, API_HEADER_LAST_MODIFIED);
+    cached->vary = api_header_value(resp, API_HEADER_VARY);
+    if (cached->vary) {
+      cached->vary_key = api_cache_vary_key(req, cached->vary);
+      size += strlen(cached->vary) + strlen(cached->vary_key);
+    }
+    cached->expires = now + lifetime;
+    cache_put(req->endpoint->cache, req->url, cached, size);
+  }
+  api_cache_forget(req);
+}
+
+static void api_disk_cache_free(api_disk_cache_t *disk) {
+  int i;
+
+  if (!disk) {
+    return;
+  }
+  diskcache_close(disk->dc);
+  for (i = 0; i < disk->headers_len; i++) {
+    free(disk->headers[i]);
+  }
+  free(disk->headers);
+  free(disk);
+}
+
+/* Key of the request in disk cache is a hash of method, URL, the selected
+ * headers and hash of the body */
+static char *api_disk_cache_key(api_request_t *req) {
+  api_disk_cache_t *disk = req->endpoint->disk_cache;
+  struct curl_slist *h;
+  UT_string *s;
+  char body_hash[SIGV4_HEX_LEN + 1], *key;
+  size_t len;
+  int i;
+
+  utstring_new(s);
+  utstring_printf(s, "%s %s\n", api_method_str(req), req->url);
+  for (i = 0; i < disk->headers_len; i++) {
+    len = strlen(disk->headers[i]);
+    for (h = req->headers; h; h = h->next) {
+      if (strncasecmp(h->data, disk->headers[i], len) == 0 &&
+          h->data[len] == ':') {
+        utstring_printf(s, "%s:%s\n", disk->headers[i], h->data + len + 1);
+      }
+    }
+  }
+  sigv4_payload_hash(req->body ? req->body : "", req->body_len, body_hash);
+  utstring_printf(s, "%s\n", body_hash);
+
+  key = malloc(SIGV4_HEX_LEN + 1);
+  sigv4_payload_hash(utstring_body(s), utstring_len(s), key);
+  utstring_free(s);
+  return key;
+}
+
+/* Serves the request from disk cache of endpoint. The response body is
+ * the mapped file. */
+static int api_disk_cache_lookup(api_request_t *req) {
+  api_disk_cache_t *disk = req->endpoint->disk_cache;
+  api_disk_entry_t entry;
+  api_response_t *resp;
+  char *data, *p, *end;
+  size_t len;
+
+  free(req->disk_key);
+  req->disk_key = NULL;
+  if (!disk || req->no_cache) {
+    return 0;
+  }
+  if (req->cache_status == API_CACHE_NONE) {
+    req->cache_status = API_CACHE_MISS;
+  }
+  req->disk_key = api_disk_cache_key(req);
+  data = diskcache_get(disk->dc, req->disk_key, &len);
+  if (!data) {
+    return 0;
+  }
+  if (len >= sizeof(entry)) {
+    memcpy(&entry, data, sizeof(entry));
+  }
+  if (len < sizeof(entry) || entry.magic != API_DISK_CACHE_MAGIC ||
+      entry.headers_len > len - sizeof(entry) ||
+      entry.body_len != len - sizeof(entry) - entry.headers_len ||
+      (entry.headers_len && data[sizeof(entry) + entry.headers_len - 1])) {
+    diskcache_unmap(data, len);
+    return 0;
+  }
+
+  resp = calloc(1, sizeof(api_response_t));
+  resp->status = entry.status;
+  resp->size_download = entry.size_download;
+  end = data + sizeof(entry) + entry.headers_len;
+  for (p = data + sizeof(entry); p < end; p += strlen(p) + 1) {
+    resp->headers = curl_slist_append(resp->headers, p);
+  }
+  resp->body = end;
+  resp->body_len = entry.body_len;
+  resp->map = data;
+  resp->map_len = len;
+  api_response_free(req->resp);
+  req->resp = resp;
+
+  api_cache_forget(req);
+  req->cache_status = API_CACHE_DISK;
+  free(req->disk_key);
+  req->disk_key = NULL;
+  return 1;
+}
+
+/* Stores successful response of the request in disk cache */
+static void api_disk_cache_response(api_request_t *req) {
+  api_response_t *resp = req->resp;
+  api_disk_entry_t entry = {0};
+  struct curl_slist *h;
+  struct iovec *iov;
+  int n = 0;
+
+  if (!req->disk_key) {
+    return;
+  }
+  if (!resp->err && resp->status >= 200 && resp->status < 300) {
+    for (h = resp->headers; h; h = h->next) {
+      n++;
+    }
+    iov = calloc(n + 2, sizeof(struct iovec));
+    n = 0;
+    iov[n].iov_base = &entry;
+    iov[n++].iov_len = sizeof(entry);
+    for (h = resp->headers; h; h = h->next) {
+      iov[n].iov_base = h->data;
+      iov[n].iov_len = strlen(h->data) + 1;
+      entry.headers_len += iov[n++].iov_len;
+    }
+    iov[n].iov_base = resp->body;
+    iov[n++].iov_len = resp->body_len;
+    entry.magic = API_DISK_CACHE_MAGIC;
+    entry.status = resp->status;
+    entry.body_len = resp->body_len;
+    entry.size_download = resp->size_download;
+    diskcache_put(req->endpoint->disk_cache->dc, req->disk_key, iov, n);
+    free(iov);
+  }
+  free(req->disk_key);
+  req->disk_key = NULL;
+}
+
+/* Handles finished attempt. The first response of the request wins and other
+ * attempts are cancelled, unless it is a transport error and there are other
+ * attempts in flight. */
+static void api_attempt_done(CURLM *cm, api_timers_t *timers, CURLMsg *msg,
+                             api_response_t *resp, double deadline) {
+  api_request_t *req = resp->req;
+  CURLcode res = msg->data.result;
+  long status;
+  double delay;
+
+  LL_DELETE(req->inflight, resp);
+  curl_easy_getinfo(resp->c, CURLINFO_TOTAL_TIME, &resp->total_time);
+  curl_easy_getinfo(resp->c, CURLINFO_SIZE_DOWNLOAD_T, &resp->size_download);
+  if (msg->msg == CURLMSG_DONE) {
+    curl_easy_getinfo(resp->c, CURLINFO_RESPONSE_CODE, &status);
+    resp->status = (int)status;
+    if (res > 0) {
+      resp->err = api_printf("%s", curl_easy_strerror(res));
+    }
+  } else {
+    resp->err = api_printf("Unexpected message type: %d", msg->msg);
+  }
+  api_stats_done(req->endpoint->stats, resp, res);
+  api_timeline_done(resp, NULL);
+
+  if (!resp->err) {
+    api_rate_update(req->endpoint->rate_limit, resp, api_now());
+  }
+  api_breaker_record(req->endpoint->breaker, req, resp, api_now());
+  if (resp->err && req->inflight) {
+    curl_multi_remove_handle(cm, resp->c);
+    curl_easy_cleanup(resp->c);
+    api_response_free(resp);
+    return;
+  }
+
+  api_cancel_attempts(cm, req);
+  api_timers_remove(timers, req);
+  if (req->admitted) {
+    // a hedge was waiting for its slot
+    api_rate_release(req->endpoint->rate_limit);
+    req->admitted = 0;
+  }
+  req->resp = resp;
+  if (!resp->err) {
+    api_record_latency(req->endpoint, resp->total_time);
+  }
+
+  delay = api_retry_delay(req, resp, res);
+  if (delay >= 0 && (!deadline || api_now() + delay < deadline)) {
+    // only the failed request is queued again
+    req->due = api_now() + delay;
+    api_timers_add(timers, req);
+  }
+  curl_multi_remove_handle(cm, resp->c);
+  curl_easy_cleanup(resp->c);
+  resp->c = NULL;
+  if (!req->timer) {
+    api_cache_response(req, api_now());
+    api_disk_cache_response(req);
+  }
+}
+
+/* Cancels requests, which haven't finished before the deadline. Background
+ * token refreshes continue in the next send. */
+static void api_expire_requests(CURLM *cm, api_request_t *head,
+                                api_timers_t *timers) {
+  api_request_t *req;
+
+  DL_FOREACH(head, req) {
+    if (req->inflight || req->timer) {
+      api_cancel_attempts(cm, req);
+      api_timers_remove(timers, req);
+      if (req->admitted) {
+        api_rate_release(req->endpoint->rate_limit);
+        req->admitted = 0;
+      }
+      if (req->probe) {
+        req->probe = 0;
+        req->endpoint->breaker->probing--;
+      }
+      api_response_free(req->resp);
+      req->resp = calloc(1, sizeof(api_response_t));
+      req->resp->err = api_printf("deadline");
+    }
+  }
+}
+
+/* Starts an attempt of the request, or schedules it if it has to wait for
+ * a slot of the rate limit. Request in flight is started as a hedge. */
+static void api_start_attempt(CURLM *cm, api_timers_t *timers,
+                              api_request_t *req, double now, char **err) {
+  api_rate_limit_t *rate = req->endpoint->rate_limit;
+  int hedge = req->inflight != NULL;
+  double delay;
+
+  // open breaker fails the request without taking a slot
+  if (api_breaker_rejects(req->endpoint->breaker, now)) {
+    if (req->admitted) {
+      api_rate_release(rate);
+      req->admitted = 0;
+    }
+    if (!hedge) {
+      api_response_free(req->resp);
+      req->resp = calloc(1, sizeof(api_response_t));
+      req->resp->err = api_printf("circuit_open");
+    }
+    return;
+  }
+
+  // the slot is lost if the endpoint was paused in the meantime
+  if (!req->admitted || (rate && now < rate->last)) {
+    delay = api_rate_acquire(rate, now);
+    if (delay > 0) {
+      req->admitted = 1;
+      req->due = now + delay;
+      api_timers_add(timers, req);
+      return;
+    }
+  }
+  req->admitted = 0;
+
+  if (!api_breaker_allow(req->endpoint->breaker, req, hedge, now)) {
+    api_rate_release(rate);
+    if (!hedge) {
+      api_response_free(req->resp);
+      req->resp = calloc(1, sizeof(api_response_t));
+      req->resp->err = api_printf("circuit_open");
+    }
+    return;
+  }
+
+  api_add_request(cm, req, hedge, err);
+  if (!*err) {
+    api_arm_hedge(timers, req, now);
+  }
+}
+
+/* Sends the requests and waits for all of them to finish, or until deadline
+ * (an absolute time of api_now) if it is not zero. */
+static void api_send_requests(api_request_t *head, double deadline,
+                              char **err) {
+  CURLM *cm;
+  CURLMsg *msg;
+  int running = 1, timeout;
+  int msgs_left = -1;
+  api_request_t *req;
+  api_response_t *resp;
+  api_timers_t timers = {0};
+  double now, delay;
+  api_phase_t prev;
+
+  cm = curl_multi_init();
+  if (!cm) {
+    *err = api_printf("Cannot init transfer");
+    return;
+  }
+
+  DL_FOREACH(head, req) {
+    api_prepare_auth(req->endpoint->auth, err);
+    if (*err) {
+      curl_multi_cleanup(cm);
+      return;
+    }
+  }
+
+  now = api_now();
+  DL_FOREACH(head, req) {
+    req->attempts = 0;
+    req->hedges = 0;
+    if (api_cache_lookup(req, now) || api_disk_cache_lookup(req)) {
+      continue;
+    }
+    api_refresh_auth(req->endpoint->auth);
+    api_start_attempt(cm, &timers, req, now, err);
+    if (*err) {
+      return;
+    }
+  }
+
+  while (running || timers.len) {
+    now = api_now();
+    if (deadline && now >= deadline) {
+      api_expire_requests(cm, head, &timers);
+      break;
+    }
+    while (timers.len && timers.items[0]->due <= now) {
+      req = timers.items[0];
+      api_timers_remove(&timers, req);
+      // request in flight is waiting for a hedge, otherwise for a retry
+      // or for a slot of the rate limit
+      api_start_attempt(cm, &timers, req, now, err);
+      if (*err) {
+        return;
+      }
+    }
+
+    curl_multi_perform(cm, &running);
+    api_refresh_perform();
+
+    while ((msg = curl_multi_info_read(cm, &msgs_left))) {
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &resp);
+      api_attempt_done(cm, &timers, msg, resp, deadline);
+    }
+    if (running || timers.len) {
+      // refreshes aren't polled, they progress when the loop wakes up
+      timeout = api_refreshes ? API_OAUTH2_REFRESH_POLL : 100;
+      now = api_now();
+      if (timers.len) {
+        delay = (timers.items[0]->due - now) * 1000;
+        timeout = delay < 0 ? 0 : delay < timeout ? (int)delay + 1 : timeout;
+      }
+      if (deadline) {
+        delay = (deadline - now) * 1000;
+        timeout = delay < 0 ? 0 : delay < timeout ? (int)delay + 1 : timeout;
+      }
+      // unlike curl_multi_wait it sleeps also when there are no transfers
+      prev = api_phase_enter(API_PHASE_WAIT);
+      curl_multi_poll(cm, NULL, 0, timeout, NULL);
+      api_phase_leave(prev);
+    }
+  }
+
+  free(timers.items);
+  curl_multi_cleanup(cm);
+}
+
+static int api_endpoint_gc(lua_State *L) {
+  api_endpoint_t *ep = lua_touserdata(L, -1);
+
+  free(ep->handle_response_chunk);
+  free(ep->accept_encoding);
+  compress_dict_free(ep->zstd_dict);
+  free(ep->rate_limit);
+  api_breaker_free(ep->breaker);
+  cache_free(ep->cache);
+  api_disk_cache_free(ep->disk_cache);
+  api_retry_free(ep->retry);
+  api_hedge_free(ep->hedge);
+  api_stats_free(ep->stats);
+  if (ep->auth) {
+    api_auth_release(L, ep->auth);
+  }
+  free(ep->host);
+  free(ep->path);
+  free(ep->base_url);
+  free(ep->ca_file);
+
+  return 0;
+}
+
+static void api_request_free(api_request_t *req) {
+  free(req->custom_method);
+  free(req->path);
+  free(req->url);
+  curl_slist_free_all(req->headers);
+  free(req->body);
+  free(req->accept_encoding);
+  api_retry_free(req->retry);
+  api_hedge_free(req->hedge);
+  free(req->handle_response_chunk);
+  api_free_signature(req);
+  api_cache_forget(req);
+  free(req->disk_key);
+  api_response_free(req->resp);
+}
+
+static void api_template_release(api_template_t *tpl) {
+  int i;
+
+  if (--tpl->refs > 0) {
+    return;
+  }
+  api_request_free(&tpl->proto);
+  for (i = 0; i < tpl->segments_len; i++) {
+    free(tpl->segments[i].literal);
+    free(tpl->segments[i].param);
+  }
+  free(tpl->segments);
+  free(tpl);
+}
+
+static int api_request_gc(lua_State *L) {
+  api_request_t *req = lua_touserdata(L, -1);
+
+  if (req->tpl) {
+    // only url, body and response are owned by requests created from template
+    free(req->url);
+    if (req->body != req->tpl->proto.body) {
+      free(req->body);
+    }
+    api_free_signature(req);
+    api_cache_forget(req);
+    api_response_free(req->resp);
+    api_template_release(req->tpl);
+  } else {
+    api_request_free(req);
+  }
+
+  return 0;
+}
+
+static int api_template_gc(lua_State *L) {
+  api_template_t **tpl = lua_touserdata(L, -1);
+
+  if (*tpl) {
+    api_template_release(*tpl);
+  }
+
+  return 0;
+}
+
+/* Pushes the value converted from json */
+void api_read_json(lua_State *L, json_t *json) {
+  json_t *value;
+  const char *key;
+  size_t i;
 
   if (json_is_false(json)) {
     lua_pushboolean(L, 0);
@@ -385,559 +2626,2476 @@ static void api_read_json(lua_State *L, json_t *json) {
       api_read_json(L, value);
       lua_seti(L, -2, i + 1);
     }
-  } else if (json_is_object(json)) {
+  } else if (json_is_object(json)) {
+    lua_newtable(L);
+    json_object_foreach(json, key, value) {
+      api_read_json(L, value);
+      lua_setfield(L, -2, key);
+    }
+  } else {
+    lua_pushnil(L);
+  }
+}
+
+/* Pops a value and returns it converted to json */
+json_t *api_write_json(lua_State *L) {
+  json_t *json, *value;
+  const char *s;
+  size_t size;
+  int i, len;
+
+  switch (lua_type(L, -1)) {
+  case LUA_TNIL:
+    json = json_null();
+    break;
+  case LUA_TBOOLEAN:
+    json = json_boolean(lua_toboolean(L, -1));
+    break;
+  case LUA_TNUMBER:
+    if (lua_isinteger(L, -1)) {
+      json = json_integer(lua_tointeger(L, -1));
+    } else {
+      json = json_real(lua_tonumber(L, -1));
+    }
+    break;
+  case LUA_TSTRING:
+    s = lua_tolstring(L, -1, &size);
+    json = json_stringn(s, size);
+    break;
+  case LUA_TTABLE:
+    lua_len(L, -1);
+    len = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    if (len > 0) {
+      // array
+      json = json_array();
+      for (i = 1; i <= len; i++) {
+        lua_geti(L, -1, i);
+        value = api_write_json(L);
+        json_array_append_new(json, value);
+      }
+    } else {
+      // object
+      json = json_object();
+      lua_pushnil(L);
+      while (lua_next(L, -2)) {
+        value = api_write_json(L);
+        s = lua_tostring(L, -1);
+        json_object_set_new(json, s, value);
+      }
+    }
+    break;
+  default:
+    luaL_error(L, "write_json: unexpected type of argument");
+    return NULL;
+  }
+
+  lua_pop(L, 1);
+  return json;
+}
+
+static int api_from_json(lua_State *L) {
+  json_t *json;
+  const char *tmp;
+  size_t size;
+  json_error_t err;
+  api_phase_t prev;
+  double start = api_timeline ? api_now() : 0;
+
+  if (lua_type(L, -1) != LUA_TSTRING) {
+    return luaL_error(L, "from_json: expecting string as an argument");
+  }
+
+  prev = api_phase_enter(API_PHASE_JSON);
+  tmp = lua_tolstring(L, -1, &size);
+  json = json_loadb(tmp, size, 0, &err);
+  if (!json) {
+    api_phase_leave(prev);
+    return luaL_error(L, "from_json: %s (line: %d, column: %d)", err.text,
+                      err.line, err.column);
+  }
+
+  lua_pop(L, 1);
+  api_read_json(L, json);
+  json_decref(json);
+  api_phase_leave(prev);
+  if (api_timeline && api_on_main_thread()) {
+    timeline_slice(api_timeline, "from_json", "lua", 0, start, api_now(), 0);
+  }
+  return 1;
+}
+
+static int api_to_json_value(lua_State *L) {
+  json_t *json;
+  char *tmp;
+
+  json = api_write_json(L);
+  tmp = json_dumps(json, 0);
+  lua_pushstring(L, tmp);
+  free(tmp);
+  json_decref(json);
+
+  return 1;
+}
+
+static int api_to_json(lua_State *L) {
+  api_phase_t prev = api_phase_enter(API_PHASE_JSON);
+  double start = api_timeline ? api_now() : 0;
+
+  // unsupported values raise errors
+  lua_pushcfunction(L, api_to_json_value);
+  lua_insert(L, -2);
+  api_phase_call(L, 1, 1, prev,
+                 api_on_main_thread() ? api_phase_endpoint : NULL);
+  api_phase_leave(prev);
+  if (api_timeline && api_on_main_thread()) {
+    timeline_slice(api_timeline, "to_json", "lua", 0, start, api_now(), 0);
+  }
+
+  return 1;
+}
+
+/* Reads the 'compressed' field of a table at index idx. It returns value for
+ * CURLOPT_ACCEPT_ENCODING (empty string means all encodings supported by curl)
+ * or NULL if the field is missing or false. */
+static char *api_getacceptencoding(lua_State *L, int idx) {
+  UT_string *s;
+  char *encoding = NULL;
+  const char *tmp;
+  size_t len;
+  int i, n;
+
+  lua_getfield(L, idx, "compressed");
+  switch (lua_type(L, -1)) {
+  case LUA_TBOOLEAN:
+    if (lua_toboolean(L, -1)) {
+      encoding = api_printf("");
+    }
+    break;
+  case LUA_TSTRING:
+    encoding = api_printf("%s", lua_tostring(L, -1));
+    break;
+  case LUA_TTABLE:
+    utstring_new(s);
+    lua_len(L, -1);
+    n = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    for (i = 1; i <= n; i++) {
+      lua_geti(L, -1, i);
+      tmp = lua_tolstring(L, -1, &len);
+      if (tmp) {
+        if (utstring_len(s)) {
+          utstring_printf(s, ", ");
+        }
+        utstring_bincpy(s, tmp, len);
+      }
+      lua_pop(L, 1);
+    }
+    encoding = api_printf("%s", utstring_body(s));
+    utstring_free(s);
+    break;
+  }
+  lua_pop(L, 1);
+
+  return encoding;
+}
+
+/* Reads 'compress' and 'compress_level' fields of a table at index idx.
+ * Missing fields keep the values passed in type and level. */
+static void api_getcompress(lua_State *L, int idx, compress_type *type,
+                            int *level) {
+  const char *s;
+
+  lua_getfield(L, idx, "compress");
+  if (!lua_isnil(L, -1)) {
+    s = lua_tostring(L, -1);
+    if (!lua_toboolean(L, -1)) {
+      *type = COMPRESS_NONE;
+    } else if (s && strcmp(s, "gzip") == 0) {
+      *type = COMPRESS_GZIP;
+    } else if (s && strcmp(s, "zstd") == 0) {
+      *type = COMPRESS_ZSTD;
+    } else {
+      luaL_error(L, "'compress' should be gzip or zstd");
+    }
+    if (!compress_supported(*type)) {
+      luaL_error(L, "%s compression is not supported", s);
+    }
+  }
+  lua_pop(L, 1);
+
+  lua_getfield(L, idx, "compress_level");
+  if (!lua_isnil(L, -1)) {
+    *level = lua_tointeger(L, -1);
+  }
+  lua_pop(L, 1);
+}
+
+/* Reads 'timeout', 'connect_timeout' and 'low_speed' fields of a table at
+ * index idx. Missing fields keep the limits unset. */
+static void api_getlimits(lua_State *L, int idx, api_limits_t *limits) {
+  lua_getfield(L, idx, "timeout");
+  if (!lua_isnil(L, -1)) {
+    limits->timeout = (long)(lua_tonumber(L, -1) * 1000);
+  }
+  lua_pop(L, 1);
+
+  lua_getfield(L, idx, "connect_timeout");
+  if (!lua_isnil(L, -1)) {
+    limits->connect_timeout = (long)(lua_tonumber(L, -1) * 1000);
+  }
+  lua_pop(L, 1);
+
+  lua_getfield(L, idx, "low_speed");
+  if (lua_istable(L, -1)) {
+    lua_getfield(L, -1, "limit");
+    limits->low_speed_limit = (long)lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    lua_getfield(L, -1, "time");
+    limits->low_speed_time = (long)lua_tointeger(L, -1);
+    lua_pop(L, 1);
+  } else if (!lua_isnil(L, -1)) {
+    luaL_error(L, "'low_speed' should be a table");
+  }
+  lua_pop(L, 1);
+}
+
+/* Reads the 'rate_limit' field of a table at index idx */
+static api_rate_limit_t *api_getratelimit(lua_State *L, int idx) {
+  api_rate_limit_t *rate = NULL;
+
+  lua_getfield(L, idx, "rate_limit");
+  if (lua_istable(L, -1)) {
+    rate = calloc(1, sizeof(api_rate_limit_t));
+    lua_getfield(L, -1, "rps");
+    rate->rps = lua_tonumber(L, -1);
+    lua_pop(L, 1);
+    lua_getfield(L, -1, "burst");
+    rate->burst = lua_isnil(L, -1) ? 1 : lua_tonumber(L, -1);
+    lua_pop(L, 1);
+    if (rate->rps <= 0 || rate->burst < 1) {
+      free(rate);
+      luaL_error(L, "'rps' should be positive and 'burst' at least 1");
+      return NULL;
+    }
+    rate->tokens = rate->burst;
+    rate->last = api_now();
+  } else if (!lua_isnil(L, -1)) {
+    luaL_error(L, "'rate_limit' should be a table");
+  }
+  lua_pop(L, 1);
+
+  return rate;
+}
+
+/* Reads the 'breaker' field of a table at index idx */
+static api_breaker_t *api_getbreaker(lua_State *L, int idx) {
+  api_breaker_t *breaker = NULL;
+
+  lua_getfield(L, idx, "breaker");
+  if (lua_istable(L, -1)) {
+    breaker = calloc(1, sizeof(api_breaker_t));
+    lua_getfield(L, -1, "failures");
+    breaker->failures =
+        lua_isnil(L, -1) ? API_BREAKER_FAILURES : lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    lua_getfield(L, -1, "window");
+    breaker->window =
+        lua_isnil(L, -1) ? API_BREAKER_WINDOW : lua_tonumber(L, -1);
+    lua_pop(L, 1);
+    lua_getfield(L, -1, "cooldown");
+    breaker->cooldown =
+        lua_isnil(L, -1) ? API_BREAKER_COOLDOWN : lua_tonumber(L, -1);
+    lua_pop(L, 1);
+    lua_getfield(L, -1, "probes");
+    breaker->probes =
+        lua_isnil(L, -1) ? API_BREAKER_PROBES : lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    if (breaker->failures < 1 || breaker->probes < 1) {
+      free(breaker);
+      luaL_error(L, "'failures' and 'probes' should be positive");
+      return NULL;
+    }
+    breaker->failed_at = calloc(breaker->failures, sizeof(double));
+  } else if (!lua_isnil(L, -1)) {
+    luaL_error(L, "'breaker' should be a table");
+  }
+  lua_pop(L, 1);
+
+  return breaker;
+}
+
+/* Reads the 'cache' field of endpoint table at index idx */
+static cache *api_getcache(lua_State *L, int idx) {
+  cache *c = NULL;
+  lua_Integer size;
+
+  lua_getfield(L, idx, "cache");
+  if (lua_istable(L, -1)) {
+    lua_getfield(L, -1, "size");
+    size = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    if (size <= 0) {
+      luaL_error(L, "'size' of cache should be positive");
+      return NULL;
+    }
+    c = cache_new((size_t)size, api_cached_release);
+  } else if (!lua_isnil(L, -1)) {
+    luaL_error(L, "'cache' should be a table");
+  }
+  lua_pop(L, 1);
+
+  return c;
+}
+
+/* Reads the 'disk_cache' field of a table at index idx and opens the cache
+ * directory */
+static api_disk_cache_t *api_getdiskcache(lua_State *L, int idx) {
+  api_disk_cache_t *disk;
+  const char *dir, *s;
+  lua_Integer size = API_DISK_CACHE_SIZE;
+  double ttl = 0;
+  char *p;
+  int i;
+
+  lua_getfield(L, idx, "disk_cache");
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    return NULL;
+  }
+  if (!lua_istable(L, -1)) {
+    luaL_error(L, "'disk_cache' should be a table");
+    return NULL;
+  }
+  lua_getfield(L, -1, "dir");
+  dir = lua_tostring(L, -1);
+  if (!dir) {
+    luaL_error(L, "'dir' of disk_cache is missing");
+    return NULL;
+  }
+  lua_getfield(L, -2, "size");
+  if (!lua_isnil(L, -1)) {
+    size = lua_tointeger(L, -1);
+  }
+  lua_getfield(L, -3, "ttl");
+  if (!lua_isnil(L, -1)) {
+    ttl = lua_tonumber(L, -1);
+  }
+  lua_pop(L, 2);
+  if (size <= 0 || ttl < 0) {
+    luaL_error(L, "'size' and 'ttl' of disk_cache should be positive");
+    return NULL;
+  }
+
+  disk = calloc(1, sizeof(api_disk_cache_t));
+  lua_getfield(L, -2, "headers");
+  if (lua_istable(L, -1)) {
+    lua_len(L, -1);
+    disk->headers_len = (int)lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    disk->headers = calloc(disk->headers_len, sizeof(char *));
+    for (i = 0; i < disk->headers_len; i++) {
+      lua_geti(L, -1, i + 1);
+      s = lua_tostring(L, -1);
+      disk->headers[i] = strdup(s ? s : "");
+      for (p = disk->headers[i]; *p; p++) {
+        *p = tolower((unsigned char)*p);
+      }
+      lua_pop(L, 1);
+    }
+  }
+  lua_pop(L, 1);
+
+  disk->dc = diskcache_open(dir, (size_t)size, ttl);
+  if (!disk->dc) {
+    api_disk_cache_free(disk);
+    luaL_error(L, "cannot open disk cache %s: %s", dir, strerror(errno));
+    return NULL;
+  }
+  lua_pop(L, 2);
+
+  return disk;
+}
+
+/* default statuses to retry on */
+static const int api_retry_statuses[] = {429, 502, 503, 504};
+
+/* Reads the 'retry' field of a table at index idx. It returns NULL if
+ * the field is missing and a policy without retries if it is false. */
+static api_retry_t *api_getretry(lua_State *L, int idx) {
+  api_retry_t *retry;
+  const char *s;
+  int i, n;
+
+  lua_getfield(L, idx, "retry");
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    return NULL;
+  }
+
+  retry = calloc(1, sizeof(api_retry_t));
+  if (!lua_toboolean(L, -1)) {
+    lua_pop(L, 1);
+    return retry;
+  }
+  if (!lua_istable(L, -1)) {
+    api_retry_free(retry);
+    luaL_error(L, "'retry' should be a table");
+    return NULL;
+  }
+
+  lua_getfield(L, -1, "max");
+  retry->max = lua_isnil(L, -1) ? API_RETRY_MAX : lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  lua_getfield(L, -1, "delay");
+  retry->delay = lua_isnil(L, -1) ? API_RETRY_DELAY : lua_tonumber(L, -1);
+  lua_pop(L, 1);
+  lua_getfield(L, -1, "max_delay");
+  retry->max_delay =
+      lua_isnil(L, -1) ? API_RETRY_MAX_DELAY : lua_tonumber(L, -1);
+  lua_pop(L, 1);
+  lua_getfield(L, -1, "jitter");
+  retry->jitter = lua_isnil(L, -1) || lua_toboolean(L, -1);
+  lua_pop(L, 1);
+
+  lua_getfield(L, -1, "backoff");
+  s = lua_tostring(L, -1);
+  if (!s || strcmp(s, "exp") == 0) {
+    retry->backoff = API_BACKOFF_EXP;
+  } else if (strcmp(s, "fixed") == 0) {
+    retry->backoff = API_BACKOFF_FIXED;
+  } else if (strcmp(s, "none") == 0) {
+    retry->backoff = API_BACKOFF_NONE;
+  } else {
+    api_retry_free(retry);
+    luaL_error(L, "'backoff' should be exp, fixed or none");
+    return NULL;
+  }
+  lua_pop(L, 1);
+
+  lua_getfield(L, -1, "on");
+  if (lua_isnil(L, -1)) {
+    n = sizeof(api_retry_statuses) / sizeof(api_retry_statuses[0]);
+    retry->statuses = malloc(sizeof(api_retry_statuses));
+    memcpy(retry->statuses, api_retry_statuses, sizeof(api_retry_statuses));
+    retry->statuses_len = n;
+    retry->errors = API_RETRY_IDEMPOTENT_TIMEOUT | API_RETRY_CONNECT;
+    lua_pop(L, 2);
+    return retry;
+  }
+  lua_len(L, -1);
+  n = lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  retry->statuses = calloc(n ? n : 1, sizeof(int));
+  for (i = 1; i <= n; i++) {
+    lua_geti(L, -1, i);
+    s = lua_type(L, -1) == LUA_TSTRING ? lua_tostring(L, -1) : NULL;
+    if (!s) {
+      retry->statuses[retry->statuses_len++] = lua_tointeger(L, -1);
+    } else if (strcmp(s, "timeout") == 0) {
+      retry->errors |= API_RETRY_TIMEOUT;
+    } else if (strcmp(s, "connect") == 0) {
+      retry->errors |= API_RETRY_CONNECT;
+    } else if (strcmp(s, "error") == 0) {
+      retry->errors |= API_RETRY_ERROR;
+    } else {
+      api_retry_free(retry);
+      luaL_error(L, "'on' should contain statuses, timeout, connect or error");
+      return NULL;
+    }
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 2);
+
+  return retry;
+}
+
+/* Reads the 'hedge' field of a table at index idx. It returns NULL if
+ * the field is missing and a policy without hedges if it is false. */
+static api_hedge_t *api_gethedge(lua_State *L, int idx) {
+  api_hedge_t *hedge;
+  const char *s;
+
+  lua_getfield(L, idx, "hedge");
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    return NULL;
+  }
+
+  hedge = calloc(1, sizeof(api_hedge_t));
+  hedge->max_extra = -1;
+  if (!lua_toboolean(L, -1)) {
+    lua_pop(L, 1);
+    return hedge;
+  }
+  if (!lua_istable(L, -1)) {
+    api_hedge_free(hedge);
+    luaL_error(L, "'hedge' should be a table");
+    return NULL;
+  }
+
+  lua_getfield(L, -1, "max_extra");
+  hedge->max_extra =
+      lua_isnil(L, -1) ? API_HEDGE_MAX_EXTRA : lua_tointeger(L, -1);
+  lua_pop(L, 1);
+
+  lua_getfield(L, -1, "after");
+  if (lua_type(L, -1) == LUA_TNUMBER) {
+    hedge->after = lua_tonumber(L, -1);
+  } else {
+    s = lua_tostring(L, -1);
+    if (!s || s[0] != 'p' || (hedge->percentile = atof(s + 1) / 100) <= 0 ||
+        hedge->percentile > 1) {
+      api_hedge_free(hedge);
+      luaL_error(L, "'after' should be a number or a percentile (ie. 'p95')");
+      return NULL;
+    }
+  }
+  lua_pop(L, 2);
+
+  return hedge;
+}
+
+static const char *api_content_encoding_header(compress_type type) {
+  switch (type) {
+  case COMPRESS_NONE:
+    return NULL;
+  case COMPRESS_GZIP:
+    return API_HEADER_CONTENT_ENCODING ": gzip";
+  case COMPRESS_ZSTD:
+    return API_HEADER_CONTENT_ENCODING ": zstd";
+  }
+  return NULL;
+}
+
+static void api_compress_body(lua_State *L, api_request_t *req,
+                              compress_type type, int level) {
+  unsigned char *out = NULL;
+  size_t out_len;
+
+  switch (type) {
+  case COMPRESS_NONE:
+    return;
+  case COMPRESS_GZIP:
+    out = compress_gzip((unsigned char *)req->body, req->body_len, level,
+                        &out_len);
+    break;
+  case COMPRESS_ZSTD:
+    out = compress_zstd((unsigned char *)req->body, req->body_len, level,
+                        req->endpoint->zstd_dict, &out_len);
+    break;
+  }
+  if (!out) {
+    luaL_error(L, "cannot compress request body");
+    return;
+  }
+
+  free(req->body);
+  req->body = (char *)out;
+  req->body_len = out_len;
+  req->content_encoding = api_content_encoding_header(type);
+}
+
+static int api_request_handle_response_chunk_cb(lua_State *L, const void *p,
+                                                size_t sz, void *ud) {
+  api_request_t *req = (api_request_t *)ud;
+  (void)L;
+  size_t new_len = req->handle_response_chunk_len + sz;
+  req->handle_response_chunk = realloc(req->handle_response_chunk, new_len);
+  memcpy(req->handle_response_chunk + req->handle_response_chunk_len, p, sz);
+  req->handle_response_chunk_len += sz;
+  return 0;
+}
+
+static api_method_t api_method_from_str(const char *method) {
+  if (strcmp(method, API_METHOD_GET_STR) == 0) {
+    return API_METHOD_GET;
+  } else if (strcmp(method, API_METHOD_POST_STR) == 0) {
+    return API_METHOD_POST;
+  } else if (strcmp(method, API_METHOD_PUT_STR) == 0) {
+    return API_METHOD_PUT;
+  } else if (strcmp(method, API_METHOD_DELETE_STR) == 0) {
+    return API_METHOD_DELETE;
+  }
+  return API_METHOD_CUSTOM;
+}
+
+/* Sets the body of the request from the value on top of the stack. Tables are
+ * encoded as json. */
+static void api_set_body(lua_State *L, api_request_t *req) {
+  const char *tmp;
+  size_t sz;
+
+  if (lua_istable(L, -1)) {
+    api_to_json(L);
+    req->content_type = API_HEADER_CONTENT_TYPE_JSON;
+  }
+  tmp = lua_tolstring(L, -1, &sz);
+  req->body = malloc(sz);
+  memcpy(req->body, tmp, sz);
+  req->body_len = sz;
+}
+
+/* Fills the request from a path string or a table at index idx */
+static void api_read_request(lua_State *L, api_request_t *req, int idx,
+                             compress_type *compress, int *compress_level) {
+  const char *k, *v, *tmp;
+  char *header;
+
+  *compress = req->endpoint->compress;
+  *compress_level = req->endpoint->compress_level;
+
+  switch (lua_type(L, idx)) {
+  case LUA_TTABLE:
+    if (req->method == API_METHOD_CUSTOM) {
+      api_getstringfield(L, req->custom_method, "method", idx, tmp);
+    }
+    api_getstringfield(L, req->path, "path", idx, tmp);
+    req->accept_encoding = api_getacceptencoding(L, idx);
+    lua_getfield(L, idx, "compressed");
+    req->uncompressed = lua_isboolean(L, -1) && !lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    api_getlimits(L, idx, &req->limits);
+    req->retry = api_getretry(L, idx);
+    req->hedge = api_gethedge(L, idx);
+    lua_getfield(L, idx, "cache");
+    req->no_cache = lua_isboolean(L, -1) && !lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    lua_getfield(L, idx, "body");
+    if (!lua_isnil(L, -1)) {
+      api_set_body(L, req);
+    }
+    lua_pop(L, 1);
+    api_getcompress(L, idx, compress, compress_level);
+    if (req->body) {
+      api_compress_body(L, req, *compress, *compress_level);
+    }
+    lua_getfield(L, idx, "headers");
+    if (lua_istable(L, -1)) {
+      lua_pushnil(L);
+      while (lua_next(L, -2)) {
+        k = lua_tostring(L, -2);
+        v = lua_tostring(L, -1);
+        header = api_printf("%s: %s", k, v);
+        req->headers = curl_slist_append(req->headers, header);
+        free(header);
+        lua_pop(L, 1);
+      }
+    }
+    lua_pop(L, 1);
+    lua_getfield(L, idx, "handle_response");
+    if (!lua_isnil(L, -1)) {
+      lua_dump(L, api_request_handle_response_chunk_cb, req, 0);
+    }
+    lua_pop(L, 1);
+    break;
+  case LUA_TSTRING:
+    tmp = (char *)lua_tostring(L, idx);
+    req->path = malloc(strlen(tmp) + 1);
+    strcpy(req->path, tmp);
+    break;
+  default:
+    luaL_error(L, "request function parameter should be string or table");
+    return;
+  }
+
+  if (req->method == API_METHOD_CUSTOM) {
+    if (!req->custom_method) {
+      /* default method */
+      req->method = API_METHOD_GET;
+    } else if (api_method_from_str(req->custom_method) != API_METHOD_CUSTOM) {
+      req->method = api_method_from_str(req->custom_method);
+      free(req->custom_method);
+      req->custom_method = NULL;
+    }
+  }
+}
+
+static void api_set_request_metatable(lua_State *L) {
+  lua_pushinteger(L, API_TYPE_REQUEST);
+  lua_setuservalue(L, -2);
+
+  if (luaL_newmetatable(L, API_REQUEST_METATABLE)) {
+    lua_pushstring(L, "__gc");
+    lua_pushcfunction(L, api_request_gc);
+    lua_rawset(L, -3);
+  }
+  lua_setmetatable(L, -2);
+}
+
+static int api_create_request(lua_State *L, api_method_t method,
+                              char *custom_method) {
+  int idx = lua_gettop(L);
+  api_request_t *req = lua_newuserdata(L, sizeof(api_request_t));
+  compress_type compress;
+  int compress_level;
+
+  memset(req, 0, sizeof(api_request_t));
+  api_set_request_metatable(L);
+
+  req->endpoint = lua_touserdata(L, lua_upvalueindex(1));
+  req->method = method;
+  req->custom_method = custom_method;
+
+  api_read_request(L, req, idx, &compress, &compress_level);
+  req->url = api_printf("%s%s", req->endpoint->base_url,
+                        req->path ? req->path : "");
+
+  return 1;
+}
+
+static int api_url_unreserved(unsigned char c) {
+  return isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~';
+}
+
+static size_t api_url_escaped_len(const char *s, size_t len) {
+  size_t i, n = 0;
+
+  for (i = 0; i < len; i++) {
+    n += api_url_unreserved(s[i]) ? 1 : 3;
+  }
+  return n;
+}
+
+static char *api_url_escape(char *dst, const char *s, size_t len) {
+  static const char hex[] = "0123456789ABCDEF";
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    if (api_url_unreserved(s[i])) {
+      *dst++ = s[i];
+    } else {
+      *dst++ = '%';
+      *dst++ = hex[(unsigned char)s[i] >> 4];
+      *dst++ = hex[(unsigned char)s[i] & 0xf];
+    }
+  }
+  return dst;
+}
+
+/* Splits the path of the template into literals and {param} placeholders.
+ * The base url of endpoint is prepended to the first literal. */
+static void api_template_compile(api_template_t *tpl) {
+  const char *p, *open, *close;
+  api_template_segment_t *seg;
+  UT_string *lit;
+  int last = 0;
+
+  utstring_new(lit);
+  utstring_printf(lit, "%s", tpl->proto.endpoint->base_url);
+  p = tpl->proto.path ? tpl->proto.path : "";
+  while (!last) {
+    open = strchr(p, '{');
+    close = open ? strchr(open, '}') : NULL;
+    last = !close;
+    utstring_bincpy(lit, p, last ? strlen(p) : (size_t)(open - p));
+
+    tpl->segments = realloc(tpl->segments, (tpl->segments_len + 1) *
+                                               sizeof(api_template_segment_t));
+    seg = &tpl->segments[tpl->segments_len++];
+    seg->literal_len = utstring_len(lit);
+    seg->literal = api_printf("%s", utstring_body(lit));
+    seg->param = NULL;
+    if (!last) {
+      seg->param = api_printf("%.*s", (int)(close - open - 1), open + 1);
+      tpl->params_len++;
+      p = close + 1;
+    }
+    utstring_clear(lit);
+  }
+
+  utstring_free(lit);
+}
+
+/* Builds url from the template and parameters in a table at index idx */
+static char *api_template_url(lua_State *L, api_template_t *tpl, int idx) {
+  api_template_segment_t *seg;
+  int i, param, top = lua_gettop(L);
+  size_t len = 0, value_len;
+  const char *value;
+  char *url, *p;
+
+  if (tpl->params_len && !lua_istable(L, idx)) {
+    luaL_error(L, "template: expects table of parameters");
+    return NULL;
+  }
+  luaL_checkstack(L, tpl->params_len, "template: too many parameters");
+
+  for (i = 0; i < tpl->segments_len; i++) {
+    seg = &tpl->segments[i];
+    len += seg->literal_len;
+    if (seg->param) {
+      lua_getfield(L, idx, seg->param);
+      value = lua_tolstring(L, -1, &value_len);
+      if (!value) {
+        luaL_error(L, "template: missing parameter '%s'", seg->param);
+        return NULL;
+      }
+      len += api_url_escaped_len(value, value_len);
+    }
+  }
+
+  p = url = malloc(len + 1);
+  for (i = 0, param = top + 1; i < tpl->segments_len; i++) {
+    seg = &tpl->segments[i];
+    memcpy(p, seg->literal, seg->literal_len);
+    p += seg->literal_len;
+    if (seg->param) {
+      value = lua_tolstring(L, param++, &value_len);
+      p = api_url_escape(p, value, value_len);
+    }
+  }
+  *p = 0;
+
+  lua_settop(L, top);
+  return url;
+}
+
+/* Creates request from the template, expects template parameters and
+ * an optional request body as arguments. */
+static int api_template_call(lua_State *L) {
+  api_template_t *tpl = *(api_template_t **)lua_touserdata(L, 1);
+  api_request_t *req;
+  int body = !lua_isnoneornil(L, 3);
+  char *url;
+
+  url = api_template_url(L, tpl, 2);
+
+  req = lua_newuserdata(L, sizeof(api_request_t));
+  memcpy(req, &tpl->proto, sizeof(api_request_t));
+  req->tpl = tpl;
+  req->url = url;
+  req->resp = NULL;
+  tpl->refs++;
+  api_set_request_metatable(L);
+
+  if (body) {
+    req->content_type = NULL;
+    lua_pushvalue(L, 3);
+    api_set_body(L, req);
+    lua_pop(L, 1);
+    api_compress_body(L, req, tpl->compress, tpl->compress_level);
+  }
+
+  return 1;
+}
+
+static int api_endpoint_prepare(lua_State *L) {
+  int idx = lua_gettop(L);
+  api_template_t *tpl, **ud;
+
+  if (!lua_istable(L, idx)) {
+    return luaL_error(L, "prepare: expects table as its argument");
+  }
+
+  tpl = calloc(1, sizeof(api_template_t));
+  tpl->refs = 1;
+  tpl->proto.endpoint = lua_touserdata(L, lua_upvalueindex(1));
+  tpl->proto.method = API_METHOD_CUSTOM;
+
+  ud = lua_newuserdata(L, sizeof(api_template_t *));
+  *ud = tpl;
+  lua_pushinteger(L, API_TYPE_TEMPLATE);
+  lua_setuservalue(L, -2);
+  if (luaL_newmetatable(L, API_TEMPLATE_METATABLE)) {
+    lua_pushstring(L, "__gc");
+    lua_pushcfunction(L, api_template_gc);
+    lua_rawset(L, -3);
+    lua_pushstring(L, "__call");
+    lua_pushcfunction(L, api_template_call);
+    lua_rawset(L, -3);
+  }
+  lua_setmetatable(L, -2);
+
+  api_read_request(L, &tpl->proto, idx, &tpl->compress, &tpl->compress_level);
+  api_template_compile(tpl);
+
+  return 1;
+}
+
+static int api_endpoint_request(lua_State *L) {
+  return api_create_request(L, API_METHOD_CUSTOM, NULL);
+}
+
+static int api_endpoint_get(lua_State *L) {
+  return api_create_request(L, API_METHOD_GET, NULL);
+}
+
+static int api_endpoint_post(lua_State *L) {
+  return api_create_request(L, API_METHOD_POST, NULL);
+}
+
+static int api_endpoint_put(lua_State *L) {
+  return api_create_request(L, API_METHOD_PUT, NULL);
+}
+
+static int api_endpoint_delete(lua_State *L) {
+  return api_create_request(L, API_METHOD_DELETE, NULL);
+}
+
+/* Returns table of stats of the endpoint or nil unless enabled */
+static int api_endpoint_stats(lua_State *L) {
+  api_endpoint_t *ep = lua_touserdata(L, lua_upvalueindex(1));
+  api_stats_t *stats = ep->stats;
+  char name[16];
+  long count = 0;
+  int i;
+
+  if (!stats) {
+    lua_pushnil(L);
+    return 1;
+  }
+  pthread_mutex_lock(&api_stats_lock);
+  lua_newtable(L);
+  lua_pushinteger(L, stats->requests);
+  lua_setfield(L, -2, "requests");
+  lua_pushinteger(L, stats->in_flight);
+  lua_setfield(L, -2, "in_flight");
+  lua_pushinteger(L, stats->bytes_in);
+  lua_setfield(L, -2, "bytes_in");
+  lua_pushinteger(L, stats->bytes_out);
+  lua_setfield(L, -2, "bytes_out");
+  lua_newtable(L);
+  for (i = 0; i < API_ERROR_KINDS; i++) {
+    lua_pushinteger(L, stats->errors[i]);
+    lua_setfield(L, -2, api_error_kind_names[i]);
+  }
+  lua_setfield(L, -2, "errors");
+  lua_newtable(L);
+  for (i = 0; i < 5; i++) {
+    snprintf(name, sizeof(name), "%dxx", i + 1);
+    lua_pushinteger(L, stats->statuses[i]);
+    lua_setfield(L, -2, name);
+  }
+  lua_setfield(L, -2, "statuses");
+  // cumulative buckets as in the metrics
+  lua_newtable(L);
+  for (i = 0; i <= API_STATS_BUCKETS; i++) {
+    count += stats->buckets[i];
     lua_newtable(L);
-    json_object_foreach(json, key, value) {
-      api_read_json(L, value);
-      lua_setfield(L, -2, key);
-    }
+    lua_pushnumber(L, i < API_STATS_BUCKETS ? api_stats_bounds[i]
+                                            : HUGE_VAL);
+    lua_setfield(L, -2, "le");
+    lua_pushinteger(L, count);
+    lua_setfield(L, -2, "count");
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_setfield(L, -2, "latency_buckets");
+  lua_pushnumber(L, stats->latency_sum);
+  lua_setfield(L, -2, "latency_sum");
+  lua_pushinteger(L, count);
+  lua_setfield(L, -2, "latency_count");
+  pthread_mutex_unlock(&api_stats_lock);
+  return 1;
+}
+
+static int api_endpoint_index(lua_State *L) {
+  const char *field = lua_tostring(L, -1);
+  if (strcmp(field, "get") == 0) {
+    lua_pop(L, 1);
+    lua_pushcclosure(L, api_endpoint_get, 1); // api_endpoint_t in a closure
+  } else if (strcmp(field, "post") == 0) {
+    lua_pop(L, 1);
+    lua_pushcclosure(L, api_endpoint_post, 1); // api_endpoint_t in a closure
+  } else if (strcmp(field, "put") == 0) {
+    lua_pop(L, 1);
+    lua_pushcclosure(L, api_endpoint_put, 1); // api_endpoint_t in a closure
+  } else if (strcmp(field, "delete") == 0) {
+    lua_pop(L, 1);
+    lua_pushcclosure(L, api_endpoint_delete, 1); // api_endpoint_t in a closure
+  } else if (strcmp(field, "request") == 0) {
+    lua_pop(L, 1);
+    lua_pushcclosure(L, api_endpoint_request, 1); // api_endpoint_t in a closure
+  } else if (strcmp(field, "prepare") == 0) {
+    lua_pop(L, 1);
+    lua_pushcclosure(L, api_endpoint_prepare, 1); // api_endpoint_t in a closure
+  } else if (strcmp(field, "stats") == 0) {
+    lua_pop(L, 1);
+    lua_pushcclosure(L, api_endpoint_stats, 1); // api_endpoint_t in a closure
   } else {
     lua_pushnil(L);
   }
+  return 1;
 }
 
-static json_t *api_write_json(lua_State *L) {
-  json_t *json, *value;
+static int api_endpoint_tostring(lua_State *L) {
+  api_endpoint_t *api = lua_touserdata(L, -1);
+  lua_pushfstring(L, "api: %s", api->host);
+  return 1;
+}
+
+static int api_auth_gc(lua_State *L) {
+  api_auth_t **auth = lua_touserdata(L, -1);
+
+  if (*auth) {
+    api_auth_release(L, *auth);
+  }
+  return 0;
+}
+
+static int api_endpoint_handle_response_chunk_cb(lua_State *L, const void *p,
+                                                 size_t sz, void *ud) {
+  api_endpoint_t *ep = (api_endpoint_t *)ud;
+  (void)L;
+  size_t new_len = ep->handle_response_chunk_len + sz;
+  ep->handle_response_chunk = realloc(ep->handle_response_chunk, new_len);
+  memcpy(ep->handle_response_chunk + ep->handle_response_chunk_len, p, sz);
+  ep->handle_response_chunk_len += sz;
+  return 0;
+}
+
+static int api_endpoint(lua_State *L) {
+  api_endpoint_t *ep = lua_newuserdata(L, sizeof(api_endpoint_t));
   const char *s;
-  size_t size;
-  int i, len;
+  api_auth_t *auth;
 
-  switch (lua_type(L, -1)) {
-  case LUA_TNIL:
-    json = json_null();
-    break;
-  case LUA_TBOOLEAN:
-    json = json_boolean(lua_toboolean(L, -1));
-    break;
-  case LUA_TNUMBER:
-    if (lua_isinteger(L, -1)) {
-      json = json_integer(lua_tointeger(L, -1));
-    } else {
-      json = json_real(lua_tonumber(L, -1));
+  memset(ep, 0, sizeof(api_endpoint_t));
+
+  lua_pushinteger(L, API_TYPE_ENDPOINT);
+  lua_setuservalue(L, -2);
+
+  if (!lua_istable(L, -2)) {
+    return luaL_error(L, "api: expects table as its argument");
+  }
+
+  lua_pushstring(L, "proto");
+  lua_gettable(L, -3);
+  s = lua_tostring(L, -1);
+  if (strcmp(s, API_PROTO_HTTP_STR) == 0) {
+    ep->proto = API_PROTO_HTTP;
+  } else if (strcmp(s, API_PROTO_HTTPS_STR) == 0) {
+    ep->proto = API_PROTO_HTTPS;
+  } else {
+    return luaL_error(L, "api: 'proto' should be http or https");
+  }
+  lua_pop(L, 1);
+
+  api_getstringfield(L, ep->host, "host", -2, s);
+  api_getstringfield(L, ep->path, "path", -2, s);
+  ep->base_url = api_printf("%s://%s%s", api_proto_t_str(ep->proto), ep->host,
+                            ep->path ? ep->path : "");
+  api_getstringfield(L, ep->ca_file, "ca_file", -2, s);
+  if (api_profiling) {
+    ep->profile = api_profile_endpoint(ep->base_url);
+  }
+
+  lua_getfield(L, -2, "verbose");
+  ep->verbose = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+
+  lua_getfield(L, -2, "http2");
+  ep->http2 = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+
+  ep->accept_encoding = api_getacceptencoding(L, -2);
+  api_getlimits(L, -2, &ep->limits);
+  ep->rate_limit = api_getratelimit(L, -2);
+  ep->breaker = api_getbreaker(L, -2);
+  ep->cache = api_getcache(L, -2);
+  ep->disk_cache = api_getdiskcache(L, -2);
+  ep->retry = api_getretry(L, -2);
+  ep->hedge = api_gethedge(L, -2);
+  lua_getfield(L, -2, "stats");
+  if (lua_toboolean(L, -1)) {
+    ep->stats = api_stats_create(ep->base_url);
+  }
+  lua_pop(L, 1);
+
+  ep->compress_level = COMPRESS_LEVEL_DEFAULT;
+  api_getcompress(L, -2, &ep->compress, &ep->compress_level);
+  lua_getfield(L, -2, "zstd_dict");
+  if (!lua_isnil(L, -1)) {
+    if (!compress_supported(COMPRESS_ZSTD)) {
+      return luaL_error(L, "api: zstd compression is not supported");
     }
-    break;
-  case LUA_TSTRING:
-    s = lua_tolstring(L, -1, &size);
-    json = json_stringn(s, size);
-    break;
-  case LUA_TTABLE:
-    lua_len(L, -1);
-    len = lua_tointeger(L, -1);
+    s = lua_tostring(L, -1);
+    ep->zstd_dict = compress_dict_load(s, ep->compress_level);
+    if (!ep->zstd_dict) {
+      return luaL_error(L, "api: cannot load zstd dictionary %s", s);
+    }
+  }
+  lua_pop(L, 1);
+
+  lua_pushstring(L, "auth");
+  lua_gettable(L, -3);
+  if (!lua_isnil(L, -1)) {
+    lua_getuservalue(L, -1);
+    if (lua_tointeger(L, -1) != API_TYPE_AUTH) {
+      return luaL_error(L, "api: 'auth' is not an auth type");
+    }
+    auth = *(api_auth_t **)lua_touserdata(L, -2);
+    auth->refs++;
+    ep->auth = auth;
     lua_pop(L, 1);
-    if (len > 0) {
-      // array
-      json = json_array();
-      for (i = 1; i <= len; i++) {
-        lua_geti(L, -1, i);
-        value = api_write_json(L);
-        json_array_append_new(json, value);
-      }
-    } else {
-      // object
-      json = json_object();
-      lua_pushnil(L);
-      while (lua_next(L, -2)) {
-        value = api_write_json(L);
-        s = lua_tostring(L, -1);
-        json_object_set_new(json, s, value);
+  }
+  lua_pop(L, 1);
+
+  lua_pushstring(L, "handle_response");
+  lua_gettable(L, -3);
+  if (!lua_isnil(L, -1)) {
+    lua_dump(L, api_endpoint_handle_response_chunk_cb, ep, 0);
+  }
+  lua_pop(L, 1);
+
+  lua_newtable(L);
+  lua_pushstring(L, "__gc");
+  lua_pushcfunction(L, api_endpoint_gc);
+  lua_rawset(L, -3);
+  lua_pushstring(L, "__index");
+  lua_pushcfunction(L, api_endpoint_index);
+  lua_rawset(L, -3);
+  lua_pushstring(L, "__tostring");
+  lua_pushcfunction(L, api_endpoint_tostring);
+  lua_rawset(L, -3);
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+/* Creates auth object, which shares the auth with endpoints */
+static api_auth_t *api_create_auth(lua_State *L, api_auth_type type) {
+  api_auth_t **ud = lua_newuserdata(L, sizeof(api_auth_t *));
+
+  *ud = calloc(1, sizeof(api_auth_t));
+  (*ud)->type = type;
+  (*ud)->refs = 1;
+
+  lua_pushinteger(L, API_TYPE_AUTH);
+  lua_setuservalue(L, -2);
+
+  if (luaL_newmetatable(L, API_AUTH_METATABLE)) {
+    lua_pushstring(L, "__gc");
+    lua_pushcfunction(L, api_auth_gc);
+    lua_rawset(L, -3);
+  }
+  lua_setmetatable(L, -2);
+
+  return *ud;
+}
+
+static int api_basic_auth(lua_State *L) {
+  api_auth_t *auth = api_create_auth(L, API_AUTH_BASIC);
+  const char *tmp;
+
+  if (!lua_istable(L, -2)) {
+    return luaL_error(L, "basic: expects table as its argument");
+  }
+
+  auth->basic = calloc(1, sizeof(api_basic_auth_t));
+  api_getstringfield(L, auth->basic->user, "user", -2, tmp);
+  api_getstringfield(L, auth->basic->passwd, "password", -2, tmp);
+  auth->basic->header = api_basic_auth_header(auth->basic);
+
+  return 1;
+}
+
+static int api_bearer_auth(lua_State *L) {
+  api_auth_t *auth = api_create_auth(L, API_AUTH_BEARER);
+  const char *tmp;
+
+  if (!lua_istable(L, -2)) {
+    return luaL_error(L, "bearer: expects table as its argument");
+  }
+
+  auth->bearer = calloc(1, sizeof(api_bearer_auth_t));
+  lua_getfield(L, -2, "token");
+  tmp = lua_tostring(L, -1);
+  if (!tmp) {
+    return luaL_error(L, "bearer: 'token' is missing");
+  }
+  auth->bearer->header =
+      api_printf("%s: Bearer %s", API_HEADER_AUTHORIZATION, tmp);
+  lua_pop(L, 1);
+
+  return 1;
+}
+
+static int api_sigv4_auth(lua_State *L) {
+  api_auth_t *auth = api_create_auth(L, API_AUTH_SIGV4);
+  sigv4_credentials *cred;
+  const char *tmp;
+
+  if (!lua_istable(L, -2)) {
+    return luaL_error(L, "sigv4: expects table as its argument");
+  }
+
+  cred = auth->sigv4 = calloc(1, sizeof(sigv4_credentials));
+  api_getstringfield(L, cred->access_key, "access_key", -2, tmp);
+  api_getstringfield(L, cred->secret_key, "secret_key", -2, tmp);
+  api_getstringfield(L, cred->region, "region", -2, tmp);
+  api_getstringfield(L, cred->service, "service", -2, tmp);
+  api_getstringfield(L, cred->session_token, "session_token", -2, tmp);
+  if (!cred->access_key || !cred->secret_key || !cred->region ||
+      !cred->service) {
+    return luaL_error(
+        L, "sigv4: 'access_key', 'secret_key', 'region' and 'service' are "
+           "required");
+  }
+
+  return 1;
+}
+
+static int api_jwt_auth(lua_State *L) {
+  api_auth_t *auth = api_create_auth(L, API_AUTH_JWT);
+  api_jwt_auth_t *jwt;
+  jwt_alg alg;
+  const char *tmp;
+  char *kid = NULL, *key_file = NULL;
+  size_t len;
+
+  if (!lua_istable(L, -2)) {
+    return luaL_error(L, "jwt: expects table as its argument");
+  }
+
+  jwt = auth->jwt = calloc(1, sizeof(api_jwt_auth_t));
+  jwt->claims_ref = LUA_NOREF;
+
+  lua_getfield(L, -2, "alg");
+  tmp = lua_tostring(L, -1);
+  if (!tmp || jwt_alg_parse(tmp, &alg) != 0) {
+    return luaL_error(L, "jwt: 'alg' must be HS256, RS256 or ES256");
+  }
+  lua_pop(L, 1);
+
+  api_getstringfield(L, kid, "kid", -2, tmp);
+  api_getstringfield(L, key_file, "key_file", -2, tmp);
+  lua_getfield(L, -2, "key");
+  tmp = lua_tolstring(L, -1, &len);
+  if (tmp) {
+    jwt->key = jwt_key_load(alg, tmp, len, kid);
+  } else if (key_file) {
+    jwt->key = jwt_key_load_file(alg, key_file, kid);
+  }
+  lua_pop(L, 1);
+  free(kid);
+  free(key_file);
+  if (!jwt->key) {
+    return luaL_error(L, "jwt: 'key' or 'key_file' is missing or invalid");
+  }
+
+  lua_getfield(L, -2, "claims");
+  if (lua_isfunction(L, -1)) {
+    jwt->claims_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  } else if (lua_istable(L, -1)) {
+    jwt->claims = api_write_json(L);
+  } else {
+    lua_pop(L, 1);
+  }
+  if (!json_is_object(jwt->claims)) {
+    json_decref(jwt->claims);
+    jwt->claims = json_object();
+  }
+
+  lua_getfield(L, -2, "ttl");
+  jwt->ttl = lua_isnil(L, -1) ? API_JWT_TTL : (lua_Integer)lua_tonumber(L, -1);
+  lua_pop(L, 1);
+  lua_getfield(L, -2, "reuse");
+  jwt->reuse = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+
+  return 1;
+}
+
+/* Appends url encoded form field to s */
+static void api_add_form_field(UT_string *s, const char *name,
+                               const char *value) {
+  char *escaped;
+
+  escaped = curl_easy_escape(NULL, value, 0);
+  utstring_printf(s, "%s%s=%s", utstring_len(s) ? "&" : "", name, escaped);
+  curl_free(escaped);
+}
+
+static int api_oauth2(lua_State *L) {
+  api_auth_t *auth = api_create_auth(L, API_AUTH_OAUTH2);
+  api_oauth2_auth_t *oauth2;
+  const char *fields[] = {"client_id", "client_secret", "scope"};
+  const char *tmp;
+  UT_string *s;
+  size_t i;
+
+  if (!lua_istable(L, -2)) {
+    return luaL_error(L, "oauth2: expects table as its argument");
+  }
+
+  oauth2 = auth->oauth2 = calloc(1, sizeof(api_oauth2_auth_t));
+  api_getstringfield(L, oauth2->token_url, "token_url", -2, tmp);
+  if (!oauth2->token_url) {
+    return luaL_error(L, "oauth2: 'token_url' is missing");
+  }
+
+  lua_getfield(L, -2, "refresh_before");
+  oauth2->refresh_before = lua_isnil(L, -1) ? API_OAUTH2_REFRESH_BEFORE
+                                            : lua_tonumber(L, -1);
+  lua_pop(L, 1);
+
+  utstring_new(s);
+  api_add_form_field(s, "grant_type", "client_credentials");
+  for (i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+    lua_getfield(L, -2, fields[i]);
+    tmp = lua_tostring(L, -1);
+    if (tmp) {
+      api_add_form_field(s, fields[i], tmp);
+    }
+    lua_pop(L, 1);
+  }
+  lua_getfield(L, -2, "params");
+  if (lua_istable(L, -1)) {
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+      tmp = lua_tostring(L, -1);
+      if (tmp && lua_type(L, -2) == LUA_TSTRING) {
+        api_add_form_field(s, lua_tostring(L, -2), tmp);
       }
+      lua_pop(L, 1);
     }
-    break;
-  default:
-    luaL_error(L, "write_json: unexpected type of argument");
-    return NULL;
   }
-
   lua_pop(L, 1);
-  return json;
+  oauth2->token_request = api_printf("%s", utstring_body(s));
+  utstring_free(s);
+
+  return 1;
 }
 
-static int api_from_json(lua_State *L) {
-  json_t *json;
+static int api_url_encode(lua_State *L) {
   const char *tmp;
   size_t size;
-  json_error_t err;
+  CURL *c;
+  char *escaped;
 
   if (lua_type(L, -1) != LUA_TSTRING) {
-    return luaL_error(L, "from_json: expecting string as an argument");
+    return luaL_error(L, "url_encode expects strings argument");
   }
 
+  c = curl_easy_init();
   tmp = lua_tolstring(L, -1, &size);
-  json = json_loadb(tmp, size, 0, &err);
-  if (!json) {
-    return luaL_error(L, "from_json: %s (line: %d, column: %d)", err.text,
-                      err.line, err.column);
+  escaped = curl_easy_escape(c, tmp, size);
+  if (escaped) {
+    lua_pushstring(L, escaped);
   }
+  curl_free(escaped);
+  curl_easy_cleanup(c);
 
-  lua_pop(L, 1);
-  api_read_json(L, json);
-  json_decref(json);
   return 1;
 }
 
-static int api_to_json(lua_State *L) {
-  json_t *json;
-  char *tmp;
+/* Pushes table of the response header lines. It returns the value of
+ * Content-Type header, which the caller frees, or NULL. */
+char *api_push_headers(lua_State *L, const struct curl_slist *headers) {
+  const struct curl_slist *header;
+  char *tmp, *name, *val, *content_type = NULL;
+  int len;
 
-  json = api_write_json(L);
-  tmp = json_dumps(json, 0);
-  lua_pushstring(L, tmp);
-  free(tmp);
-  json_decref(json);
+  lua_newtable(L);
+  for (header = headers; header; header = header->next) {
+    tmp = strchr(header->data, ':');
+    if (tmp) {
+      len = tmp - header->data;
+      name = malloc(len + 1);
+      memcpy(name, header->data, len);
+      name[len] = 0;
+      lua_pushstring(L, name);
+      while (isspace((int)(++tmp)[0]))
+        ;
+      len = strlen(tmp);
+      while ((len > 0) && isspace((int)tmp[len - 1]))
+        len--;
+      val = malloc(len + 1);
+      memcpy(val, tmp, len);
+      val[len] = 0;
+      lua_pushstring(L, val);
+      lua_settable(L, -3);
+      if (strcasecmp(name, API_HEADER_CONTENT_TYPE) == 0) {
+        free(content_type);
+        content_type = val;
+        val = NULL;
+      }
+      free(name);
+      free(val);
+    }
+  }
+  return content_type;
+}
 
-  return 1;
+static void api_create_result(lua_State *L, api_request_t *req) {
+  char *content_type;
+  api_endpoint_t *ep;
+  api_phase_t prev, result;
+  double start;
+
+  ep = req->endpoint;
+  prev = api_phase_enter(API_PHASE_RESULT);
+  api_phase_endpoint = ep->profile;
+  if (ep->profile) {
+    ep->profile->phases[API_PHASE_RESULT].count++;
+    ep->profile->requests++;
+    ep->profile->response_time += req->resp->total_time;
+  }
+  lua_newtable(L);
+  if (req->resp->err) {
+    lua_pushstring(L, req->resp->err);
+    lua_setfield(L, -2, "err");
+  } else {
+    lua_pushinteger(L, req->resp->status);
+    lua_setfield(L, -2, "status");
+    content_type = api_push_headers(L, req->resp->headers);
+    lua_setfield(L, -2, "headers");
+    lua_pushlstring(L, req->resp->body, req->resp->body_len);
+    if (content_type) {
+      if (strcmp(content_type, API_MIME_JSON) == 0) {
+        // malformed body raises an error
+        lua_pushcfunction(L, api_from_json);
+        lua_insert(L, -2);
+        api_phase_call(L, 1, 1, prev, NULL);
+      }
+      free(content_type);
+    }
+    lua_setfield(L, -2, "body");
+  }
+  lua_pushstring(L, req->url);
+  lua_setfield(L, -2, "url");
+  lua_pushstring(L, api_method_str(req));
+  lua_setfield(L, -2, "method");
+  lua_pushnumber(L, req->resp->total_time);
+  lua_setfield(L, -2, "total_time");
+  lua_pushinteger(L, req->attempts);
+  lua_setfield(L, -2, "attempts");
+  lua_pushinteger(L, req->hedges);
+  lua_setfield(L, -2, "hedges");
+  if (req->cache_status != API_CACHE_NONE) {
+    lua_pushstring(L, api_cache_status_str(req->cache_status));
+    lua_setfield(L, -2, "cache");
+  }
+  lua_pushinteger(L, req->resp->size_download);
+  lua_setfield(L, -2, "compressed_size");
+  lua_pushinteger(L, req->resp->body_len);
+  lua_setfield(L, -2, "decoded_size");
+
+  result = api_phase_enter(API_PHASE_HANDLER);
+  start = api_timeline ? api_now() : 0;
+  if (ep->handle_response_chunk) {
+    lua_pushvalue(L, -1);
+    luaL_loadbuffer(L, ep->handle_response_chunk, ep->handle_response_chunk_len,
+                    "handle_response");
+    lua_rotate(L, -2, 1);
+    api_phase_call(L, 1, 0, prev, NULL);
+  }
+  if (req->handle_response_chunk) {
+    lua_pushvalue(L, -1);
+    luaL_loadbuffer(L, req->handle_response_chunk,
+                    req->handle_response_chunk_len, "handle_response");
+    lua_rotate(L, -2, 1);
+    api_phase_call(L, 1, 0, prev, NULL);
+  }
+  api_phase_leave(result);
+  api_phase_leave(prev);
+  api_phase_endpoint = NULL;
+  if (api_timeline &&
+      (ep->handle_response_chunk || req->handle_response_chunk)) {
+    timeline_slice(api_timeline, "handle_response", "lua", 0, start,
+                   api_now(), 0);
+  }
 }
 
-static int api_request_handle_response_chunk_cb(lua_State *L, const void *p,
-                                                size_t sz, void *ud) {
-  api_request_t *req = (api_request_t *)ud;
-  (void)L;
-  size_t new_len = req->handle_response_chunk_len + sz;
-  req->handle_response_chunk = realloc(req->handle_response_chunk, new_len);
-  memcpy(req->handle_response_chunk + req->handle_response_chunk_len, p, sz);
-  req->handle_response_chunk_len += sz;
+/* Mints a token for the request. Claims of the table or returned by the claims
+ * function are completed by iat and exp unless they are set already. */
+static void api_mint_token(lua_State *L, api_request_t *req) {
+  api_auth_t *auth = req->endpoint->auth;
+  api_jwt_auth_t *jwt;
+  json_t *claims, *exp;
+  time_t now;
+  char *payload, *token;
+  lua_Integer reuse_before;
+
+  if (!auth || auth->type != API_AUTH_JWT) {
+    return;
+  }
+  jwt = auth->jwt;
+  api_free_signature(req);
+
+  now = time(NULL);
+  if (jwt->header && now < jwt->reuse_until) {
+    req->signature_headers[0] = api_printf("%s", jwt->header);
+    return;
+  }
+
+  if (jwt->claims_ref != LUA_NOREF) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, jwt->claims_ref);
+    lua_call(L, 0, 1);
+    if (!lua_istable(L, -1)) {
+      luaL_error(L, "jwt: claims function must return a table");
+    }
+    claims = api_write_json(L);
+    if (!json_is_object(claims)) {
+      json_decref(claims);
+      claims = json_object();
+    }
+  } else {
+    claims = json_copy(jwt->claims);
+  }
+  if (!json_object_get(claims, "iat")) {
+    json_object_set_new(claims, "iat", json_integer(now));
+  }
+  exp = json_object_get(claims, "exp");
+  if (!exp) {
+    exp = json_integer(now + jwt->ttl);
+    json_object_set_new(claims, "exp", exp);
+  }
+
+  payload = json_dumps(claims, JSON_COMPACT);
+  token = jwt_sign(jwt->key, payload, strlen(payload));
+  free(payload);
+  if (!token) {
+    json_decref(claims);
+    luaL_error(L, "jwt: cannot sign token");
+  }
+  req->signature_headers[0] =
+      api_printf("%s: Bearer %s", API_HEADER_AUTHORIZATION, token);
+  free(token);
+
+  if (jwt->reuse) {
+    reuse_before = jwt->ttl / 2 < API_JWT_REUSE_BEFORE ? jwt->ttl / 2
+                                                       : API_JWT_REUSE_BEFORE;
+    free(jwt->header);
+    jwt->header = api_printf("%s", req->signature_headers[0]);
+    // exp may be a real number, ie. os.time() + 60.0
+    jwt->reuse_until = (time_t)json_number_value(exp) - reuse_before;
+  }
+  json_decref(claims);
+}
+
+/* credentials, which are left out of traces */
+static const char *api_trace_secret_headers[] = {
+    "Authorization", "Proxy-Authorization", "Cookie", "Set-Cookie",
+    "X-Api-Key"};
+
+static int api_trace_secret(const char *header) {
+  size_t i, len;
+
+  for (i = 0; i < sizeof(api_trace_secret_headers) /
+                      sizeof(api_trace_secret_headers[0]);
+       i++) {
+    len = strlen(api_trace_secret_headers[i]);
+    if (strncasecmp(header, api_trace_secret_headers[i], len) == 0 &&
+        header[len] == ':') {
+      return 1;
+    }
+  }
   return 0;
 }
 
-static int api_create_request(lua_State *L, api_method_t method,
-                              char *custom_method) {
-  api_request_t *req = lua_newuserdata(L, sizeof(api_request_t));
-  api_endpoint_t *endpoint;
-  const char *k, *v, *tmp;
-  char *header;
-  size_t sz;
+static void api_trace_headers(UT_string *s, struct curl_slist *headers) {
+  for (; headers; headers = headers->next) {
+    if (!api_trace_secret(headers->data)) {
+      utstring_bincpy(s, headers->data, strlen(headers->data) + 1);
+    }
+  }
+}
 
-  memset(req, 0, sizeof(api_request_t));
+static struct curl_slist *api_trace_slist(const char *data, size_t len) {
+  struct curl_slist *headers = NULL;
+  const char *p, *end = data + len;
 
-  endpoint = lua_touserdata(L, lua_upvalueindex(1));
-  req->endpoint = endpoint;
-  req->method = method;
-  req->custom_method = custom_method;
+  for (p = data; p < end; p += strlen(p) + 1) {
+    headers = curl_slist_append(headers, p);
+  }
+  return headers;
+}
 
-  switch (lua_type(L, -2)) {
-  case LUA_TTABLE:
-    if (method == API_METHOD_CUSTOM) {
-      api_getstringfield(L, req->custom_method, "method", -2, tmp);
+/* Appends the requests and their results to the trace. Authorization
+ * headers are not recorded. */
+static void api_record_requests(api_request_t *head, double sent) {
+  api_request_t *req;
+  api_response_t *resp;
+  trace_record rec;
+  UT_string *req_headers, *resp_headers;
+  const char *method;
+
+  utstring_new(req_headers);
+  utstring_new(resp_headers);
+  DL_FOREACH(head, req) {
+    resp = req->resp;
+    if (!resp) {
+      continue;
     }
-    api_getstringfield(L, req->path, "path", -2, tmp);
-    lua_getfield(L, -2, "body");
-    if (!lua_isnil(L, -1)) {
-      if (lua_istable(L, -1)) {
-        api_to_json(L);
-        header = api_printf("%s: %s", API_HEADER_CONTENT_TYPE, API_MIME_JSON);
-        req->headers = curl_slist_append(req->headers, header);
-        free(header);
-      }
-      tmp = lua_tolstring(L, -1, &sz);
-      req->body = malloc(sz);
-      memcpy(req->body, tmp, sz);
-      req->body_len = sz;
+    utstring_clear(req_headers);
+    utstring_clear(resp_headers);
+    if (req->content_type) {
+      utstring_bincpy(req_headers, req->content_type,
+                      strlen(req->content_type) + 1);
     }
-    lua_pop(L, 1);
-    lua_getfield(L, -2, "headers");
-    if (lua_istable(L, -1)) {
-      lua_pushnil(L);
-      while (lua_next(L, -2)) {
-        k = lua_tostring(L, -2);
-        v = lua_tostring(L, -1);
-        header = api_printf("%s: %s", k, v);
-        req->headers = curl_slist_append(req->headers, header);
-        free(header);
-        lua_pop(L, 1);
-      }
+    if (req->content_encoding) {
+      utstring_bincpy(req_headers, req->content_encoding,
+                      strlen(req->content_encoding) + 1);
     }
-    lua_pop(L, 1);
-    lua_getfield(L, -2, "handle_response");
+    api_trace_headers(req_headers, req->headers);
+    api_trace_headers(resp_headers, resp->headers);
+
+    memset(&rec, 0, sizeof(rec));
+    rec.sent = sent - api_record_start;
+    rec.duration = resp->total_time;
+    rec.status = resp->status;
+    method = api_method_str(req);
+    rec.fields[TRACE_METHOD] = method;
+    rec.lens[TRACE_METHOD] = strlen(method);
+    rec.fields[TRACE_URL] = req->url;
+    rec.lens[TRACE_URL] = strlen(req->url);
+    rec.fields[TRACE_REQUEST_HEADERS] = utstring_body(req_headers);
+    rec.lens[TRACE_REQUEST_HEADERS] = utstring_len(req_headers);
+    rec.fields[TRACE_REQUEST_BODY] = req->body;
+    rec.lens[TRACE_REQUEST_BODY] = req->body_len;
+    rec.fields[TRACE_RESPONSE_HEADERS] = utstring_body(resp_headers);
+    rec.lens[TRACE_RESPONSE_HEADERS] = utstring_len(resp_headers);
+    rec.fields[TRACE_RESPONSE_BODY] = resp->body;
+    rec.lens[TRACE_RESPONSE_BODY] = resp->body_len;
+    rec.fields[TRACE_ERROR] = resp->err;
+    rec.lens[TRACE_ERROR] = resp->err ? strlen(resp->err) : 0;
+    trace_write(api_recorder, &rec);
+  }
+  utstring_free(req_headers);
+  utstring_free(resp_headers);
+}
+
+static int api_trace_field_eq(trace_record *rec, trace_field field,
+                              const char *data, size_t len) {
+  return rec->lens[field] == len &&
+         (len == 0 || memcmp(rec->fields[field], data, len) == 0);
+}
+
+/* Returns the first unused record of the trace with the same method, URL and
+ * body as the request */
+static trace_record *api_replay_match(api_request_t *req) {
+  const char *method = api_method_str(req);
+  trace_record *rec;
+  size_t i;
+
+  while (api_replayed_next < api_replayed_len &&
+         api_replayed_used[api_replayed_next]) {
+    api_replayed_next++;
+  }
+  for (i = api_replayed_next; i < api_replayed_len; i++) {
+    rec = &api_replayed[i];
+    if (!api_replayed_used[i] &&
+        api_trace_field_eq(rec, TRACE_METHOD, method, strlen(method)) &&
+        api_trace_field_eq(rec, TRACE_URL, req->url, strlen(req->url)) &&
+        api_trace_field_eq(rec, TRACE_REQUEST_BODY, req->body,
+                           req->body_len)) {
+      api_replayed_used[i] = 1;
+      return rec;
+    }
+  }
+  return NULL;
+}
+
+/* Sets results of the requests to the recorded responses without sending
+ * them */
+static void api_replay_responses(api_request_t *head) {
+  api_request_t *req;
+  api_response_t *resp;
+  trace_record *rec;
+
+  DL_FOREACH(head, req) {
+    rec = api_replay_match(req);
+    resp = calloc(1, sizeof(api_response_t));
+    if (!rec) {
+      resp->err = api_printf("not in trace");
+    } else if (rec->lens[TRACE_ERROR]) {
+      resp->err = api_printf("%.*s", (int)rec->lens[TRACE_ERROR],
+                             rec->fields[TRACE_ERROR]);
+    } else {
+      resp->status = rec->status;
+      resp->headers = api_trace_slist(rec->fields[TRACE_RESPONSE_HEADERS],
+                                      rec->lens[TRACE_RESPONSE_HEADERS]);
+      resp->body_len = rec->lens[TRACE_RESPONSE_BODY];
+      resp->body = malloc(resp->body_len + 1);
+      memcpy(resp->body, rec->fields[TRACE_RESPONSE_BODY], resp->body_len);
+      resp->size_download = resp->body_len;
+    }
+    if (rec) {
+      resp->total_time = rec->duration;
+    }
+    api_response_free(req->resp);
+    req->resp = resp;
+    req->attempts = rec ? 1 : 0;
+    req->hedges = 0;
+    req->cache_status = API_CACHE_NONE;
+  }
+}
+
+static int api_send(lua_State *L) {
+  int i, len;
+  api_request_t *head = NULL, *req;
+  char *err = NULL;
+  int single_req = 0;
+  const char *tmp;
+  double deadline = 0, sent;
+  api_phase_t prev;
+
+  if (lua_istable(L, 2)) {
+    lua_getfield(L, 2, "deadline");
     if (!lua_isnil(L, -1)) {
-      lua_dump(L, api_request_handle_response_chunk_cb, req, 0);
+      deadline = api_now() + lua_tonumber(L, -1);
+    }
+    lua_pop(L, 1);
+  }
+  lua_settop(L, 1);
+
+  switch (lua_type(L, -1)) {
+  case LUA_TUSERDATA:
+    lua_getuservalue(L, -1);
+    if (lua_tointeger(L, -1) != API_TYPE_REQUEST) {
+      return luaL_error(L, "send: expects request as an argument");
     }
     lua_pop(L, 1);
+    head = NULL;
+    DL_APPEND(head, (api_request_t *)lua_touserdata(L, -1));
+    single_req = 1;
     break;
-  case LUA_TSTRING:
-    tmp = (char *)lua_tostring(L, -2);
-    req->path = malloc(strlen(tmp) + 1);
-    strcpy(req->path, tmp);
+  case LUA_TTABLE:
+    lua_len(L, -1);
+    len = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    for (i = 1; i <= len; i++) {
+      lua_geti(L, -1, i);
+      req = lua_touserdata(L, -1);
+      if (!req) {
+        return luaL_error(L, "send: expects list of requests as an argument");
+      }
+      lua_pop(L, 1);
+      DL_APPEND(head, req);
+    }
     break;
   default:
-    return luaL_error(L,
-                      "request function parameter should be string or table");
+    return luaL_error(L, "send: expects request or list of requests");
+    break;
   }
 
-  if (!req->method) {
-    /* default method */
-    req->method = API_METHOD_GET;
+  // claims functions of jwt_auth are a part of the script
+  DL_FOREACH(head, req) {
+    api_mint_token(L, req);
+  }
+  prev = api_phase_enter(API_PHASE_CURL);
+
+  sent = api_now();
+  if (api_replayed) {
+    api_replay_responses(head);
+  } else {
+    api_send_requests(head, deadline, &err);
+  }
+  if (err) {
+    api_phase_leave(prev);
+    luaL_where(L, 0);
+    tmp = lua_tostring(L, -1);
+    lua_pushfstring(L, "%s %s", tmp, err);
+    free(err);
+    lua_error(L);
+  }
+  if (api_recorder) {
+    api_record_requests(head, sent);
+  }
+  api_phase_leave(prev);
+
+  if (single_req) {
+    api_create_result(L, head);
+  } else {
+    lua_newtable(L);
+    i = 1;
+    DL_FOREACH(head, req) {
+      api_create_result(L, req);
+      lua_seti(L, -2, i);
+      i++;
+    }
+  }
+  return 1;
+}
+
+static int api_url_decode(lua_State *L) {
+  const char *tmp;
+  size_t size;
+  CURL *c;
+  char *unescaped;
+  int len;
+
+  if (lua_type(L, -1) != LUA_TSTRING) {
+    return luaL_error(L, "url_decode expects strings argument");
   }
 
-  lua_pushinteger(L, API_TYPE_REQUEST);
-  lua_setuservalue(L, -2);
-
-  lua_newtable(L);
-  lua_pushstring(L, "__gc");
-  lua_pushcfunction(L, api_request_gc);
-  lua_rawset(L, -3);
-  lua_setmetatable(L, -2);
+  c = curl_easy_init();
+  tmp = lua_tolstring(L, -1, &size);
+  unescaped = curl_easy_unescape(c, tmp, size, &len);
+  if (unescaped) {
+    lua_pushstring(L, unescaped);
+  }
+  curl_free(unescaped);
+  curl_easy_cleanup(c);
 
   return 1;
 }
 
-static int api_endpoint_request(lua_State *L) {
-  return api_create_request(L, API_METHOD_CUSTOM, NULL);
+/* Returns seconds of a monotonic clock, ie. to measure elapsed time */
+static int api_lua_now(lua_State *L) {
+  lua_pushnumber(L, api_now());
+  return 1;
 }
 
-static int api_endpoint_get(lua_State *L) {
-  return api_create_request(L, API_METHOD_GET, NULL);
-}
+/* Returns metrics of endpoints as OpenMetrics text, or writes them to a file
+ * replaced atomically by rename */
+static int api_metrics(lua_State *L) {
+  const char *path = luaL_optstring(L, 1, NULL);
+  UT_string *s;
+  char *tmp;
+  FILE *f;
+  int ok;
 
-static int api_endpoint_post(lua_State *L) {
-  return api_create_request(L, API_METHOD_POST, NULL);
-}
+  utstring_new(s);
+  api_metrics_text(s);
+  if (!path) {
+    lua_pushlstring(L, utstring_body(s), utstring_len(s));
+    utstring_free(s);
+    return 1;
+  }
 
-static int api_endpoint_put(lua_State *L) {
-  return api_create_request(L, API_METHOD_PUT, NULL);
+  tmp = api_printf("%s.tmp", path);
+  f = fopen(tmp, "w");
+  ok = f && fwrite(utstring_body(s), 1, utstring_len(s), f) == utstring_len(s);
+  ok = f && fclose(f) == 0 && ok;
+  ok = ok && rename(tmp, path) == 0;
+  if (!ok) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "metrics: cannot write %s: %s", path, strerror(errno));
+    unlink(tmp);
+  } else {
+    lua_pushboolean(L, 1);
+  }
+  free(tmp);
+  utstring_free(s);
+  return ok ? 1 : 2;
 }
 
-static int api_endpoint_delete(lua_State *L) {
-  return api_create_request(L, API_METHOD_DELETE, NULL);
+/* Pushes table of phase names to their wall, cpu and count */
+static void api_push_phases(lua_State *L, const api_phase_time_t *phases) {
+  int i;
+
+  lua_newtable(L);
+  for (i = 0; i < API_PHASES; i++) {
+    lua_newtable(L);
+    lua_pushnumber(L, phases[i].wall);
+    lua_setfield(L, -2, "wall");
+    lua_pushnumber(L, phases[i].cpu);
+    lua_setfield(L, -2, "cpu");
+    lua_pushinteger(L, phases[i].count);
+    lua_setfield(L, -2, "count");
+    lua_setfield(L, -2, api_phase_names[i]);
+  }
 }
 
-static int api_endpoint_index(lua_State *L) {
-  const char *field = lua_tostring(L, -1);
-  if (strcmp(field, "get") == 0) {
-    lua_pop(L, 1);
-    lua_pushcclosure(L, api_endpoint_get, 1); // api_endpoint_t in a closure
-  } else if (strcmp(field, "post") == 0) {
-    lua_pop(L, 1);
-    lua_pushcclosure(L, api_endpoint_post, 1); // api_endpoint_t in a closure
-  } else if (strcmp(field, "put") == 0) {
-    lua_pop(L, 1);
-    lua_pushcclosure(L, api_endpoint_put, 1); // api_endpoint_t in a closure
-  } else if (strcmp(field, "delete") == 0) {
-    lua_pop(L, 1);
-    lua_pushcclosure(L, api_endpoint_delete, 1); // api_endpoint_t in a closure
-  } else if (strcmp(field, "request") == 0) {
-    lua_pop(L, 1);
-    lua_pushcclosure(L, api_endpoint_request, 1); // api_endpoint_t in a closure
-  } else {
+/* Returns the profile so far or nil unless profiling */
+static int api_profile_report(lua_State *L) {
+  api_profile_endpoint_t *p;
+
+  if (!api_profiling) {
     lua_pushnil(L);
+    return 1;
   }
-  return 1;
-}
+  // account the current phase
+  api_phase_switch(api_phase, 0);
+
+  lua_newtable(L);
+  lua_pushnumber(L, api_phase_wall - api_profile_wall);
+  lua_setfield(L, -2, "elapsed");
+  lua_pushnumber(L, api_phase_cpu - api_profile_cpu);
+  lua_setfield(L, -2, "cpu");
+  api_push_phases(L, api_phases);
+  lua_setfield(L, -2, "phases");
+
+  lua_newtable(L);
+  LL_FOREACH(api_profile_endpoints, p) {
+    lua_newtable(L);
+    lua_pushinteger(L, p->requests);
+    lua_setfield(L, -2, "requests");
+    lua_pushnumber(L, p->response_time);
+    lua_setfield(L, -2, "response_time");
+    api_push_phases(L, p->phases);
+    lua_setfield(L, -2, "phases");
+    lua_setfield(L, -2, p->url);
+  }
+  lua_setfield(L, -2, "endpoints");
 
-static int api_endpoint_tostring(lua_State *L) {
-  api_endpoint_t *api = lua_touserdata(L, -1);
-  lua_pushfstring(L, "api: %s", api->host);
   return 1;
 }
 
-static int api_auth_gc(lua_State *L) {
-  api_auth_t *auth = lua_touserdata(L, -1);
+#ifdef API_HAVE_MICROHTTPD
+/* Splits path of the route key "METHOD /path/:param" */
+static void api_route_parse(api_route_t *route, const char *key) {
+  const char *p = strchr(key, ' ');
+  size_t len;
 
-  switch (auth->type) {
-  case API_AUTH_BASIC:
-    if (auth->basic) {
-      free(auth->basic->user);
-      free(auth->basic->passwd);
-      free(auth->basic);
+  if (p) {
+    route->method = api_printf("%.*s", (int)(p - key), key);
+    key = p + 1;
+  }
+  for (p = key; *p; p += len) {
+    while (*p == '/') {
+      p++;
+    }
+    if (!*p) {
+      break;
+    }
+    len = strcspn(p, "/");
+    route->segments = realloc(route->segments,
+                              (route->segments_len + 1) * sizeof(char *));
+    route->segments[route->segments_len++] = api_printf("%.*s", (int)len, p);
+    if (*p == ':') {
+      route->params_len++;
     }
-    break;
   }
-  return 0;
-}
-
-static int api_endpoint_handle_response_chunk_cb(lua_State *L, const void *p,
-                                                 size_t sz, void *ud) {
-  api_endpoint_t *ep = (api_endpoint_t *)ud;
-  (void)L;
-  size_t new_len = ep->handle_response_chunk_len + sz;
-  ep->handle_response_chunk = realloc(ep->handle_response_chunk, new_len);
-  memcpy(ep->handle_response_chunk + ep->handle_response_chunk_len, p, sz);
-  ep->handle_response_chunk_len += sz;
-  return 0;
 }
 
-static int api_endpoint(lua_State *L) {
-  api_endpoint_t *ep = lua_newuserdata(L, sizeof(api_endpoint_t));
-  const char *s;
-  api_auth_t *auth;
-
-  memset(ep, 0, sizeof(api_endpoint_t));
-
-  lua_pushinteger(L, API_TYPE_ENDPOINT);
-  lua_setuservalue(L, -2);
+/* Matches the route with the request. If L is not NULL, values of parameters
+ * are set to the table at the top of the stack. */
+static int api_route_match(lua_State *L, api_route_t *route,
+                           const char *method, const char *url) {
+  const char *p = url, *seg;
+  size_t len;
+  int i = 0;
 
-  if (!lua_istable(L, -2)) {
-    return luaL_error(L, "api: expects table as its argument");
+  if (route->method && strcmp(route->method, method) != 0) {
+    return 0;
   }
-
-  lua_pushstring(L, "proto");
-  lua_gettable(L, -3);
-  s = lua_tostring(L, -1);
-  if (strcmp(s, API_PROTO_HTTP_STR) == 0) {
-    ep->proto = API_PROTO_HTTP;
-  } else if (strcmp(s, API_PROTO_HTTPS_STR) == 0) {
-    ep->proto = API_PROTO_HTTPS;
-  } else {
-    return luaL_error(L, "api: 'proto' should be http or https");
+  for (;; p += len) {
+    while (*p == '/') {
+      p++;
+    }
+    if (!*p) {
+      break;
+    }
+    if (i == route->segments_len) {
+      return 0;
+    }
+    len = strcspn(p, "/");
+    seg = route->segments[i++];
+    if (*seg == ':') {
+      if (L) {
+        lua_pushlstring(L, p, len);
+        lua_setfield(L, -2, seg + 1);
+      }
+    } else if (strlen(seg) != len || strncmp(seg, p, len) != 0) {
+      return 0;
+    }
   }
-  lua_pop(L, 1);
+  return i == route->segments_len;
+}
 
-  api_getstringfield(L, ep->host, "host", -2, s);
-  api_getstringfield(L, ep->path, "path", -2, s);
+/* routes with fewer parameters take precedence */
+static int api_route_cmp(const void *a, const void *b) {
+  const api_route_t *x = a, *y = b;
 
-  lua_getfield(L, -2, "verbose");
-  ep->verbose = lua_toboolean(L, -1);
-  lua_pop(L, 1);
+  return x->params_len - y->params_len;
+}
 
-  lua_pushstring(L, "auth");
-  lua_gettable(L, -3);
-  if (!lua_isnil(L, -1)) {
-    lua_getuservalue(L, -1);
-    if (lua_tointeger(L, -1) != API_TYPE_AUTH) {
-      return luaL_error(L, "api: 'auth' is not an auth type");
+static int api_route_handler_chunk_cb(lua_State *L, const void *p, size_t sz,
+                                      void *ud) {
+  api_route_t *route = ud;
+  (void)L;
+  route->handler_chunk =
+      realloc(route->handler_chunk, route->handler_chunk_len + sz);
+  memcpy(route->handler_chunk + route->handler_chunk_len, p, sz);
+  route->handler_chunk_len += sz;
+  return 0;
+}
+
+/* Creates response from a string or a table { status, headers, body } at the
+ * top of the stack, table body is encoded as json. It returns NULL if the body
+ * cannot be encoded. */
+static struct MHD_Response *api_server_response(lua_State *L,
+                                                unsigned int *status) {
+  struct MHD_Response *resp;
+  const char *body = "", *k, *v;
+  size_t len = 0;
+  int idx = lua_gettop(L), json = 0, has_type = 0;
+
+  *status = MHD_HTTP_OK;
+  if (lua_type(L, idx) == LUA_TSTRING) {
+    body = lua_tolstring(L, idx, &len);
+  } else if (lua_istable(L, idx)) {
+    lua_getfield(L, idx, "status");
+    if (lua_isinteger(L, -1)) {
+      *status = (unsigned int)lua_tointeger(L, -1);
     }
-    auth = lua_touserdata(L, -2);
-    ep->auth = malloc(sizeof(api_auth_t));
-    ep->auth->type = auth->type;
-    switch (auth->type) {
-    case API_AUTH_BASIC:
-      ep->auth->basic = auth->basic;
-      auth->basic = NULL;
-      break;
+    lua_getfield(L, idx, "body");
+    if (lua_istable(L, -1)) {
+      lua_pushcfunction(L, api_to_json);
+      lua_insert(L, -2);
+      if (lua_pcall(L, 1, 1, 0) != LUA_OK) {
+        lua_settop(L, idx);
+        return NULL;
+      }
+      json = 1;
     }
-    lua_pop(L, 1);
+    if (lua_type(L, -1) == LUA_TSTRING) {
+      body = lua_tolstring(L, -1, &len);
+    }
+  } else if (lua_isnil(L, idx)) {
+    *status = MHD_HTTP_NO_CONTENT;
   }
-  lua_pop(L, 1);
 
-  lua_pushstring(L, "handle_response");
-  lua_gettable(L, -3);
-  if (!lua_isnil(L, -1)) {
-    lua_dump(L, api_endpoint_handle_response_chunk_cb, ep, 0);
+  resp = MHD_create_response_from_buffer(len, (void *)body,
+                                         MHD_RESPMEM_MUST_COPY);
+  if (lua_istable(L, idx)) {
+    lua_getfield(L, idx, "headers");
+    if (lua_istable(L, -1)) {
+      lua_pushnil(L);
+      while (lua_next(L, -2)) {
+        k = lua_tostring(L, -2);
+        v = lua_tostring(L, -1);
+        if (k && v) {
+          MHD_add_response_header(resp, k, v);
+          has_type |= strcasecmp(k, API_HEADER_CONTENT_TYPE) == 0;
+        }
+        lua_pop(L, 1);
+      }
+    }
   }
-  lua_pop(L, 1);
-
-  lua_newtable(L);
-  lua_pushstring(L, "__gc");
-  lua_pushcfunction(L, api_endpoint_gc);
-  lua_rawset(L, -3);
-  lua_pushstring(L, "__index");
-  lua_pushcfunction(L, api_endpoint_index);
-  lua_rawset(L, -3);
-  lua_pushstring(L, "__tostring");
-  lua_pushcfunction(L, api_endpoint_tostring);
-  lua_rawset(L, -3);
-  lua_setmetatable(L, -2);
-  return 1;
+  if (json && !has_type) {
+    MHD_add_response_header(resp, API_HEADER_CONTENT_TYPE, API_MIME_JSON);
+  }
+  lua_settop(L, idx);
+  return resp;
 }
 
-static int api_basic_auth(lua_State *L) {
-  api_auth_t *auth = lua_newuserdata(L, sizeof(api_auth_t));
-  const char *tmp;
-
-  memset(auth, 0, sizeof(api_auth_t));
+static void api_server_state_free(void *L) { lua_close(L); }
 
-  lua_pushinteger(L, API_TYPE_AUTH);
-  lua_setuservalue(L, -2);
+/* Returns Lua state of the current server thread. Handlers of routes are
+ * loaded into it on the first request. */
+static lua_State *api_server_state(api_server_t *srv) {
+  lua_State *L = pthread_getspecific(srv->state);
+  api_route_t *route;
+  int i;
 
-  if (!lua_istable(L, -2)) {
-    return luaL_error(L, "basic: expects table as its argument");
+  if (L) {
+    return L;
+  }
+  L = luaL_newstate();
+  luaL_openlibs(L);
+  lua_register(L, "to_json", api_to_json);
+  lua_register(L, "from_json", api_from_json);
+  lua_newtable(L);
+  for (i = 0; i < srv->routes_len; i++) {
+    route = &srv->routes[i];
+    if (route->handler_chunk) {
+      luaL_loadbuffer(L, route->handler_chunk, route->handler_chunk_len,
+                      "handler");
+      lua_rawseti(L, -2, i + 1);
+    }
   }
+  lua_setfield(L, LUA_REGISTRYINDEX, API_SERVER_HANDLERS);
+  pthread_setspecific(srv->state, L);
+  return L;
+}
 
-  auth->type = API_AUTH_BASIC;
-  auth->basic = calloc(1, sizeof(api_basic_auth_t));
-  api_getstringfield(L, auth->basic->user, "user", -2, tmp);
-  api_getstringfield(L, auth->basic->passwd, "password", -2, tmp);
+static enum MHD_Result api_server_value(void *cls, enum MHD_ValueKind kind,
+                                        const char *key, const char *value) {
+  lua_State *L = cls;
+  (void)kind;
 
-  lua_newtable(L);
-  lua_pushstring(L, "__gc");
-  lua_pushcfunction(L, api_auth_gc);
-  lua_rawset(L, -3);
-  lua_setmetatable(L, -2);
-  return 1;
+  lua_pushstring(L, value ? value : "");
+  lua_setfield(L, -2, key);
+  return MHD_YES;
 }
 
-static int api_url_encode(lua_State *L) {
-  const char *tmp;
-  size_t size;
-  CURL *c;
-  char *escaped;
+/* Queues metrics of endpoints, they are rendered by the server thread */
+static enum MHD_Result api_server_metrics(struct MHD_Connection *connection) {
+  struct MHD_Response *resp;
+  enum MHD_Result ret;
+  UT_string *s;
 
-  if (lua_type(L, -1) != LUA_TSTRING) {
-    return luaL_error(L, "url_encode expects strings argument");
-  }
+  utstring_new(s);
+  api_metrics_text(s);
+  resp = MHD_create_response_from_buffer(utstring_len(s), utstring_body(s),
+                                         MHD_RESPMEM_MUST_COPY);
+  utstring_free(s);
+  MHD_add_response_header(resp, "Content-Type", API_METRICS_CONTENT_TYPE);
+  ret = MHD_queue_response(connection, MHD_HTTP_OK, resp);
+  MHD_destroy_response(resp);
+  return ret;
+}
 
-  c = curl_easy_init();
-  tmp = lua_tolstring(L, -1, &size);
-  escaped = curl_easy_escape(c, tmp, size);
-  if (escaped) {
-    lua_pushstring(L, escaped);
+/* Calls handler of the route with a request table and queues its response */
+static enum MHD_Result api_server_call(api_server_t *srv,
+                                       struct MHD_Connection *connection,
+                                       api_server_request_t *sreq,
+                                       const char *url, const char *method) {
+  lua_State *L = api_server_state(srv);
+  struct MHD_Response *resp = NULL;
+  unsigned int status;
+  enum MHD_Result ret;
+
+  lua_getfield(L, LUA_REGISTRYINDEX, API_SERVER_HANDLERS);
+  lua_rawgeti(L, -1, (lua_Integer)(sreq->route - srv->routes) + 1);
+  lua_createtable(L, 0, 6);
+  lua_pushstring(L, method);
+  lua_setfield(L, -2, "method");
+  lua_pushstring(L, url);
+  lua_setfield(L, -2, "path");
+  lua_newtable(L);
+  api_route_match(L, sreq->route, method, url);
+  lua_setfield(L, -2, "params");
+  lua_newtable(L);
+  MHD_get_connection_values(connection, MHD_GET_ARGUMENT_KIND,
+                            api_server_value, L);
+  lua_setfield(L, -2, "query");
+  lua_newtable(L);
+  MHD_get_connection_values(connection, MHD_HEADER_KIND, api_server_value, L);
+  lua_setfield(L, -2, "headers");
+  lua_pushlstring(L, utstring_body(sreq->body), utstring_len(sreq->body));
+  lua_setfield(L, -2, "body");
+
+  if (lua_pcall(L, 1, 1, 0) == LUA_OK) {
+    resp = api_server_response(L, &status);
   }
-  curl_free(escaped);
-  curl_easy_cleanup(c);
+  if (!resp) {
+    fprintf(stderr, "serve: %s %s: %s\n", method, url,
+            lua_isstring(L, -1) ? lua_tostring(L, -1) : "invalid response");
+    status = MHD_HTTP_INTERNAL_SERVER_ERROR;
+    resp = MHD_create_response_from_buffer(0, "", MHD_RESPMEM_PERSISTENT);
+  }
+  lua_settop(L, 0);
 
-  return 1;
+  ret = MHD_queue_response(connection, status, resp);
+  MHD_destroy_response(resp);
+  return ret;
 }
-static void api_create_result(lua_State *L, api_request_t *req) {
-  struct curl_slist *header;
-  char *tmp, *name, *val, *content_type;
-  int i, len;
-  api_endpoint_t *ep;
 
-  ep = req->endpoint;
-  lua_newtable(L);
-  if (req->resp->err) {
-    lua_pushstring(L, req->resp->err);
-    lua_setfield(L, -2, "err");
-  } else {
-    lua_pushinteger(L, req->resp->status);
-    lua_setfield(L, -2, "status");
-    content_type = NULL;
-    lua_newtable(L);
-    for (i = 0, header = req->resp->headers; header;
-         i++, header = header->next) {
-      tmp = strchr(header->data, ':');
-      if (tmp) {
-        len = tmp - header->data;
-        name = malloc(len + 1);
-        memcpy(name, header->data, len);
-        name[len] = 0;
-        lua_pushstring(L, name);
-        while (isspace((int)(++tmp)[0]))
-          ;
-        len = strlen(tmp);
-        while ((len > 0) && isspace((int)tmp[len - 1]))
-          len--;
-        val = malloc(len + 1);
-        memcpy(val, tmp, len);
-        val[len] = 0;
-        lua_pushstring(L, val);
-        lua_settable(L, -3);
-        if (strcasecmp(name, API_HEADER_CONTENT_TYPE) == 0) {
-          content_type = val;
-          val = NULL;
-        }
-        free(name);
-        free(val);
+static enum MHD_Result
+api_server_handler(void *cls, struct MHD_Connection *connection,
+                   const char *url, const char *method, const char *version,
+                   const char *upload_data, size_t *upload_data_size,
+                   void **con_cls) {
+  api_server_t *srv = cls;
+  api_server_request_t *sreq = *con_cls;
+  api_route_t *route = NULL;
+  int i;
+
+  (void)version;
+
+  if (!sreq) {
+    for (i = 0; i < srv->routes_len && !route; i++) {
+      if (api_route_match(NULL, &srv->routes[i], method, url)) {
+        route = &srv->routes[i];
       }
     }
-    lua_setfield(L, -2, "headers");
-    lua_pushlstring(L, req->resp->body, req->resp->body_len);
-    if (content_type) {
-      if (strcmp(content_type, API_MIME_JSON) == 0) {
-        api_from_json(L);
+    // static responses to requests without body are queued at once
+    if (!MHD_lookup_connection_value(connection, MHD_HEADER_KIND,
+                                     "Content-Length") &&
+        !MHD_lookup_connection_value(connection, MHD_HEADER_KIND,
+                                     "Transfer-Encoding")) {
+      if (!route) {
+        return MHD_queue_response(connection, MHD_HTTP_NOT_FOUND,
+                                  srv->not_found);
       }
-      free(content_type);
+      if (route->response) {
+        return MHD_queue_response(connection, route->status,
+                                  route->response);
+      }
+      if (route->metrics) {
+        return api_server_metrics(connection);
+      }
+    }
+    sreq = calloc(1, sizeof(api_server_request_t));
+    sreq->route = route;
+    if (route && route->handler_chunk) {
+      utstring_new(sreq->body);
+    }
+    *con_cls = sreq;
+    return MHD_YES;
+  }
+
+  if (*upload_data_size) {
+    if (sreq->body) {
+      utstring_bincpy(sreq->body, upload_data, *upload_data_size);
     }
-    lua_setfield(L, -2, "body");
+    *upload_data_size = 0;
+    return MHD_YES;
   }
-  lua_pushstring(L, req->resp->url);
-  lua_setfield(L, -2, "url");
-  lua_pushstring(L, api_method_str(req));
-  lua_setfield(L, -2, "method");
-  lua_pushnumber(L, req->resp->total_time);
-  lua_setfield(L, -2, "total_time");
 
-  if (ep->handle_response_chunk) {
-    lua_pushvalue(L, -1);
-    luaL_loadbuffer(L, ep->handle_response_chunk, ep->handle_response_chunk_len,
-                    "handle_response");
-    lua_rotate(L, -2, 1);
-    lua_call(L, 1, 0);
+  if (!sreq->route) {
+    return MHD_queue_response(connection, MHD_HTTP_NOT_FOUND, srv->not_found);
   }
-  if (req->handle_response_chunk) {
-    lua_pushvalue(L, -1);
-    luaL_loadbuffer(L, req->handle_response_chunk,
-                    req->handle_response_chunk_len, "handle_response");
-    lua_rotate(L, -2, 1);
-    lua_call(L, 1, 0);
+  if (sreq->route->response) {
+    return MHD_queue_response(connection, sreq->route->status,
+                              sreq->route->response);
   }
+  if (sreq->route->metrics) {
+    return api_server_metrics(connection);
+  }
+  return api_server_call(srv, connection, sreq, url, method);
 }
 
-static int api_send(lua_State *L) {
-  int i, len;
-  api_request_t *head = NULL, *req;
-  char *err = NULL;
-  int single_req = 0;
-  const char *tmp;
+static void api_server_completed(void *cls, struct MHD_Connection *connection,
+                                 void **con_cls,
+                                 enum MHD_RequestTerminationCode toe) {
+  api_server_request_t *sreq = *con_cls;
 
-  switch (lua_type(L, -1)) {
-  case LUA_TUSERDATA:
-    lua_getuservalue(L, -1);
-    if (lua_tointeger(L, -1) != API_TYPE_REQUEST) {
-      return luaL_error(L, "send: expects request as an argument");
+  (void)cls;
+  (void)connection;
+  (void)toe;
+
+  if (sreq) {
+    if (sreq->body) {
+      utstring_free(sreq->body);
     }
-    lua_pop(L, 1);
-    head = lua_touserdata(L, -1);
-    single_req = 1;
-    break;
-  case LUA_TTABLE:
-    lua_len(L, -1);
-    len = lua_tointeger(L, -1);
-    lua_pop(L, 1);
-    for (i = 1; i <= len; i++) {
-      lua_geti(L, -1, i);
-      req = lua_touserdata(L, -1);
-      if (!req) {
-        return luaL_error(L, "send: expects list of requests as an argument");
-      }
-      lua_pop(L, 1);
-      DL_APPEND(head, req);
+    free(sreq);
+    *con_cls = NULL;
+  }
+}
+
+static void api_server_stop(api_server_t *srv) {
+  if (srv->daemon) {
+    MHD_stop_daemon(srv->daemon);
+    srv->daemon = NULL;
+  }
+}
+
+static int api_server_gc(lua_State *L) {
+  api_server_t *srv = lua_touserdata(L, 1);
+  api_route_t *route;
+  int i, j;
+
+  // threads of the daemon close their Lua states when they exit
+  api_server_stop(srv);
+  if (srv->has_state) {
+    pthread_key_delete(srv->state);
+  }
+  for (i = 0; i < srv->routes_len; i++) {
+    route = &srv->routes[i];
+    free(route->method);
+    for (j = 0; j < route->segments_len; j++) {
+      free(route->segments[j]);
     }
-    break;
-  default:
-    return luaL_error(L, "send: expects request or list of requests");
-    break;
+    free(route->segments);
+    if (route->response) {
+      MHD_destroy_response(route->response);
+    }
+    free(route->handler_chunk);
+  }
+  free(srv->routes);
+  if (srv->not_found) {
+    MHD_destroy_response(srv->not_found);
   }
+  return 0;
+}
 
-  api_send_requests(head, &err);
-  if (err) {
-    luaL_where(L, 0);
-    tmp = lua_tostring(L, -1);
-    lua_pushfstring(L, "%s %s", tmp, err);
-    free(err);
-    lua_error(L);
+static int api_server_stop_method(lua_State *L) {
+  api_server_stop(luaL_checkudata(L, 1, API_SERVER_METATABLE));
+  return 0;
+}
+
+/* Blocks the script for a number of seconds or forever, while the server
+ * threads are serving requests */
+static int api_server_wait(lua_State *L) {
+  struct timespec ts;
+  double seconds;
+
+  luaL_checkudata(L, 1, API_SERVER_METATABLE);
+  if (lua_isnoneornil(L, 2)) {
+    for (;;) {
+      pause();
+    }
   }
+  seconds = luaL_checknumber(L, 2);
+  ts.tv_sec = (time_t)seconds;
+  ts.tv_nsec = (long)((seconds - ts.tv_sec) * 1e9);
+  while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+    ;
+  return 0;
+}
 
-  if (single_req) {
-    api_create_result(L, head);
+static int api_server_index(lua_State *L) {
+  api_server_t *srv = lua_touserdata(L, 1);
+  const char *field = lua_tostring(L, 2);
+
+  if (!field) {
+    lua_pushnil(L);
+  } else if (strcmp(field, "port") == 0) {
+    lua_pushinteger(L, srv->port);
+  } else if (strcmp(field, "stop") == 0) {
+    lua_pushcfunction(L, api_server_stop_method);
+  } else if (strcmp(field, "wait") == 0) {
+    lua_pushcfunction(L, api_server_wait);
   } else {
-    lua_newtable(L);
-    i = 1;
-    DL_FOREACH(head, req) {
-      api_create_result(L, req);
-      lua_seti(L, -2, i);
-      i++;
-    }
+    lua_pushnil(L);
   }
   return 1;
 }
 
-static int api_url_decode(lua_State *L) {
-  const char *tmp;
-  size_t size;
-  CURL *c;
-  char *unescaped;
-  int len;
+/* Starts embedded HTTP server running on its own threads */
+static int api_serve(lua_State *L) {
+  api_server_t *srv;
+  api_route_t *route;
+  const union MHD_DaemonInfo *info;
+  lua_Integer port = API_SERVER_PORT, threads;
+  const char *key;
+  sigset_t sigprof, mask;
 
-  if (lua_type(L, -1) != LUA_TSTRING) {
-    return luaL_error(L, "url_decode expects strings argument");
+  if (!lua_istable(L, 1)) {
+    return luaL_error(L, "serve: expects table as its argument");
+  }
+  lua_settop(L, 1);
+  threads = sysconf(_SC_NPROCESSORS_ONLN);
+  lua_getfield(L, 1, "port");
+  if (!lua_isnil(L, -1)) {
+    port = lua_tointeger(L, -1);
+  }
+  lua_getfield(L, 1, "threads");
+  if (!lua_isnil(L, -1)) {
+    threads = lua_tointeger(L, -1);
+  }
+  lua_pop(L, 2);
+  if (port < 0 || port > 65535 || threads < 1) {
+    return luaL_error(L, "serve: invalid 'port' or 'threads'");
   }
 
-  c = curl_easy_init();
-  tmp = lua_tolstring(L, -1, &size);
-  unescaped = curl_easy_unescape(c, tmp, size, &len);
-  if (unescaped) {
-    lua_pushstring(L, unescaped);
+  srv = lua_newuserdata(L, sizeof(api_server_t));
+  memset(srv, 0, sizeof(api_server_t));
+  lua_pushinteger(L, API_TYPE_SERVER);
+  lua_setuservalue(L, -2);
+  if (luaL_newmetatable(L, API_SERVER_METATABLE)) {
+    lua_pushstring(L, "__gc");
+    lua_pushcfunction(L, api_server_gc);
+    lua_rawset(L, -3);
+    lua_pushstring(L, "__index");
+    lua_pushcfunction(L, api_server_index);
+    lua_rawset(L, -3);
   }
-  curl_free(unescaped);
-  curl_easy_cleanup(c);
+  lua_setmetatable(L, -2);
+
+  lua_getfield(L, 1, "routes");
+  if (!lua_istable(L, -1)) {
+    return luaL_error(L, "serve: 'routes' should be a table");
+  }
+  lua_pushnil(L);
+  while (lua_next(L, -2)) {
+    if (lua_type(L, -2) != LUA_TSTRING) {
+      return luaL_error(L, "serve: route should be a string");
+    }
+    key = lua_tostring(L, -2);
+    srv->routes =
+        realloc(srv->routes, (srv->routes_len + 1) * sizeof(api_route_t));
+    route = &srv->routes[srv->routes_len++];
+    memset(route, 0, sizeof(api_route_t));
+    api_route_parse(route, key);
+    if (lua_tocfunction(L, -1) == api_metrics) {
+      route->metrics = 1;
+    } else if (lua_iscfunction(L, -1)) {
+      // handlers run in other Lua states, only Lua functions can be dumped
+      return luaL_error(L, "serve: handler of %s must be a Lua function", key);
+    } else if (lua_isfunction(L, -1)) {
+      if (lua_dump(L, api_route_handler_chunk_cb, route, 0) != 0 ||
+          !route->handler_chunk) {
+        return luaL_error(L, "serve: cannot dump handler of %s", key);
+      }
+    } else {
+      route->response = api_server_response(L, &route->status);
+      if (!route->response) {
+        return luaL_error(L, "serve: cannot encode response of %s", key);
+      }
+    }
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+  if (srv->routes_len > 1) {
+    qsort(srv->routes, srv->routes_len, sizeof(api_route_t), api_route_cmp);
+  }
+
+  srv->not_found =
+      MHD_create_response_from_buffer(0, "", MHD_RESPMEM_PERSISTENT);
+  if (pthread_key_create(&srv->state, api_server_state_free) != 0) {
+    return luaL_error(L, "serve: cannot create thread state");
+  }
+  srv->has_state = 1;
+  // threads of the server inherit the mask, the profiler samples the script
+  sigemptyset(&sigprof);
+  sigaddset(&sigprof, SIGPROF);
+  pthread_sigmask(SIG_BLOCK, &sigprof, &mask);
+  srv->daemon = MHD_start_daemon(
+      MHD_USE_AUTO_INTERNAL_THREAD | MHD_USE_ERROR_LOG, (uint16_t)port, NULL,
+      NULL, api_server_handler, srv, MHD_OPTION_THREAD_POOL_SIZE,
+      (unsigned int)threads, MHD_OPTION_NOTIFY_COMPLETED,
+      api_server_completed, srv, MHD_OPTION_END);
+  pthread_sigmask(SIG_SETMASK, &mask, NULL);
+  if (!srv->daemon) {
+    return luaL_error(L, "serve: cannot start server on port %d", (int)port);
+  }
+  info = MHD_get_daemon_info(srv->daemon, MHD_DAEMON_INFO_BIND_PORT);
+  srv->port = info ? info->port : (int)port;
 
   return 1;
 }
+#endif
+
+/* Counts the stack of the script as a line of frames from the root */
+static void api_lua_profile_hook(lua_State *L, lua_Debug *ar) {
+  char stack[API_LUA_PROFILE_DEPTH * (LUA_IDSIZE + 32)];
+  size_t len = 0;
+  int depth, level, n;
+
+  (void)ar;
+  lua_sethook(L, NULL, 0, 0);
+  for (depth = 0; lua_getstack(L, depth, ar); depth++) {
+  }
+  level = depth > API_LUA_PROFILE_DEPTH ? API_LUA_PROFILE_DEPTH : depth;
+  while (level-- > 0 && lua_getstack(L, level, ar)) {
+    lua_getinfo(L, "Sn", ar);
+    if (*ar->what == 'C') {
+      n = snprintf(stack + len, sizeof(stack) - len, "%s[C] %s",
+                   len ? ";" : "", ar->name ? ar->name : "?");
+    } else if (*ar->what == 'm') {
+      n = snprintf(stack + len, sizeof(stack) - len, "%smain (%s)",
+                   len ? ";" : "", ar->short_src);
+    } else {
+      n = snprintf(stack + len, sizeof(stack) - len, "%s%s (%s:%d)",
+                   len ? ";" : "", ar->name ? ar->name : "?", ar->short_src,
+                   ar->linedefined);
+    }
+    if (n < 0 || (size_t)n >= sizeof(stack) - len) {
+      break;
+    }
+    len += n;
+  }
+  if (len) {
+    folded_add(api_lua_profile_stacks, stack, len);
+  }
+}
+
+/* lua_sethook is safe in a signal handler only on the thread running
+ * the state. The process-wide signal may land on a thread of libcurl, which
+ * passes it to the script thread. */
+static void api_lua_profile_signal(int sig) {
+  if (!api_on_main_thread()) {
+    pthread_kill(api_main_thread, sig);
+    return;
+  }
+  lua_sethook(api_lua_profile_state, api_lua_profile_hook, LUA_MASKCOUNT, 1);
+}
+
+static void api_lua_profile_stop(void) {
+  struct itimerval timer = {0};
+
+  if (!api_lua_profile_state) {
+    return;
+  }
+  setitimer(ITIMER_PROF, &timer, NULL);
+  // a signal passed by another thread may still be pending
+  signal(SIGPROF, SIG_IGN);
+  lua_sethook(api_lua_profile_state, NULL, 0, 0);
+  api_lua_profile_state = NULL;
+}
 
 lua_State *api_init(char **err) {
   lua_State *L;
   CURLcode res;
 
+  api_main_thread = pthread_self();
+
   res = curl_global_init(CURL_GLOBAL_DEFAULT);
   if (res != 0) {
     *err = api_printf("%s", curl_easy_strerror(res));
@@ -971,6 +5129,18 @@ lua_State *api_init(char **err) {
   // basic function
   lua_register(L, "basic_auth", api_basic_auth);
 
+  // bearer function
+  lua_register(L, "bearer_auth", api_bearer_auth);
+
+  // oauth2 function
+  lua_register(L, "oauth2", api_oauth2);
+
+  // sigv4 function
+  lua_register(L, "sigv4_auth", api_sigv4_auth);
+
+  // jwt_auth function
+  lua_register(L, "jwt_auth", api_jwt_auth);
+
   // send function
   lua_register(L, "send", api_send);
 
@@ -986,12 +5156,410 @@ lua_State *api_init(char **err) {
   // url_decode function
   lua_register(L, "url_decode", api_url_decode);
 
+  // now function
+  lua_register(L, "now", api_lua_now);
+
+  // metrics function
+  lua_register(L, "metrics", api_metrics);
+
+  // profile_report function
+  lua_register(L, "profile_report", api_profile_report);
+
+#ifdef API_HAVE_MICROHTTPD
+  // serve function
+  lua_register(L, "serve", api_serve);
+#endif
+
   return L;
 }
 
 void api_cleanup(lua_State *L) {
+  api_profile_endpoint_t *p, *tmp;
+
+  // the timer must not touch the closed state
+  api_lua_profile_stop();
+  folded_free(api_lua_profile_stacks);
+  api_lua_profile_stacks = NULL;
+  free(api_lua_profile_path);
+  api_lua_profile_path = NULL;
   if (L) {
     lua_close(L);
   }
+  trace_writer_close(api_recorder);
+  api_recorder = NULL;
+  free(api_replayed);
+  free(api_replayed_used);
+  api_replayed = NULL;
+  api_replayed_len = 0;
+  trace_reader_close(api_replay_reader);
+  api_replay_reader = NULL;
+  LL_FOREACH_SAFE(api_profile_endpoints, p, tmp) {
+    LL_DELETE(api_profile_endpoints, p);
+    free(p->url);
+    free(p);
+  }
+  api_profiling = 0;
+  // refreshes were removed by garbage collection of their auth objects
+  if (api_refresh_multi) {
+    curl_multi_cleanup(api_refresh_multi);
+    api_refresh_multi = NULL;
+  }
+  timeline_free(api_timeline);
+  api_timeline = NULL;
+  free(api_timeline_path);
+  api_timeline_path = NULL;
+  free(api_timeline_lanes);
+  api_timeline_lanes = NULL;
+  api_timeline_lanes_len = 0;
+  api_timeline_in_flight = 0;
   curl_global_cleanup();
 }
+
+/* Reads all records of a trace, their fields point into the mapped file of
+ * the returned reader */
+static trace_record *api_trace_load(const char *path, trace_reader **reader,
+                                    size_t *len, char **err) {
+  trace_record *recs = NULL;
+  size_t size = 0;
+
+  *len = 0;
+  *reader = trace_reader_open(path);
+  if (!*reader) {
+    *err = api_printf("cannot open trace %s: %s", path, strerror(errno));
+    return NULL;
+  }
+  for (;;) {
+    if (*len == size) {
+      size = size ? size * 2 : 64;
+      recs = realloc(recs, size * sizeof(trace_record));
+    }
+    if (!trace_read(*reader, &recs[*len])) {
+      break;
+    }
+    (*len)++;
+  }
+  return recs;
+}
+
+/* Records requests sent by scripts and their results to a trace file */
+int api_record(const char *path, char **err) {
+  api_recorder = trace_writer_open(path);
+  if (!api_recorder) {
+    *err = api_printf("cannot create trace %s: %s", path, strerror(errno));
+    return -1;
+  }
+  api_record_start = api_now();
+  return 0;
+}
+
+/* Returns recorded responses to requests sent by scripts instead of sending
+ * them. Requests are matched by method, URL and body in the recorded order. */
+int api_replay(const char *path, char **err) {
+  api_replayed = api_trace_load(path, &api_replay_reader, &api_replayed_len,
+                                err);
+  if (!api_replayed) {
+    return -1;
+  }
+  api_replayed_used = calloc(api_replayed_len + 1, 1);
+  api_replayed_next = 0;
+  return 0;
+}
+
+/* Samples stacks of the script in CPU time, they are written as folded
+ * stacks by api_lua_profile_write. Coroutines are sampled when they return
+ * to the main thread. */
+int api_lua_profile(lua_State *L, const char *path, char **err) {
+  struct sigaction sa;
+  struct itimerval timer = {0};
+
+  api_lua_profile_stacks =
+      folded_new(API_LUA_PROFILE_STACKS, API_LUA_PROFILE_BYTES);
+  if (!api_lua_profile_stacks) {
+    *err = api_printf("cannot allocate profile");
+    return -1;
+  }
+  api_lua_profile_path = api_printf("%s", path);
+  api_lua_profile_state = L;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = api_lua_profile_signal;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  timer.it_interval.tv_usec = API_LUA_PROFILE_INTERVAL;
+  timer.it_value.tv_usec = API_LUA_PROFILE_INTERVAL;
+  if (sigaction(SIGPROF, &sa, NULL) != 0 ||
+      setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+    *err = api_printf("cannot start profile timer: %s", strerror(errno));
+    api_lua_profile_stop();
+    return -1;
+  }
+  return 0;
+}
+
+int api_lua_profile_write(char **err) {
+  if (!api_lua_profile_stacks) {
+    return 0;
+  }
+  api_lua_profile_stop();
+  if (folded_write(api_lua_profile_stacks, api_lua_profile_path)) {
+    *err = api_printf("cannot write profile %s: %s", api_lua_profile_path,
+                      strerror(errno));
+    return -1;
+  }
+  // the profile is still usable, so missing samples don't fail the run
+  if (folded_dropped(api_lua_profile_stacks)) {
+    fprintf(stderr, "profile %s misses %zu samples of too many stacks\n",
+            api_lua_profile_path, folded_dropped(api_lua_profile_stacks));
+  }
+  return 0;
+}
+
+/* Keeps a timeline of requests sent by scripts, which is written to a file in
+ * Chrome trace event format by api_trace_write */
+int api_trace(const char *path, char **err) {
+  api_timeline = timeline_new(API_TIMELINE_EVENTS);
+  if (!api_timeline) {
+    *err = api_printf("cannot allocate timeline");
+    return -1;
+  }
+  api_timeline_path = api_printf("%s", path);
+  api_timeline_origin = api_now();
+  return 0;
+}
+
+int api_trace_write(char **err) {
+  if (!api_timeline) {
+    return 0;
+  }
+  if (timeline_write(api_timeline, api_timeline_path, api_timeline_origin)) {
+    *err = api_printf("cannot write timeline %s: %s", api_timeline_path,
+                      strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+/* Measures wall and CPU time of the phases of the client, in total and per
+ * endpoint, from now on */
+void api_profile_enable(void) {
+  api_profiling = 1;
+  api_phase = API_PHASE_SCRIPT;
+  api_profile_wall = api_phase_wall = api_now();
+  api_profile_cpu = api_phase_cpu = api_cpu_now();
+}
+
+static void api_profile_print_phases(FILE *f, const api_phase_time_t *phases,
+                                     double elapsed) {
+  int i;
+
+  fprintf(f, "  %-8s %10s %7s %10s %10s\n", "phase", "wall s", "wall %",
+          "cpu s", "count");
+  for (i = 0; i < API_PHASES; i++) {
+    if (!phases[i].count && !phases[i].wall) {
+      continue;
+    }
+    fprintf(f, "  %-8s %10.4f %6.1f%% %10.4f %10ld\n", api_phase_names[i],
+            phases[i].wall, elapsed ? 100 * phases[i].wall / elapsed : 0,
+            phases[i].cpu, phases[i].count);
+  }
+}
+
+/* Prints the breakdown of the profile to f */
+void api_profile_print(FILE *f) {
+  api_profile_endpoint_t *p;
+  double elapsed;
+
+  if (!api_profiling) {
+    return;
+  }
+  api_phase_switch(api_phase, 0);
+  elapsed = api_phase_wall - api_profile_wall;
+
+  fprintf(f, "profile: %.4f s elapsed, %.4f s cpu\n", elapsed,
+          api_phase_cpu - api_profile_cpu);
+  api_profile_print_phases(f, api_phases, elapsed);
+  LL_FOREACH(api_profile_endpoints, p) {
+    fprintf(f, "endpoint %s: %ld requests, %.4f s response time\n", p->url,
+            p->requests, p->response_time);
+    api_profile_print_phases(f, p->phases, elapsed);
+  }
+}
+
+/* Request re-issued by api_replay_traffic */
+typedef struct {
+  trace_record *rec;
+  CURL *c;
+  struct curl_slist *headers;
+  char *url;
+  char *method;
+  long status;
+  double total_time;
+  int failed;
+} api_replay_t;
+
+static size_t api_write_discard(char *buf, size_t l, size_t n, void *data) {
+  (void)buf;
+  (void)data;
+  return l * n;
+}
+
+/* Returns URL with host (and optional port after colon) replaced */
+static char *api_replace_host(const char *url, const char *host) {
+  CURLU *u = curl_url();
+  char *h = api_printf("%s", host), *port, *tmp, *res = NULL;
+
+  port = strrchr(h, ':');
+  if (port && !strchr(port, ']')) {
+    *port++ = 0;
+  } else {
+    port = NULL;
+  }
+  if (curl_url_set(u, CURLUPART_URL, url, 0) == CURLUE_OK &&
+      curl_url_set(u, CURLUPART_HOST, h, 0) == CURLUE_OK &&
+      (!port || curl_url_set(u, CURLUPART_PORT, port, 0) == CURLUE_OK) &&
+      curl_url_get(u, CURLUPART_URL, &tmp, 0) == CURLUE_OK) {
+    res = api_printf("%s", tmp);
+    curl_free(tmp);
+  }
+  curl_url_cleanup(u);
+  free(h);
+  return res;
+}
+
+static CURL *api_replay_handle(api_replay_t *r, const char *host) {
+  trace_record *rec = r->rec;
+  CURL *c;
+  char *url;
+
+  r->url = api_printf("%.*s", (int)rec->lens[TRACE_URL], rec->fields[TRACE_URL]);
+  if (host) {
+    url = api_replace_host(r->url, host);
+    free(r->url);
+    r->url = url;
+    if (!r->url) {
+      return NULL;
+    }
+  }
+  r->method = api_printf("%.*s", (int)rec->lens[TRACE_METHOD],
+                         rec->fields[TRACE_METHOD]);
+  r->headers = api_trace_slist(rec->fields[TRACE_REQUEST_HEADERS],
+                               rec->lens[TRACE_REQUEST_HEADERS]);
+
+  c = curl_easy_init();
+  if (!c) {
+    return NULL;
+  }
+  curl_easy_setopt(c, CURLOPT_URL, r->url);
+  curl_easy_setopt(c, CURLOPT_PRIVATE, r);
+  curl_easy_setopt(c, CURLOPT_WRITEFUNCTION, api_write_discard);
+  curl_easy_setopt(c, CURLOPT_TIMEOUT, API_REPLAY_TIMEOUT);
+  curl_easy_setopt(c, CURLOPT_HTTPHEADER, r->headers);
+  if (strcmp(r->method, API_METHOD_GET_STR) != 0) {
+    curl_easy_setopt(c, CURLOPT_POSTFIELDSIZE_LARGE,
+                     (curl_off_t)rec->lens[TRACE_REQUEST_BODY]);
+    curl_easy_setopt(c, CURLOPT_POSTFIELDS, rec->fields[TRACE_REQUEST_BODY]);
+    curl_easy_setopt(c, CURLOPT_CUSTOMREQUEST, r->method);
+  }
+  return c;
+}
+
+static double api_replay_percentile(double *values, size_t len, double p) {
+  size_t i = (size_t)(p * len);
+
+  if (len == 0) {
+    return 0;
+  }
+  qsort(values, len, sizeof(double), api_latency_cmp);
+  return values[i < len ? i : len - 1];
+}
+
+/* Sends the requests of a trace with the recorded inter-arrival times divided
+ * by speed, optionally to another host, and prints a summary */
+int api_replay_traffic(const char *path, double speed, const char *host,
+                       char **err) {
+  trace_reader *reader;
+  trace_record *recs;
+  api_replay_t *replays, *r;
+  CURLM *cm;
+  CURLMsg *msg;
+  size_t len, next = 0, done = 0, failed = 0, mismatched = 0, i, n = 0;
+  int running = 0, msgs_left, timeout;
+  double start, now, delay, *recorded, *replayed;
+
+  recs = api_trace_load(path, &reader, &len, err);
+  if (!recs) {
+    return -1;
+  }
+  replays = calloc(len + 1, sizeof(api_replay_t));
+  cm = curl_multi_init();
+
+  start = api_now();
+  while (next < len || running) {
+    now = api_now();
+    while (next < len && start + recs[next].sent / speed <= now) {
+      r = &replays[next];
+      r->rec = &recs[next++];
+      r->c = api_replay_handle(r, host);
+      if (!r->c) {
+        r->failed = 1;
+        done++;
+        continue;
+      }
+      curl_multi_add_handle(cm, r->c);
+    }
+
+    curl_multi_perform(cm, &running);
+    while ((msg = curl_multi_info_read(cm, &msgs_left))) {
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &r);
+      curl_easy_getinfo(r->c, CURLINFO_RESPONSE_CODE, &r->status);
+      curl_easy_getinfo(r->c, CURLINFO_TOTAL_TIME, &r->total_time);
+      r->failed = msg->msg != CURLMSG_DONE || msg->data.result != CURLE_OK;
+      curl_multi_remove_handle(cm, r->c);
+      curl_easy_cleanup(r->c);
+      r->c = NULL;
+      done++;
+    }
+
+    if (next < len || running) {
+      timeout = 100;
+      if (next < len) {
+        delay = (start + recs[next].sent / speed - api_now()) * 1000;
+        timeout = delay < 0 ? 0 : delay < timeout ? (int)delay + 1 : timeout;
+      }
+      curl_multi_poll(cm, NULL, 0, timeout, NULL);
+    }
+  }
+  curl_multi_cleanup(cm);
+
+  recorded = calloc(len + 1, sizeof(double));
+  replayed = calloc(len + 1, sizeof(double));
+  for (i = 0; i < len; i++) {
+    r = &replays[i];
+    recorded[i] = r->rec->duration;
+    if (r->failed) {
+      failed++;
+    } else {
+      mismatched += r->status != r->rec->status;
+      replayed[n++] = r->total_time;
+    }
+    curl_slist_free_all(r->headers);
+    free(r->url);
+    free(r->method);
+  }
+  printf("replayed %zu requests in %.3f s, %zu failed, %zu with different "
+         "status\n",
+         done, api_now() - start, failed, mismatched);
+  printf("latency p50 %.3f s (recorded %.3f s), p99 %.3f s (recorded "
+         "%.3f s)\n",
+         api_replay_percentile(replayed, n, 0.5),
+         api_replay_percentile(recorded, len, 0.5),
+         api_replay_percentile(replayed, n, 0.99),
+         api_replay_percentile(recorded, len, 0.99));
+
+  free(recorded);
+  free(replayed);
+  free(replays);
+  free(recs);
+  trace_reader_close(reader);
+  return 0;
+}
@@ -1,6 +1,8 @@
 #ifndef APINETTE_H
+#define APINETTE_H
 
 #include <lua.h>
+#include <stdio.h>
 
 char *api_printf(char *format, ...);
 
@@ -8,4 +10,23 @@ lua_State *api_init(char **err);
 
 void api_cleanup(lua_State *L);
 
+int api_record(const char *path, char **err);
+
+int api_replay(const char *path, char **err);
+
+int api_replay_traffic(const char *path, double speed, const char *host,
+                       char **err);
+
+int api_trace(const char *path, char **err);
+
+int api_trace_write(char **err);
+
+int api_lua_profile(lua_State *L, const char *path, char **err);
+
+int api_lua_profile_write(char **err);
+
+void api_profile_enable(void);
+
+void api_profile_print(FILE *f);
+
 #endif // APINETTE_H
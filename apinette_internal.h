@@ -0,0 +1,18 @@
+/*
+ * Internals of apinette linked by the microbenchmarks
+ */
+
+#ifndef APINETTE_INTERNAL_H
+#define APINETTE_INTERNAL_H
+
+#include <curl/curl.h>
+#include <jansson.h>
+#include <lua.h>
+
+void api_read_json(lua_State *L, json_t *json);
+
+json_t *api_write_json(lua_State *L);
+
+char *api_push_headers(lua_State *L, const struct curl_slist *headers);
+
+#endif // APINETTE_INTERNAL_H
@@ -0,0 +1,95 @@
+-- Benchmark harness of the workloads in this directory, run by
+-- `meson test --benchmark` or `apinette bench/WORKLOAD.lua`.
+--
+-- It starts test_server (path in TEST_SERVER environment variable, port in
+-- BENCH_PORT), sends the workload and prints a JSON line with requests per
+-- second, latency percentiles, CPU time and peak RSS of apinette.
+
+local bench = {}
+
+local function percentile(sorted, p)
+  local i = math.ceil(#sorted * p / 100)
+  return sorted[math.max(i, 1)]
+end
+
+-- Peak resident set size in bytes (Linux only)
+local function peak_rss()
+  local f = io.open('/proc/self/status')
+  if not f then
+    return nil
+  end
+  for line in f:lines() do
+    local kb = line:match('^VmHWM:%s+(%d+) kB')
+    if kb then
+      f:close()
+      return tonumber(kb) * 1024
+    end
+  end
+  f:close()
+end
+
+-- Waits until the server accepts connections
+local function wait_ready(ep)
+  for _ = 1, 100 do
+    if send(ep.get('/')).status then
+      return true
+    end
+    os.execute('sleep 0.05')
+  end
+  return false
+end
+
+-- Runs workload, opts is a table of:
+-- server - arguments of test_server (optional)
+-- rounds - number of send calls
+-- requests - function, which receives the endpoint and returns a list of
+--            requests sent by one send call
+function bench.run(name, opts)
+  local port = os.getenv('BENCH_PORT') or '18080'
+  local server = io.popen((os.getenv('TEST_SERVER') or 'test_server') ..
+                          ' -p ' .. port .. ' ' .. (opts.server or ''), 'w')
+  local ep = endpoint { proto = http, host = 'localhost:' .. port }
+
+  if not wait_ready(ep) then
+    server:close()
+    error(name .. ': test_server is not running')
+  end
+  -- one round warms up connections and allocations
+  send(opts.requests(ep))
+
+  local latencies, errors = {}, 0
+  local cpu, start = os.clock(), now()
+  for _ = 1, opts.rounds do
+    for _, r in ipairs(send(opts.requests(ep))) do
+      if r.err or r.status >= 400 then
+        errors = errors + 1
+      end
+      latencies[#latencies + 1] = r.total_time
+    end
+  end
+  local elapsed, cpu_time = now() - start, os.clock() - cpu
+  -- test_server stops at the end of its input
+  server:close()
+
+  table.sort(latencies)
+  print(to_json {
+    name = name,
+    requests = #latencies,
+    errors = errors,
+    elapsed = elapsed,
+    rps = #latencies / elapsed,
+    latency = {
+      p50 = percentile(latencies, 50),
+      p90 = percentile(latencies, 90),
+      p99 = percentile(latencies, 99),
+      max = latencies[#latencies],
+    },
+    cpu_time = cpu_time,
+    peak_rss = peak_rss(),
+  })
+  if errors > 0 then
+    os.exit(1)
+  end
+end
+
+return bench
@@ -0,0 +1,12 @@
+-- GETs of 1 MiB JSON responses, which are decoded into tables
+require('bench').run('large_body', {
+  server = '--threads 4 --prebuilt --body-size 1M',
+  rounds = 50,
+  requests = function(ep)
+    local reqs = {}
+    for i = 1, 4 do
+      reqs[i] = ep.get('/')
+    end
+    return reqs
+  end,
+})
@@ -0,0 +1,275 @@
+/*
+ * Microbenchmarks of JSON conversion, header parsing and encoding helpers
+ *
+ * Each case runs on synthetic inputs from 100 B to --max-size bytes and prints
+ * a JSON line with the input size, nanoseconds per operation and throughput.
+ */
+
+#include <curl/curl.h>
+#include <jansson.h>
+#include <lauxlib.h>
+#include <lua.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "apinette.h"
+#include "apinette_internal.h"
+#include "base64.h"
+
+#define PROG "microbench"
+#define MIN_SIZE 100
+#define MAX_SIZE (100 * 1000 * 1000)
+/* each case is repeated at least this long */
+#define MIN_SECONDS 0.2
+
+/* Case input and state, setup creates the input of the size and run
+ * processes it once */
+typedef struct {
+  size_t size;
+  lua_State *L;
+  unsigned char *data;
+  size_t len; // bytes processed by run
+  json_t *json;
+  struct curl_slist *headers;
+  int ref; // registry reference of a Lua value
+} bench_input;
+
+typedef struct {
+  const char *name;
+  void (*setup)(bench_input *in);
+  void (*run)(bench_input *in);
+} bench_case;
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Random bytes, a quarter of them need escaping in URLs */
+static void random_data(bench_input *in) {
+  static const char safe[] = "abcdefghijklmnopqrstuvwxyz0123456789-._~";
+  size_t i;
+
+  in->data = malloc(in->size);
+  in->len = in->size;
+  for (i = 0; i < in->len; i++) {
+    in->data[i] = rand() % 4 ? safe[rand() % (sizeof(safe) - 1)] : rand();
+  }
+}
+
+/* Array of todo items, which is in->size bytes when dumped */
+static json_t *todo_items(size_t size) {
+  json_t *items = json_array(), *item;
+  size_t len = 2, pad_len = size < 4000 ? size / 4 : 1000;
+  char *pad = malloc(pad_len + 1);
+  int i;
+
+  memset(pad, 'x', pad_len);
+  pad[pad_len] = 0;
+  for (i = 1; len < size; i++) {
+    item = json_object();
+    json_object_set_new(item, "id", json_integer(i));
+    json_object_set_new(item, "title", json_string("benchmark"));
+    json_object_set_new(item, "done", json_false());
+    json_object_set_new(item, "score", json_real(i / 3.0));
+    json_object_set_new(item, "data", json_string(pad));
+    // dumped item and its separator
+    len += 70 + pad_len;
+    json_array_append_new(items, item);
+  }
+  free(pad);
+  return items;
+}
+
+static void setup_read_json(bench_input *in) {
+  in->json = todo_items(in->size);
+  in->len = json_dumpb(in->json, NULL, 0, 0);
+}
+
+static void run_read_json(bench_input *in) {
+  api_read_json(in->L, in->json);
+  lua_pop(in->L, 1);
+}
+
+static void setup_write_json(bench_input *in) {
+  json_t *json = todo_items(in->size);
+
+  in->len = json_dumpb(json, NULL, 0, 0);
+  api_read_json(in->L, json);
+  json_decref(json);
+  in->ref = luaL_ref(in->L, LUA_REGISTRYINDEX);
+}
+
+static void run_write_json(bench_input *in) {
+  lua_rawgeti(in->L, LUA_REGISTRYINDEX, in->ref);
+  json_decref(api_write_json(in->L));
+}
+
+static void setup_headers(bench_input *in) {
+  char line[128];
+  int i;
+
+  in->headers = curl_slist_append(NULL, "Content-Type: application/json");
+  for (i = 0; in->len < in->size; i++) {
+    in->len += snprintf(line, sizeof(line),
+                        "X-Header-%d:  value of header %d \r\n", i, i);
+    in->headers = curl_slist_append(in->headers, line);
+  }
+}
+
+static void run_headers(bench_input *in) {
+  free(api_push_headers(in->L, in->headers));
+  lua_pop(in->L, 1);
+}
+
+static void run_base64_encode(bench_input *in) {
+  size_t len;
+
+  free(base64_encode(in->data, in->len, &len));
+}
+
+static void setup_base64_decode(bench_input *in) {
+  unsigned char *data;
+
+  random_data(in);
+  data = base64_encode(in->data, in->len, &in->len);
+  free(in->data);
+  in->data = data;
+}
+
+static void run_base64_decode(bench_input *in) {
+  size_t len;
+
+  free(base64_decode(in->data, in->len, &len));
+}
+
+/* Lua function of apinette called with the input string */
+static void run_lua_function(bench_input *in, const char *name) {
+  lua_getglobal(in->L, name);
+  lua_pushlstring(in->L, (char *)in->data, in->len);
+  lua_call(in->L, 1, 1);
+  lua_pop(in->L, 1);
+}
+
+static void run_url_encode(bench_input *in) {
+  run_lua_function(in, "url_encode");
+}
+
+static void setup_url_decode(bench_input *in) {
+  const char *s;
+
+  random_data(in);
+  lua_getglobal(in->L, "url_encode");
+  lua_pushlstring(in->L, (char *)in->data, in->len);
+  lua_call(in->L, 1, 1);
+  s = lua_tolstring(in->L, -1, &in->len);
+  free(in->data);
+  in->data = malloc(in->len);
+  memcpy(in->data, s, in->len);
+  lua_pop(in->L, 1);
+}
+
+static void run_url_decode(bench_input *in) {
+  run_lua_function(in, "url_decode");
+}
+
+static const bench_case cases[] = {
+    {"read_json", setup_read_json, run_read_json},
+    {"write_json", setup_write_json, run_write_json},
+    {"headers", setup_headers, run_headers},
+    {"base64_encode", random_data, run_base64_encode},
+    {"base64_decode", setup_base64_decode, run_base64_decode},
+    {"url_encode", random_data, run_url_encode},
+    {"url_decode", setup_url_decode, run_url_decode},
+};
+
+static void bench_run(const bench_case *c, lua_State *L, size_t size) {
+  bench_input in;
+  double start, elapsed;
+  long n = 0;
+
+  memset(&in, 0, sizeof(in));
+  in.size = size;
+  in.L = L;
+  in.ref = LUA_NOREF;
+  c->setup(&in);
+
+  start = now();
+  do {
+    c->run(&in);
+    n++;
+    elapsed = now() - start;
+  } while (elapsed < MIN_SECONDS);
+
+  printf("{\"name\": \"%s\", \"size\": %zu, \"iterations\": %ld, "
+         "\"ns_per_op\": %.0f, \"mb_per_s\": %.1f}\n",
+         c->name, in.len, n, elapsed / n * 1e9, in.len * n / elapsed / 1e6);
+  fflush(stdout);
+
+  free(in.data);
+  json_decref(in.json);
+  curl_slist_free_all(in.headers);
+  luaL_unref(L, LUA_REGISTRYINDEX, in.ref);
+  lua_gc(L, LUA_GCCOLLECT, 0);
+}
+
+void usage(void) {
+  fprintf(stderr,
+          "Usage: %s [--max-size BYTES] [CASE...]\n\n"
+          "Runs all cases or the given ones on inputs from %d bytes to\n"
+          "--max-size bytes (default %d), growing by 100 times.\n\n"
+          "Cases:",
+          PROG, MIN_SIZE, MAX_SIZE);
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    fprintf(stderr, " %s", cases[i].name);
+  }
+  fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv) {
+  size_t max_size = MAX_SIZE, size, i;
+  const char **names = calloc(argc, sizeof(char *));
+  int names_len = 0, j, selected;
+  char *err = NULL;
+  lua_State *L;
+
+  for (j = 1; j < argc; j++) {
+    if (strcmp(argv[j], "--max-size") == 0 && j + 1 < argc) {
+      max_size = strtoul(argv[++j], NULL, 10);
+    } else if (argv[j][0] == '-') {
+      usage();
+      return EXIT_FAILURE;
+    } else {
+      names[names_len++] = argv[j];
+    }
+  }
+
+  L = api_init(&err);
+  if (err) {
+    fprintf(stderr, "%s: %s\n", PROG, err);
+    free(err);
+    return EXIT_FAILURE;
+  }
+  srand(1);
+
+  for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    selected = !names_len;
+    for (j = 0; j < names_len; j++) {
+      selected |= strcmp(names[j], cases[i].name) == 0;
+    }
+    if (!selected) {
+      continue;
+    }
+    for (size = MIN_SIZE; size <= max_size; size *= 100) {
+      bench_run(&cases[i], L, size);
+    }
+  }
+
+  api_cleanup(L);
+  free(names);
+  return EXIT_SUCCESS;
+}
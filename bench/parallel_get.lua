@@ -0,0 +1,12 @@
+-- Many GETs in parallel against a thread pool serving a prebuilt response
+require('bench').run('parallel_get', {
+  server = '--threads 4 --prebuilt',
+  rounds = 50,
+  requests = function(ep)
+    local reqs = {}
+    for i = 1, 100 do
+      reqs[i] = ep.get('/')
+    end
+    return reqs
+  end,
+})
@@ -0,0 +1,17 @@
+-- POSTs of JSON bodies, which the server echoes back
+local body = { title = 'benchmark', done = false, tags = {} }
+for i = 1, 50 do
+  body.tags[i] = 'tag' .. i
+end
+
+require('bench').run('post_json', {
+  server = '--threads 4',
+  rounds = 200,
+  requests = function(ep)
+    local reqs = {}
+    for i = 1, 10 do
+      reqs[i] = ep.post { path = '/echo', body = body }
+    end
+    return reqs
+  end,
+})
@@ -0,0 +1,7 @@
+-- Sequential GETs of a small JSON response
+require('bench').run('small_get', {
+  rounds = 2000,
+  requests = function(ep)
+    return { ep.get('/') }
+  end,
+})
@@ -0,0 +1,204 @@
+/*
+ * LRU cache of values limited by their total size
+ */
+
+#include <string.h>
+
+#include "cache.h"
+#include "utlist.h"
+
+#define CACHE_BUCKETS 64
+
+typedef struct cache_entry {
+  char *key;
+  unsigned long hash;
+  void *value;
+  size_t size;
+  struct cache_entry *chain; // next entry of the bucket
+  struct cache_entry *prev;  // LRU list, most recently used first
+  struct cache_entry *next;
+} cache_entry;
+
+struct cache {
+  size_t max_size;
+  size_t size;
+  void (*release)(void *value);
+  cache_entry **buckets;
+  size_t buckets_len;
+  size_t len;
+  cache_entry *lru;
+};
+
+/* FNV-1a */
+static unsigned long cache_hash(const char *key) {
+  unsigned long h = 2166136261UL;
+
+  while (*key) {
+    h ^= (unsigned char)*key++;
+    h *= 16777619UL;
+  }
+  return h;
+}
+
+static cache_entry **cache_find(cache *c, const char *key, unsigned long hash) {
+  cache_entry **e = &c->buckets[hash % c->buckets_len];
+
+  while (*e && ((*e)->hash != hash || strcmp((*e)->key, key) != 0)) {
+    e = &(*e)->chain;
+  }
+  return e;
+}
+
+static void cache_unlink(cache *c, cache_entry **link) {
+  cache_entry *e = *link;
+
+  *link = e->chain;
+  DL_DELETE(c->lru, e);
+  c->size -= e->size;
+  c->len--;
+  c->release(e->value);
+  free(e->key);
+  free(e);
+}
+
+/* Doubles the number of buckets when there are more entries than buckets */
+static void cache_grow(cache *c) {
+  cache_entry **buckets, *e, *next;
+  size_t i, len = c->buckets_len * 2;
+
+  buckets = calloc(len, sizeof(cache_entry *));
+  for (i = 0; i < c->buckets_len; i++) {
+    for (e = c->buckets[i]; e; e = next) {
+      next = e->chain;
+      e->chain = buckets[e->hash % len];
+      buckets[e->hash % len] = e;
+    }
+  }
+  free(c->buckets);
+  c->buckets = buckets;
+  c->buckets_len = len;
+}
+
+/**
+ * cache_new - Create cache
+ * @max_size: Maximum total size of values
+ * @release: Function called when a value is removed from the cache
+ * Returns: Allocated cache
+ *
+ * Caller is responsible for freeing the cache by cache_free().
+ */
+cache *cache_new(size_t max_size, void (*release)(void *value)) {
+  cache *c = calloc(1, sizeof(cache));
+
+  c->max_size = max_size;
+  c->release = release;
+  c->buckets_len = CACHE_BUCKETS;
+  c->buckets = calloc(c->buckets_len, sizeof(cache_entry *));
+  return c;
+}
+
+/**
+ * cache_free - Free cache and release all values
+ * @c: Cache created by cache_new() or %NULL
+ */
+void cache_free(cache *c) {
+  size_t i;
+
+  if (!c) {
+    return;
+  }
+  for (i = 0; i < c->buckets_len; i++) {
+    while (c->buckets[i]) {
+      cache_unlink(c, &c->buckets[i]);
+    }
+  }
+  free(c->buckets);
+  free(c);
+}
+
+/**
+ * cache_get - Look up value
+ * @c: Cache
+ * @key: Nul terminated key
+ * Returns: Value or %NULL if the key is not cached
+ *
+ * The value becomes the most recently used one. It is valid until it is
+ * replaced or evicted by cache_put() or removed.
+ */
+void *cache_get(cache *c, const char *key) {
+  cache_entry *e = *cache_find(c, key, cache_hash(key));
+
+  if (!e) {
+    return NULL;
+  }
+  if (c->lru != e) {
+    DL_DELETE(c->lru, e);
+    DL_PREPEND(c->lru, e);
+  }
+  return e->value;
+}
+
+/**
+ * cache_put - Store value
+ * @c: Cache
+ * @key: Nul terminated key
+ * @value: Value, which is owned by the cache from now on
+ * @size: Size of the value
+ * Returns: 0 on success, -1 if the value is larger than the cache
+ *
+ * Previous value of the key is released and least recently used values are
+ * evicted until the values fit. The value is released on failure.
+ */
+int cache_put(cache *c, const char *key, void *value, size_t size) {
+  unsigned long hash = cache_hash(key);
+  cache_entry **link, *e;
+
+  link = cache_find(c, key, hash);
+  if (*link) {
+    cache_unlink(c, link);
+  }
+  if (size > c->max_size) {
+    c->release(value);
+    return -1;
+  }
+  while (c->size + size > c->max_size) {
+    e = c->lru->prev;
+    cache_unlink(c, cache_find(c, e->key, e->hash));
+  }
+
+  if (c->len >= c->buckets_len) {
+    cache_grow(c);
+  }
+  e = calloc(1, sizeof(cache_entry));
+  e->key = strdup(key);
+  e->hash = hash;
+  e->value = value;
+  e->size = size;
+  link = &c->buckets[hash % c->buckets_len];
+  e->chain = *link;
+  *link = e;
+  DL_PREPEND(c->lru, e);
+  c->size += size;
+  c->len++;
+  return 0;
+}
+
+/**
+ * cache_remove - Remove value
+ * @c: Cache
+ * @key: Nul terminated key
+ */
+void cache_remove(cache *c, const char *key) {
+  cache_entry **link = cache_find(c, key, cache_hash(key));
+
+  if (*link) {
+    cache_unlink(c, link);
+  }
+}
+
+/**
+ * cache_size - Total size of cached values
+ * @c: Cache
+ * Returns: Size in bytes
+ */
+size_t cache_size(cache *c) { return c->size; }
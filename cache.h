@@ -0,0 +1,19 @@
+/*
+ * LRU cache of values limited by their total size
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdlib.h>
+
+typedef struct cache cache;
+
+cache *cache_new(size_t max_size, void (*release)(void *value));
+void cache_free(cache *c);
+void *cache_get(cache *c, const char *key);
+int cache_put(cache *c, const char *key, void *value, size_t size);
+void cache_remove(cache *c, const char *key);
+size_t cache_size(cache *c);
+
+#endif /* CACHE_H */
@@ -0,0 +1,239 @@
+/*
+ * Request body compression (gzip, zstd)
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+#ifdef API_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "compress.h"
+
+struct compress_dict {
+  void *buf;
+  size_t len;
+  int level;
+#ifdef API_HAVE_ZSTD
+  ZSTD_CDict *cdict;
+#endif
+};
+
+#ifdef API_HAVE_ZSTD
+/* compression context is reused by all requests */
+static ZSTD_CCtx *zstd_cctx;
+#endif
+
+/**
+ * compress_encoding - Content-Encoding header value
+ * @type: Compression type
+ * Returns: Name of the content coding or %NULL for COMPRESS_NONE
+ */
+const char *compress_encoding(compress_type type) {
+  switch (type) {
+  case COMPRESS_NONE:
+    return NULL;
+  case COMPRESS_GZIP:
+    return "gzip";
+  case COMPRESS_ZSTD:
+    return "zstd";
+  }
+  return NULL;
+}
+
+/**
+ * compress_supported - Check whether compression type was compiled in
+ * @type: Compression type
+ * Returns: 1 if supported, 0 otherwise
+ */
+int compress_supported(compress_type type) {
+  switch (type) {
+  case COMPRESS_NONE:
+  case COMPRESS_GZIP:
+    return 1;
+  case COMPRESS_ZSTD:
+#ifdef API_HAVE_ZSTD
+    return 1;
+#else
+    return 0;
+#endif
+  }
+  return 0;
+}
+
+/**
+ * compress_gzip - Compress data into gzip format
+ * @src: Data to be compressed
+ * @len: Length of the data
+ * @level: Compression level (0-9) or COMPRESS_LEVEL_DEFAULT
+ * @out_len: Pointer to output length variable
+ * Returns: Allocated buffer of out_len bytes of compressed data,
+ * or %NULL on failure
+ *
+ * Caller is responsible for freeing the returned buffer.
+ */
+unsigned char *compress_gzip(const unsigned char *src, size_t len, int level,
+                             size_t *out_len) {
+  z_stream zs;
+  unsigned char *out;
+  size_t olen;
+
+  if (level == COMPRESS_LEVEL_DEFAULT) {
+    level = Z_DEFAULT_COMPRESSION;
+  }
+
+  memset(&zs, 0, sizeof(zs));
+  /* 16 added to window bits selects gzip wrapper instead of zlib one */
+  if (deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) !=
+      Z_OK) {
+    return NULL;
+  }
+
+  olen = deflateBound(&zs, len);
+  out = malloc(olen);
+  if (out == NULL) {
+    deflateEnd(&zs);
+    return NULL;
+  }
+
+  zs.next_in = (unsigned char *)src;
+  zs.avail_in = len;
+  zs.next_out = out;
+  zs.avail_out = olen;
+  if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+    deflateEnd(&zs);
+    free(out);
+    return NULL;
+  }
+
+  *out_len = zs.total_out;
+  deflateEnd(&zs);
+  return out;
+}
+
+/**
+ * compress_zstd - Compress data into zstd frame
+ * @src: Data to be compressed
+ * @len: Length of the data
+ * @level: Compression level or COMPRESS_LEVEL_DEFAULT
+ * @dict: Dictionary loaded by compress_dict_load() or %NULL
+ * @out_len: Pointer to output length variable
+ * Returns: Allocated buffer of out_len bytes of compressed data,
+ * or %NULL on failure
+ *
+ * Digested dictionary is used when the level matches the level of the
+ * dictionary, otherwise the raw dictionary is loaded for this call only.
+ * Caller is responsible for freeing the returned buffer.
+ */
+unsigned char *compress_zstd(const unsigned char *src, size_t len, int level,
+                             compress_dict *dict, size_t *out_len) {
+#ifdef API_HAVE_ZSTD
+  unsigned char *out;
+  size_t olen, res;
+
+  if (level == COMPRESS_LEVEL_DEFAULT) {
+    level = dict ? dict->level : ZSTD_CLEVEL_DEFAULT;
+  }
+
+  if (!zstd_cctx) {
+    zstd_cctx = ZSTD_createCCtx();
+    if (!zstd_cctx) {
+      return NULL;
+    }
+  }
+
+  olen = ZSTD_compressBound(len);
+  out = malloc(olen);
+  if (out == NULL) {
+    return NULL;
+  }
+
+  if (!dict) {
+    res = ZSTD_compressCCtx(zstd_cctx, out, olen, src, len, level);
+  } else if (dict->level == level) {
+    res = ZSTD_compress_usingCDict(zstd_cctx, out, olen, src, len,
+                                   dict->cdict);
+  } else {
+    res = ZSTD_compress_usingDict(zstd_cctx, out, olen, src, len, dict->buf,
+                                  dict->len, level);
+  }
+  if (ZSTD_isError(res)) {
+    free(out);
+    return NULL;
+  }
+
+  *out_len = res;
+  return out;
+#else
+  (void)src;
+  (void)len;
+  (void)level;
+  (void)dict;
+  (void)out_len;
+  return NULL;
+#endif
+}
+
+/**
+ * compress_dict_load - Load pre-trained zstd dictionary
+ * @path: Path to the dictionary file (ie. created by zstd --train)
+ * @level: Compression level the dictionary is digested for
+ * Returns: Allocated dictionary or %NULL on failure
+ *
+ * Caller is responsible for freeing the dictionary by compress_dict_free().
+ */
+compress_dict *compress_dict_load(const char *path, int level) {
+#ifdef API_HAVE_ZSTD
+  compress_dict *dict;
+  FILE *f;
+  long size;
+
+  f = fopen(path, "rb");
+  if (!f) {
+    return NULL;
+  }
+  if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) <= 0 ||
+      fseek(f, 0, SEEK_SET) != 0) {
+    fclose(f);
+    return NULL;
+  }
+
+  dict = calloc(1, sizeof(compress_dict));
+  dict->len = size;
+  dict->buf = malloc(dict->len);
+  if (fread(dict->buf, 1, dict->len, f) != dict->len) {
+    fclose(f);
+    compress_dict_free(dict);
+    return NULL;
+  }
+  fclose(f);
+
+  dict->level = level == COMPRESS_LEVEL_DEFAULT ? ZSTD_CLEVEL_DEFAULT : level;
+  dict->cdict = ZSTD_createCDict(dict->buf, dict->len, dict->level);
+  if (!dict->cdict) {
+    compress_dict_free(dict);
+    return NULL;
+  }
+
+  return dict;
+#else
+  (void)path;
+  (void)level;
+  return NULL;
+#endif
+}
+
+/**
+ * compress_dict_free - Free dictionary
+ * @dict: Dictionary loaded by compress_dict_load() or %NULL
+ */
+void compress_dict_free(compress_dict *dict) {
+  if (dict) {
+#ifdef API_HAVE_ZSTD
+    ZSTD_freeCDict(dict->cdict);
+#endif
+    free(dict->buf);
+    free(dict);
+  }
+}
@@ -0,0 +1,26 @@
+/*
+ * Request body compression (gzip, zstd)
+ */
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <limits.h>
+#include <stdlib.h>
+
+#define COMPRESS_LEVEL_DEFAULT INT_MIN
+
+typedef enum { COMPRESS_NONE, COMPRESS_GZIP, COMPRESS_ZSTD } compress_type;
+
+typedef struct compress_dict compress_dict;
+
+const char *compress_encoding(compress_type type);
+int compress_supported(compress_type type);
+unsigned char *compress_gzip(const unsigned char *src, size_t len, int level,
+                             size_t *out_len);
+unsigned char *compress_zstd(const unsigned char *src, size_t len, int level,
+                             compress_dict *dict, size_t *out_len);
+compress_dict *compress_dict_load(const char *path, int level);
+void compress_dict_free(compress_dict *dict);
+
+#endif /* COMPRESS_H */
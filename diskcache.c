@@ -0,0 +1,332 @@
+/*
+ * Content addressed cache of files in a directory
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "diskcache.h"
+
+/* files being written are hidden from other processes until renamed */
+#define DISKCACHE_TMP_NAME ".tmp.XXXXXX"
+
+/* Cached file in the index, which evicts least recently used files */
+typedef struct {
+  diskcache *dc;
+  char path[];
+} diskcache_file;
+
+typedef struct {
+  char *key;
+  time_t mtime;
+  size_t size;
+} diskcache_found;
+
+struct diskcache {
+  char *dir;
+  double ttl;
+  cache *index;
+  int closing; // files are kept when the index is freed
+};
+
+static void diskcache_release(void *value) {
+  diskcache_file *f = value;
+
+  if (!f->dc->closing) {
+    unlink(f->path);
+  }
+  free(f);
+}
+
+static char *diskcache_path(diskcache *dc, const char *key, const char *name) {
+  size_t len = strlen(dc->dir) + strlen(name) + 5;
+  char *path = malloc(len);
+
+  snprintf(path, len, "%s/%.2s/%s", dc->dir, key, name);
+  return path;
+}
+
+static int diskcache_fresh(diskcache *dc, time_t mtime, time_t now) {
+  return dc->ttl <= 0 || difftime(now, mtime) < dc->ttl;
+}
+
+/* Adds a file to the index, it returns -1 if the file was evicted at once */
+static int diskcache_index(diskcache *dc, const char *key, size_t size) {
+  char *path = diskcache_path(dc, key, key + 2);
+  size_t len = strlen(path) + 1;
+  diskcache_file *f = malloc(sizeof(diskcache_file) + len);
+
+  f->dc = dc;
+  memcpy(f->path, path, len);
+  free(path);
+  return cache_put(dc->index, key, f, size);
+}
+
+static int diskcache_found_cmp(const void *a, const void *b) {
+  const diskcache_found *x = a, *y = b;
+
+  return x->mtime < y->mtime ? -1 : x->mtime > y->mtime;
+}
+
+/* Indexes files of previous runs, the most recently written files become
+ * the most recently used ones. Expired files are removed. */
+static void diskcache_scan(diskcache *dc) {
+  DIR *d, *sub;
+  struct dirent *e, *se;
+  struct stat st;
+  diskcache_found *found = NULL;
+  size_t found_len = 0, found_size = 0, i;
+  char *path;
+  time_t now = time(NULL);
+
+  d = opendir(dc->dir);
+  if (!d) {
+    return;
+  }
+  while ((e = readdir(d))) {
+    if (strlen(e->d_name) != 2 || e->d_name[0] == '.') {
+      continue;
+    }
+    path = diskcache_path(dc, e->d_name, "");
+    sub = opendir(path);
+    free(path);
+    if (!sub) {
+      continue;
+    }
+    while ((se = readdir(sub))) {
+      if (se->d_name[0] == '.') {
+        continue;
+      }
+      path = diskcache_path(dc, e->d_name, se->d_name);
+      if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        free(path);
+        continue;
+      }
+      if (!diskcache_fresh(dc, st.st_mtime, now)) {
+        unlink(path);
+        free(path);
+        continue;
+      }
+      free(path);
+      if (found_len == found_size) {
+        found_size = found_size ? found_size * 2 : 64;
+        found = realloc(found, found_size * sizeof(diskcache_found));
+      }
+      found[found_len].key = malloc(strlen(se->d_name) + 3);
+      sprintf(found[found_len].key, "%s%s", e->d_name, se->d_name);
+      found[found_len].mtime = st.st_mtime;
+      found[found_len].size = st.st_size;
+      found_len++;
+    }
+    closedir(sub);
+  }
+  closedir(d);
+
+  if (found_len > 1) {
+    qsort(found, found_len, sizeof(diskcache_found), diskcache_found_cmp);
+  }
+  for (i = 0; i < found_len; i++) {
+    diskcache_index(dc, found[i].key, found[i].size);
+    free(found[i].key);
+  }
+  free(found);
+}
+
+/**
+ * diskcache_open - Open cache directory
+ * @dir: Path to the directory, it is created if it doesn't exist
+ * @max_size: Maximum total size of files
+ * @ttl: Maximum age of files in seconds or 0 if files don't expire
+ * Returns: Allocated cache or %NULL on failure (errno is set)
+ *
+ * Files of previous runs are indexed, so that they count towards the size
+ * and can be evicted. Caller is responsible for closing the cache by
+ * diskcache_close().
+ */
+diskcache *diskcache_open(const char *dir, size_t max_size, double ttl) {
+  diskcache *dc;
+  struct stat st;
+
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+    return NULL;
+  }
+  if (stat(dir, &st) != 0) {
+    return NULL;
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    errno = ENOTDIR;
+    return NULL;
+  }
+
+  dc = calloc(1, sizeof(diskcache));
+  dc->dir = strdup(dir);
+  dc->ttl = ttl;
+  dc->index = cache_new(max_size, diskcache_release);
+  diskcache_scan(dc);
+  return dc;
+}
+
+/**
+ * diskcache_close - Free cache, the files are kept
+ * @dc: Cache opened by diskcache_open() or %NULL
+ */
+void diskcache_close(diskcache *dc) {
+  if (!dc) {
+    return;
+  }
+  dc->closing = 1;
+  cache_free(dc->index);
+  free(dc->dir);
+  free(dc);
+}
+
+/**
+ * diskcache_get - Map cached file into memory
+ * @dc: Cache
+ * @key: Nul terminated hex digest of at least DISKCACHE_KEY_MIN_LEN characters
+ * @len: Pointer to length variable
+ * Returns: Read-only mapping of len bytes or %NULL if the key is not cached
+ *
+ * The file becomes the most recently used one. Expired file is removed.
+ * The mapping stays valid after the file is evicted, caller is responsible
+ * for unmapping it by diskcache_unmap().
+ */
+void *diskcache_get(diskcache *dc, const char *key, size_t *len) {
+  char *path;
+  int fd;
+  struct stat st;
+  void *data;
+
+  if (strlen(key) < DISKCACHE_KEY_MIN_LEN) {
+    return NULL;
+  }
+  path = diskcache_path(dc, key, key + 2);
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    free(path);
+    cache_remove(dc->index, key);
+    return NULL;
+  }
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0 ||
+      !diskcache_fresh(dc, st.st_mtime, time(NULL))) {
+    close(fd);
+    cache_remove(dc->index, key);
+    unlink(path);
+    free(path);
+    return NULL;
+  }
+  free(path);
+
+  data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return NULL;
+  }
+  // the file may have been written by another process
+  if (!cache_get(dc->index, key)) {
+    diskcache_index(dc, key, st.st_size);
+  }
+  *len = st.st_size;
+  return data;
+}
+
+/**
+ * diskcache_unmap - Unmap file mapped by diskcache_get()
+ * @data: Mapping
+ * @len: Length of the mapping
+ */
+void diskcache_unmap(void *data, size_t len) { munmap(data, len); }
+
+static int diskcache_write(int fd, const struct iovec *iov, int iovcnt,
+                           size_t *size) {
+  const char *p;
+  size_t left;
+  ssize_t n;
+  int i;
+
+  for (i = 0; i < iovcnt; i++) {
+    p = iov[i].iov_base;
+    left = iov[i].iov_len;
+    while (left > 0) {
+      n = write(fd, p, left);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        return -1;
+      }
+      p += n;
+      left -= n;
+    }
+    *size += iov[i].iov_len;
+  }
+  return 0;
+}
+
+/**
+ * diskcache_put - Store file
+ * @dc: Cache
+ * @key: Nul terminated hex digest of at least DISKCACHE_KEY_MIN_LEN characters
+ * @iov: Buffers, which are concatenated into the file
+ * @iovcnt: Number of buffers
+ * Returns: 0 on success, -1 on failure or if the file is larger than the cache
+ *
+ * The file is written aside and renamed, so that readers never see a partial
+ * file. Previous file of the key is replaced and least recently used files
+ * are removed until the files fit.
+ */
+int diskcache_put(diskcache *dc, const char *key, const struct iovec *iov,
+                  int iovcnt) {
+  char *path, *tmp;
+  size_t size = 0;
+  int fd, res;
+
+  if (strlen(key) < DISKCACHE_KEY_MIN_LEN) {
+    return -1;
+  }
+  path = diskcache_path(dc, key, "");
+  if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+    free(path);
+    return -1;
+  }
+  free(path);
+
+  tmp = diskcache_path(dc, key, DISKCACHE_TMP_NAME);
+  fd = mkstemp(tmp);
+  if (fd < 0) {
+    free(tmp);
+    return -1;
+  }
+  res = diskcache_write(fd, iov, iovcnt, &size);
+  if (close(fd) != 0) {
+    res = -1;
+  }
+  if (res == 0) {
+    cache_remove(dc->index, key);
+    path = diskcache_path(dc, key, key + 2);
+    res = rename(tmp, path);
+    free(path);
+  }
+  if (res != 0) {
+    unlink(tmp);
+    free(tmp);
+    return -1;
+  }
+  free(tmp);
+  return diskcache_index(dc, key, size);
+}
+
+/**
+ * diskcache_size - Total size of indexed files
+ * @dc: Cache
+ * Returns: Size in bytes
+ */
+size_t diskcache_size(diskcache *dc) { return cache_size(dc->index); }
@@ -0,0 +1,24 @@
+/*
+ * Content addressed cache of files in a directory
+ */
+
+#ifndef DISKCACHE_H
+#define DISKCACHE_H
+
+#include <stdlib.h>
+#include <sys/uio.h>
+
+/* keys are hex digests, the first two characters name a subdirectory */
+#define DISKCACHE_KEY_MIN_LEN 3
+
+typedef struct diskcache diskcache;
+
+diskcache *diskcache_open(const char *dir, size_t max_size, double ttl);
+void diskcache_close(diskcache *dc);
+void *diskcache_get(diskcache *dc, const char *key, size_t *len);
+void diskcache_unmap(void *data, size_t len);
+int diskcache_put(diskcache *dc, const char *key, const struct iovec *iov,
+                  int iovcnt);
+size_t diskcache_size(diskcache *dc);
+
+#endif /* DISKCACHE_H */
@@ -0,0 +1,149 @@
+/*
+ * Counts of stack samples written as folded stacks for flame graphs
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "folded.h"
+
+/* Distinct stack, its text is in the arena */
+typedef struct {
+  size_t offset;
+  size_t len;
+  unsigned long count; // 0 if the slot is free
+} folded_stack;
+
+/* Open addressing table of stacks and the arena of their text, both are
+ * allocated upfront, so adding a sample never allocates */
+struct folded {
+  folded_stack *stacks;
+  size_t stacks_size; // power of two
+  size_t stacks_len;
+  char *arena;
+  size_t arena_size;
+  size_t arena_len;
+  size_t dropped;
+};
+
+static uint64_t folded_hash(const char *s, size_t len) {
+  uint64_t h = 14695981039346656037ULL;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    h = (h ^ (unsigned char)s[i]) * 1099511628211ULL;
+  }
+  return h;
+}
+
+/**
+ * folded_new - Allocate counts of stacks
+ * @max_stacks: Maximum number of distinct stacks
+ * @max_bytes: Maximum total length of distinct stacks
+ * Returns: Allocated counts or %NULL on failure
+ *
+ * Caller is responsible for freeing the counts by folded_free().
+ */
+folded *folded_new(size_t max_stacks, size_t max_bytes) {
+  folded *f = calloc(1, sizeof(folded));
+
+  if (!f) {
+    return NULL;
+  }
+  // the table is kept at most half full
+  for (f->stacks_size = 16; f->stacks_size < 2 * max_stacks;
+       f->stacks_size *= 2) {
+  }
+  f->stacks = calloc(f->stacks_size, sizeof(folded_stack));
+  f->arena = malloc(max_bytes);
+  if (!f->stacks || !f->arena) {
+    folded_free(f);
+    return NULL;
+  }
+  f->arena_size = max_bytes;
+  return f;
+}
+
+/**
+ * folded_free - Free counts of stacks
+ * @f: Counts created by folded_new() or %NULL
+ */
+void folded_free(folded *f) {
+  if (f) {
+    free(f->stacks);
+    free(f->arena);
+    free(f);
+  }
+}
+
+/**
+ * folded_add - Count sample of a stack
+ * @f: Counts
+ * @stack: Frames from the root separated by semicolons
+ * @len: Length of the stack
+ * Returns: 0 on success, -1 if the sample was dropped
+ *
+ * A new stack is dropped when the limits of folded_new() are reached.
+ */
+int folded_add(folded *f, const char *stack, size_t len) {
+  size_t mask = f->stacks_size - 1, i;
+  folded_stack *s;
+
+  for (i = folded_hash(stack, len) & mask;; i = (i + 1) & mask) {
+    s = &f->stacks[i];
+    if (!s->count) {
+      break;
+    }
+    if (s->len == len && memcmp(f->arena + s->offset, stack, len) == 0) {
+      s->count++;
+      return 0;
+    }
+  }
+  if (2 * (f->stacks_len + 1) > f->stacks_size ||
+      f->arena_size - f->arena_len < len) {
+    f->dropped++;
+    return -1;
+  }
+  memcpy(f->arena + f->arena_len, stack, len);
+  s->offset = f->arena_len;
+  s->len = len;
+  s->count = 1;
+  f->arena_len += len;
+  f->stacks_len++;
+  return 0;
+}
+
+/**
+ * folded_dropped - Number of dropped samples
+ * @f: Counts
+ */
+size_t folded_dropped(folded *f) { return f->dropped; }
+
+/**
+ * folded_write - Write stacks with their counts
+ * @f: Counts
+ * @path: Path to the file, existing file is truncated
+ * Returns: 0 on success, -1 on failure (errno is set)
+ *
+ * Each line is a stack followed by a space and its count, which is read by
+ * flamegraph.pl, inferno and speedscope.
+ */
+int folded_write(folded *f, const char *path) {
+  FILE *out = fopen(path, "w");
+  folded_stack *s;
+  size_t i;
+  int ok;
+
+  if (!out) {
+    return -1;
+  }
+  for (i = 0; i < f->stacks_size; i++) {
+    s = &f->stacks[i];
+    if (s->count) {
+      fprintf(out, "%.*s %lu\n", (int)s->len, f->arena + s->offset, s->count);
+    }
+  }
+  ok = !ferror(out);
+  return fclose(out) == 0 && ok ? 0 : -1;
+}
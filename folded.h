@@ -0,0 +1,18 @@
+/*
+ * Counts of stack samples written as folded stacks for flame graphs
+ */
+
+#ifndef FOLDED_H
+#define FOLDED_H
+
+#include <stdlib.h>
+
+typedef struct folded folded;
+
+folded *folded_new(size_t max_stacks, size_t max_bytes);
+void folded_free(folded *f);
+int folded_add(folded *f, const char *stack, size_t len);
+size_t folded_dropped(folded *f);
+int folded_write(folded *f, const char *path);
+
+#endif /* FOLDED_H */
@@ -0,0 +1,314 @@
+/*
+ * JSON Web Token signing (HS256, RS256, ES256)
+ */
+
+#include <openssl/bio.h>
+#include <openssl/crypto.h>
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/obj_mac.h>
+#include <openssl/opensslv.h>
+#include <openssl/pem.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "base64.h"
+#include "jwt.h"
+
+#define JWT_HASH_LEN 32
+#define JWT_ES256_LEN 64
+
+struct jwt_key {
+  jwt_alg alg;
+  unsigned char *secret;
+  size_t secret_len;
+  EVP_PKEY *pkey;
+  EVP_MD_CTX *ctx;
+  /* encoded header including the trailing dot */
+  char *header;
+  size_t header_len;
+};
+
+static const char *jwt_alg_names[] = {"HS256", "RS256", "ES256"};
+
+/* Encodes src to base64url without padding */
+static char *jwt_base64url(const unsigned char *src, size_t len,
+                           size_t *out_len) {
+  char *out;
+  size_t i, n;
+
+  out = (char *)base64_encode(src, len, &n);
+  if (!out) {
+    return NULL;
+  }
+  while (n > 0 && out[n - 1] == '=') {
+    n--;
+  }
+  for (i = 0; i < n; i++) {
+    if (out[i] == '+') {
+      out[i] = '-';
+    } else if (out[i] == '/') {
+      out[i] = '_';
+    }
+  }
+  out[n] = 0;
+  *out_len = n;
+  return out;
+}
+
+/* ES256 is ECDSA on P-256, other curves produce signatures of other lengths */
+static int jwt_p256(EVP_PKEY *pkey) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  char name[32];
+  size_t len;
+
+  return EVP_PKEY_base_id(pkey) == EVP_PKEY_EC &&
+         EVP_PKEY_get_group_name(pkey, name, sizeof(name), &len) == 1 &&
+         strcmp(name, SN_X9_62_prime256v1) == 0;
+#else
+  const EC_KEY *ec;
+
+  if (EVP_PKEY_base_id(pkey) != EVP_PKEY_EC) {
+    return 0;
+  }
+  ec = EVP_PKEY_get0_EC_KEY(pkey);
+  return ec && EC_GROUP_get_curve_name(EC_KEY_get0_group(ec)) ==
+                   NID_X9_62_prime256v1;
+#endif
+}
+
+/**
+ * jwt_alg_parse - Parse algorithm name
+ * @name: Algorithm name (ie. "HS256")
+ * @alg: Pointer to output algorithm
+ * Returns: 0 on success, -1 for unsupported algorithm
+ */
+int jwt_alg_parse(const char *name, jwt_alg *alg) {
+  size_t i;
+
+  for (i = 0; i < sizeof(jwt_alg_names) / sizeof(jwt_alg_names[0]); i++) {
+    if (strcmp(name, jwt_alg_names[i]) == 0) {
+      *alg = (jwt_alg)i;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/**
+ * jwt_key_load - Parse signing key
+ * @alg: Algorithm
+ * @key: Shared secret for HS256, PEM encoded private key otherwise
+ * @key_len: Length of the key
+ * @kid: Key ID added to the token header or %NULL
+ * Returns: Allocated key or %NULL on failure
+ *
+ * The key is parsed and the token header is encoded only once, so they are
+ * reused by all tokens signed by the key. Caller is responsible for freeing
+ * the key by jwt_key_free().
+ */
+jwt_key *jwt_key_load(jwt_alg alg, const char *key, size_t key_len,
+                      const char *kid) {
+  jwt_key *k;
+  BIO *bio;
+  char *header;
+  size_t len;
+
+  k = calloc(1, sizeof(jwt_key));
+  k->alg = alg;
+
+  switch (alg) {
+  case JWT_HS256:
+    k->secret = malloc(key_len);
+    memcpy(k->secret, key, key_len);
+    k->secret_len = key_len;
+    break;
+  case JWT_RS256:
+  case JWT_ES256:
+    bio = BIO_new_mem_buf(key, key_len);
+    k->pkey = PEM_read_bio_PrivateKey(bio, NULL, NULL, NULL);
+    BIO_free(bio);
+    if (!k->pkey ||
+        (alg == JWT_RS256 && EVP_PKEY_base_id(k->pkey) != EVP_PKEY_RSA) ||
+        (alg == JWT_ES256 && !jwt_p256(k->pkey))) {
+      jwt_key_free(k);
+      return NULL;
+    }
+    k->ctx = EVP_MD_CTX_new();
+    break;
+  }
+
+  len = strlen(jwt_alg_names[alg]) + (kid ? strlen(kid) : 0) + 40;
+  header = malloc(len);
+  if (kid) {
+    snprintf(header, len, "{\"alg\":\"%s\",\"typ\":\"JWT\",\"kid\":\"%s\"}",
+             jwt_alg_names[alg], kid);
+  } else {
+    snprintf(header, len, "{\"alg\":\"%s\",\"typ\":\"JWT\"}",
+             jwt_alg_names[alg]);
+  }
+  k->header = jwt_base64url((unsigned char *)header, strlen(header), &len);
+  free(header);
+  k->header = realloc(k->header, len + 2);
+  k->header[len] = '.';
+  k->header[len + 1] = 0;
+  k->header_len = len + 1;
+
+  return k;
+}
+
+/**
+ * jwt_key_load_file - Read signing key from file
+ * @alg: Algorithm
+ * @path: Path to the shared secret or PEM encoded private key
+ * @kid: Key ID added to the token header or %NULL
+ * Returns: Allocated key or %NULL on failure
+ *
+ * Trailing line break of the shared secret is not a part of the secret.
+ */
+jwt_key *jwt_key_load_file(jwt_alg alg, const char *path, const char *kid) {
+  jwt_key *key;
+  FILE *f;
+  char *buf;
+  long size, len;
+
+  f = fopen(path, "rb");
+  if (!f) {
+    return NULL;
+  }
+  if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0 ||
+      fseek(f, 0, SEEK_SET) != 0) {
+    fclose(f);
+    return NULL;
+  }
+  buf = malloc(size + 1);
+  if (fread(buf, 1, size, f) != (size_t)size) {
+    free(buf);
+    fclose(f);
+    return NULL;
+  }
+  fclose(f);
+
+  len = size;
+  if (alg == JWT_HS256) {
+    while (len > 0 && (buf[len - 1] == '\n' || buf[len - 1] == '\r')) {
+      len--;
+    }
+  }
+  key = jwt_key_load(alg, buf, len, kid);
+  OPENSSL_cleanse(buf, size);
+  free(buf);
+  return key;
+}
+
+/**
+ * jwt_key_free - Free signing key
+ * @key: Key loaded by jwt_key_load() or %NULL
+ */
+void jwt_key_free(jwt_key *key) {
+  if (key) {
+    if (key->secret) {
+      OPENSSL_cleanse(key->secret, key->secret_len);
+      free(key->secret);
+    }
+    EVP_PKEY_free(key->pkey);
+    EVP_MD_CTX_free(key->ctx);
+    free(key->header);
+    free(key);
+  }
+}
+
+/* Converts DER encoded ECDSA signature to JWS format (r || s) */
+static int jwt_ecdsa_raw(const unsigned char *der, size_t der_len,
+                         unsigned char *raw) {
+  ECDSA_SIG *sig;
+  const BIGNUM *r, *s;
+
+  sig = d2i_ECDSA_SIG(NULL, &der, der_len);
+  if (!sig) {
+    return -1;
+  }
+  ECDSA_SIG_get0(sig, &r, &s);
+  if (BN_bn2binpad(r, raw, JWT_ES256_LEN / 2) < 0 ||
+      BN_bn2binpad(s, raw + JWT_ES256_LEN / 2, JWT_ES256_LEN / 2) < 0) {
+    ECDSA_SIG_free(sig);
+    return -1;
+  }
+  ECDSA_SIG_free(sig);
+  return 0;
+}
+
+/**
+ * jwt_sign - Create signed token
+ * @key: Signing key
+ * @claims: JSON encoded claims
+ * @claims_len: Length of the claims
+ * Returns: Allocated nul terminated token or %NULL on failure
+ *
+ * Caller is responsible for freeing the returned token.
+ */
+char *jwt_sign(jwt_key *key, const char *claims, size_t claims_len) {
+  unsigned char hash[JWT_HASH_LEN], raw[JWT_ES256_LEN], *sig = NULL;
+  unsigned int hash_len = JWT_HASH_LEN;
+  char *payload, *signature, *token = NULL;
+  size_t payload_len, signature_len, sig_len = 0, input_len;
+  char *input;
+
+  payload = jwt_base64url((const unsigned char *)claims, claims_len,
+                          &payload_len);
+  input_len = key->header_len + payload_len;
+  input = malloc(input_len + 1);
+  memcpy(input, key->header, key->header_len);
+  memcpy(input + key->header_len, payload, payload_len + 1);
+  free(payload);
+
+  switch (key->alg) {
+  case JWT_HS256:
+    HMAC(EVP_sha256(), key->secret, key->secret_len, (unsigned char *)input,
+         input_len, hash, &hash_len);
+    signature = jwt_base64url(hash, hash_len, &signature_len);
+    break;
+  case JWT_RS256:
+  case JWT_ES256:
+    EVP_MD_CTX_reset(key->ctx);
+    if (EVP_DigestSignInit(key->ctx, NULL, EVP_sha256(), NULL, key->pkey) !=
+            1 ||
+        EVP_DigestSign(key->ctx, NULL, &sig_len, (unsigned char *)input,
+                       input_len) != 1) {
+      free(input);
+      return NULL;
+    }
+    sig = malloc(sig_len);
+    if (EVP_DigestSign(key->ctx, sig, &sig_len, (unsigned char *)input,
+                       input_len) != 1) {
+      free(sig);
+      free(input);
+      return NULL;
+    }
+    if (key->alg == JWT_ES256) {
+      if (jwt_ecdsa_raw(sig, sig_len, raw) != 0) {
+        free(sig);
+        free(input);
+        return NULL;
+      }
+      signature = jwt_base64url(raw, JWT_ES256_LEN, &signature_len);
+    } else {
+      signature = jwt_base64url(sig, sig_len, &signature_len);
+    }
+    free(sig);
+    break;
+  default:
+    free(input);
+    return NULL;
+  }
+
+  token = malloc(input_len + signature_len + 2);
+  memcpy(token, input, input_len);
+  token[input_len] = '.';
+  memcpy(token + input_len + 1, signature, signature_len + 1);
+  free(signature);
+  free(input);
+
+  return token;
+}
@@ -0,0 +1,21 @@
+/*
+ * JSON Web Token signing (HS256, RS256, ES256)
+ */
+
+#ifndef JWT_H
+#define JWT_H
+
+#include <stdlib.h>
+
+typedef enum { JWT_HS256, JWT_RS256, JWT_ES256 } jwt_alg;
+
+typedef struct jwt_key jwt_key;
+
+int jwt_alg_parse(const char *name, jwt_alg *alg);
+jwt_key *jwt_key_load(jwt_alg alg, const char *key, size_t key_len,
+                      const char *kid);
+jwt_key *jwt_key_load_file(jwt_alg alg, const char *path, const char *kid);
+void jwt_key_free(jwt_key *key);
+char *jwt_sign(jwt_key *key, const char *claims, size_t claims_len);
+
+#endif /* JWT_H */
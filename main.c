@@ -63,24 +63,101 @@ int run_script(lua_State *L, const char *script) {
   return EXIT_SUCCESS;
 }
 
+void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [OPTIONS] [--record TRACE] [SCRIPT]\n"
+          "       %s [OPTIONS] --replay TRACE SCRIPT\n"
+          "       %s --replay TRACE [--speed N[x]] [--host HOST[:PORT]]\n",
+          prog, prog, prog);
+  fprintf(stderr, "\nOptions:\n"
+                  "  --profile          print time of phases of the client\n"
+                  "  --trace FILE       write timeline of requests\n"
+                  "  --lua-profile FILE write folded stacks of Lua code\n");
+}
+
 int main(int argc, char **argv) {
-  char *err = NULL;
-  int res = EXIT_SUCCESS;
+  char *err = NULL, *end;
+  const char *script = NULL, *record = NULL, *replay = NULL, *host = NULL,
+             *trace = NULL, *lua_profile = NULL;
+  double speed = 0;
+  int i, profile = 0, res = EXIT_SUCCESS;
   lua_State *L = NULL;
 
-  if (argc > 2) {
-    fprintf(stderr, "Usage: %s SCRIPT\n", argv[0]);
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+      record = argv[++i];
+    } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+      replay = argv[++i];
+    } else if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc) {
+      speed = strtod(argv[++i], &end);
+      if (speed <= 0 || (*end && strcmp(end, "x") != 0)) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+    } else if (strcmp(argv[i], "--host") == 0 && i + 1 < argc) {
+      host = argv[++i];
+    } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+      trace = argv[++i];
+    } else if (strcmp(argv[i], "--lua-profile") == 0 && i + 1 < argc) {
+      lua_profile = argv[++i];
+    } else if (strcmp(argv[i], "--profile") == 0) {
+      profile = 1;
+    } else if (argv[i][0] == '-' || script) {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    } else {
+      script = argv[i];
+    }
+  }
+  // speed and host apply only to replayed traffic
+  if ((record && replay) || ((speed || host) && (!replay || script)) ||
+      ((trace || lua_profile) && replay && !script)) {
+    usage(argv[0]);
     return EXIT_FAILURE;
   }
 
   L = api_init(&err);
+  if (profile) {
+    api_profile_enable();
+  }
 
-  if (argc == 1) {
+  if (replay && !script) {
+    res = api_replay_traffic(replay, speed ? speed : 1, host, &err);
+  } else if (record) {
+    res = api_record(record, &err);
+  } else if (replay) {
+    res = api_replay(replay, &err);
+  }
+  if (!err && trace) {
+    api_trace(trace, &err);
+  }
+  if (!err && lua_profile) {
+    api_lua_profile(L, lua_profile, &err);
+  }
+  if (err) {
+    fprintf(stderr, "%s: %s\n", PROGNAME, err);
+    free(err);
+    res = EXIT_FAILURE;
+  } else if (replay && !script) {
+    res = EXIT_SUCCESS;
+  } else if (!script) {
     res = repl(L);
   } else {
-    res = run_script(L, argv[1]);
+    res = run_script(L, script);
   }
 
+  api_profile_print(stderr);
+  if (api_trace_write(&err)) {
+    fprintf(stderr, "%s: %s\n", PROGNAME, err);
+    free(err);
+    err = NULL;
+    res = EXIT_FAILURE;
+  }
+  if (api_lua_profile_write(&err)) {
+    fprintf(stderr, "%s: %s\n", PROGNAME, err);
+    free(err);
+    res = EXIT_FAILURE;
+  }
   api_cleanup(L);
   return res;
 }
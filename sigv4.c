@@ -0,0 +1,258 @@
+/*
+ * AWS Signature Version 4 style request signing
+ */
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "sigv4.h"
+#include "utstring.h"
+
+#define SIGV4_ALGORITHM "AWS4-HMAC-SHA256"
+#define SIGV4_TERMINATOR "aws4_request"
+
+#define SIGV4_SIGNED_HEADERS "host;x-amz-content-sha256;x-amz-date"
+#define SIGV4_SIGNED_HEADERS_TOKEN                                             \
+  "host;x-amz-content-sha256;x-amz-date;x-amz-security-token"
+
+static void sigv4_hex(const unsigned char *src, size_t len, char *hex) {
+  static const char digits[] = "0123456789abcdef";
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    hex[i * 2] = digits[src[i] >> 4];
+    hex[i * 2 + 1] = digits[src[i] & 0xf];
+  }
+  hex[len * 2] = 0;
+}
+
+static void sigv4_hmac(const unsigned char *key, size_t key_len,
+                       const char *data, size_t len, unsigned char *out) {
+  unsigned int out_len = SIGV4_HASH_LEN;
+
+  HMAC(EVP_sha256(), key, key_len, (const unsigned char *)data, len, out,
+       &out_len);
+}
+
+/**
+ * sigv4_payload_hash - Hex encoded SHA-256 of the payload
+ * @data: Payload
+ * @len: Length of the payload
+ * @hex: Output buffer of at least SIGV4_HEX_LEN + 1 bytes
+ */
+void sigv4_payload_hash(const void *data, size_t len, char *hex) {
+  EVP_MD_CTX *ctx;
+  unsigned char hash[SIGV4_HASH_LEN];
+
+  ctx = EVP_MD_CTX_new();
+  EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+  EVP_DigestUpdate(ctx, data, len);
+  EVP_DigestFinal_ex(ctx, hash, NULL);
+  EVP_MD_CTX_free(ctx);
+
+  sigv4_hex(hash, SIGV4_HASH_LEN, hex);
+}
+
+/**
+ * sigv4_timestamp - Format time as ISO 8601 basic format (20150830T123600Z)
+ * @t: Time
+ * @timestamp: Output buffer of at least SIGV4_TIMESTAMP_LEN + 1 bytes
+ */
+void sigv4_timestamp(time_t t, char *timestamp) {
+  struct tm tm;
+
+  gmtime_r(&t, &tm);
+  strftime(timestamp, SIGV4_TIMESTAMP_LEN + 1, "%Y%m%dT%H%M%SZ", &tm);
+}
+
+/* Derives the signing key, it is cached until the date changes */
+static const unsigned char *sigv4_signing_key(sigv4_credentials *cred,
+                                              const char *date) {
+  unsigned char k[SIGV4_HASH_LEN];
+  char *secret;
+
+  if (strcmp(cred->date, date) == 0) {
+    return cred->key;
+  }
+
+  secret = malloc(strlen(cred->secret_key) + 5);
+  sprintf(secret, "AWS4%s", cred->secret_key);
+  sigv4_hmac((unsigned char *)secret, strlen(secret), date, SIGV4_DATE_LEN, k);
+  free(secret);
+  sigv4_hmac(k, SIGV4_HASH_LEN, cred->region, strlen(cred->region), k);
+  sigv4_hmac(k, SIGV4_HASH_LEN, cred->service, strlen(cred->service), k);
+  sigv4_hmac(k, SIGV4_HASH_LEN, SIGV4_TERMINATOR, strlen(SIGV4_TERMINATOR),
+             cred->key);
+  memcpy(cred->date, date, SIGV4_DATE_LEN);
+  cred->date[SIGV4_DATE_LEN] = 0;
+
+  return cred->key;
+}
+
+static int sigv4_param_cmp(const void *a, const void *b) {
+  const char *pa = *(const char **)a, *pb = *(const char **)b;
+  size_t la = strcspn(pa, "="), lb = strcspn(pb, "=");
+  int res;
+
+  /* sort by name, then by value */
+  res = strncmp(pa, pb, la < lb ? la : lb);
+  if (res == 0 && la != lb) {
+    res = la < lb ? -1 : 1;
+  }
+  return res ? res : strcmp(pa + la, pb + lb);
+}
+
+static int sigv4_hex_digit(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  } else if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  } else if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+/* Appends URI encoded name or value of query parameter, which may be already
+ * percent encoded. Only unreserved characters are left as they are and the
+ * escapes are in upper case. */
+static void sigv4_uri_encode(UT_string *s, const char *src, size_t len) {
+  unsigned char c;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    c = (unsigned char)src[i];
+    if (c == '%' && i + 2 < len && sigv4_hex_digit(src[i + 1]) >= 0 &&
+        sigv4_hex_digit(src[i + 2]) >= 0) {
+      c = (unsigned char)(sigv4_hex_digit(src[i + 1]) << 4 |
+                          sigv4_hex_digit(src[i + 2]));
+      i += 2;
+    }
+    if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') ||
+        (c >= '0' && c <= '9') || c == '-' || c == '_' || c == '.' ||
+        c == '~') {
+      utstring_bincpy(s, &c, 1);
+    } else {
+      utstring_printf(s, "%%%02X", c);
+    }
+  }
+}
+
+/* Appends canonical query string, parameters are URI encoded and sorted by
+ * name, then by value */
+static void sigv4_canonical_query(UT_string *s, const char *query) {
+  UT_string *param;
+  char **params = NULL;
+  const char *p;
+  size_t i, n = 0, len, name_len;
+
+  utstring_new(param);
+  for (p = query; *p; p += len + (p[len] == '&')) {
+    len = strcspn(p, "&");
+    if (!len) {
+      continue;
+    }
+    name_len = strcspn(p, "=&");
+    utstring_clear(param);
+    sigv4_uri_encode(param, p, name_len);
+    utstring_printf(param, "=");
+    if (name_len < len) {
+      sigv4_uri_encode(param, p + name_len + 1, len - name_len - 1);
+    }
+    params = realloc(params, (n + 1) * sizeof(char *));
+    params[n] = malloc(utstring_len(param) + 1);
+    memcpy(params[n++], utstring_body(param), utstring_len(param) + 1);
+  }
+  utstring_free(param);
+  if (n) {
+    qsort(params, n, sizeof(char *), sigv4_param_cmp);
+  }
+  for (i = 0; i < n; i++) {
+    utstring_printf(s, "%s%s", i ? "&" : "", params[i]);
+    free(params[i]);
+  }
+  free(params);
+}
+
+/**
+ * sigv4_authorization - Sign the request
+ * @cred: Credentials, signing key is cached in them
+ * @method: HTTP method
+ * @url: Request URL (with encoded path)
+ * @payload_hash: Hash of the body computed by sigv4_payload_hash()
+ * @timestamp: Request time formatted by sigv4_timestamp()
+ * Returns: Allocated value of Authorization header
+ *
+ * Signed headers are Host (taken from the URL), X-Amz-Content-Sha256,
+ * X-Amz-Date and X-Amz-Security-Token if there is a session token. Caller is
+ * responsible for sending these headers and for freeing the returned value.
+ */
+char *sigv4_authorization(sigv4_credentials *cred, const char *method,
+                          const char *url, const char *payload_hash,
+                          const char *timestamp) {
+  UT_string *s;
+  const char *host, *path, *query, *signed_headers;
+  size_t host_len, path_len;
+  unsigned char hash[SIGV4_HASH_LEN];
+  char hex[SIGV4_HEX_LEN + 1], date[SIGV4_DATE_LEN + 1], *res;
+
+  host = strstr(url, "://");
+  host = host ? host + 3 : url;
+  host_len = strcspn(host, "/?");
+  path = host + host_len;
+  path_len = strcspn(path, "?");
+  query = path[path_len] == '?' ? path + path_len + 1 : "";
+  /* default ports are not part of the Host header */
+  if (strncmp(url, "http:", 5) == 0 && host_len > 3 &&
+      strncmp(host + host_len - 3, ":80", 3) == 0) {
+    host_len -= 3;
+  } else if (strncmp(url, "https:", 6) == 0 && host_len > 4 &&
+             strncmp(host + host_len - 4, ":443", 4) == 0) {
+    host_len -= 4;
+  }
+  signed_headers =
+      cred->session_token ? SIGV4_SIGNED_HEADERS_TOKEN : SIGV4_SIGNED_HEADERS;
+  memcpy(date, timestamp, SIGV4_DATE_LEN);
+  date[SIGV4_DATE_LEN] = 0;
+
+  /* canonical request */
+  utstring_new(s);
+  utstring_printf(s, "%s\n", method);
+  if (path_len) {
+    utstring_bincpy(s, path, path_len);
+  } else {
+    utstring_printf(s, "/");
+  }
+  utstring_printf(s, "\n");
+  sigv4_canonical_query(s, query);
+  utstring_printf(s, "\nhost:%.*s\n", (int)host_len, host);
+  utstring_printf(s, "x-amz-content-sha256:%s\n", payload_hash);
+  utstring_printf(s, "x-amz-date:%s\n", timestamp);
+  if (cred->session_token) {
+    utstring_printf(s, "x-amz-security-token:%s\n", cred->session_token);
+  }
+  utstring_printf(s, "\n%s\n%s", signed_headers, payload_hash);
+  sigv4_payload_hash(utstring_body(s), utstring_len(s), hex);
+
+  /* string to sign */
+  utstring_clear(s);
+  utstring_printf(s, "%s\n%s\n%s/%s/%s/%s\n%s", SIGV4_ALGORITHM, timestamp,
+                  date, cred->region, cred->service, SIGV4_TERMINATOR, hex);
+  sigv4_hmac(sigv4_signing_key(cred, date), SIGV4_HASH_LEN, utstring_body(s),
+             utstring_len(s), hash);
+  sigv4_hex(hash, SIGV4_HASH_LEN, hex);
+
+  utstring_clear(s);
+  utstring_printf(s,
+                  "%s Credential=%s/%s/%s/%s/%s, SignedHeaders=%s, "
+                  "Signature=%s",
+                  SIGV4_ALGORITHM, cred->access_key, date, cred->region,
+                  cred->service, SIGV4_TERMINATOR, signed_headers, hex);
+  res = malloc(utstring_len(s) + 1);
+  memcpy(res, utstring_body(s), utstring_len(s) + 1);
+  utstring_free(s);
+
+  return res;
+}
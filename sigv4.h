@@ -0,0 +1,33 @@
+/*
+ * AWS Signature Version 4 style request signing
+ */
+
+#ifndef SIGV4_H
+#define SIGV4_H
+
+#include <stdlib.h>
+#include <time.h>
+
+#define SIGV4_HASH_LEN 32
+#define SIGV4_HEX_LEN (SIGV4_HASH_LEN * 2)
+#define SIGV4_DATE_LEN 8
+#define SIGV4_TIMESTAMP_LEN 16
+
+typedef struct {
+  char *access_key;
+  char *secret_key;
+  char *region;
+  char *service;
+  char *session_token;
+  /* signing key derived for the date */
+  char date[SIGV4_DATE_LEN + 1];
+  unsigned char key[SIGV4_HASH_LEN];
+} sigv4_credentials;
+
+void sigv4_payload_hash(const void *data, size_t len, char *hex);
+void sigv4_timestamp(time_t t, char *timestamp);
+char *sigv4_authorization(sigv4_credentials *cred, const char *method,
+                          const char *url, const char *payload_hash,
+                          const char *timestamp);
+
+#endif /* SIGV4_H */
@@ -43,3 +43,175 @@ assert(type(resp.body) == 'table', 'invalid type of response body: ' .. type(res
 assert(resp.body.title == "example", 'unexpected title: ' .. resp.body.title)
 assert(resp.body.description == "this is an example todo item",
   'unexpected description: ' .. resp.body.description)
+
+resp = send(ep.request { method = DELETE, path = '/echo', body = { id = 1 } })
+
+assert(resp.status == 200, 'invalid response status: ' .. resp.status)
+assert(type(resp.body) == 'table' and resp.body.id == 1, 'body of DELETE request was not sent')
+
+resp = send(ep.get { path = '/gzip', compressed = true })
+
+assert(not resp.err, 'unexpected error: ' .. (resp.err or ''))
+assert(resp.body.title == "example", 'unexpected body of compressed response')
+assert(resp.decoded_size > 0, 'invalid decoded size: ' .. resp.decoded_size)
+assert(resp.compressed_size < resp.decoded_size,
+  'invalid compressed size: ' .. resp.compressed_size)
+
+gzip_ep = endpoint { proto = http, host = 'localhost:8000', compressed = true }
+resp = send(gzip_ep.get { path = '/gzip', compressed = false })
+
+assert(not resp.err, 'unexpected error: ' .. (resp.err or ''))
+assert(resp.compressed_size == resp.decoded_size,
+  'compressed = false of request was not used')
+
+for _, encoding in ipairs { 'gzip', 'zstd' } do
+  -- /echo sends the compressed body back with its Content-Encoding
+  local ok, req = pcall(gzip_ep.post, { path = '/echo', body = { title = 'example' }, compress = encoding })
+  if ok then
+    resp = send(req)
+
+    assert(not resp.err, 'unexpected error: ' .. (resp.err or ''))
+    assert(resp.headers['Content-Encoding'] == encoding,
+      'body was not compressed: ' .. tostring(resp.headers['Content-Encoding']))
+    assert(resp.body.title == 'example', 'unexpected body of ' .. encoding .. ' round trip')
+  end
+end
+
+item = ep:prepare { path = '/items/{id}', headers = { Accept = 'application/json' } }
+resp = send { item { id = 42 }, item { id = 'a b' } }
+
+assert(not resp[1].err, 'unexpected error: ' .. (resp[1].err or ''))
+assert(resp[1].status == 200, 'invalid response status: ' .. resp[1].status)
+assert(resp[1].url == 'http://localhost:8000/items/42', 'unexpected url: ' .. resp[1].url)
+assert(resp[2].url == 'http://localhost:8000/items/a%20b', 'unexpected url: ' .. resp[2].url)
+
+token = oauth2 {
+  token_url = 'http://localhost:8000/token',
+  client_id = 'test',
+  client_secret = 'secret'
+}
+ep1 = endpoint { proto = http, host = 'localhost:8000', auth = token }
+ep2 = endpoint { proto = http, host = 'localhost:8000', auth = token }
+resp = send { ep1.get '/1', ep2.get '/2' }
+
+for _, r in ipairs(resp) do
+  assert(not r.err, 'unexpected error: ' .. (r.err or ''))
+  assert(r.body.authorization == 'Bearer test-token',
+    'unexpected authorization: ' .. tostring(r.body.authorization))
+end
+
+signed = endpoint {
+  proto = http,
+  host = 'localhost:8000',
+  auth = sigv4_auth {
+    access_key = 'AKIDEXAMPLE',
+    secret_key = 'wJalrXUtnFEMI/K7MDENG+bPxRfiCYEXAMPLEKEY',
+    region = 'us-east-1',
+    service = 'service'
+  }
+}
+resp = send(signed.post { path = '/1', body = { title = 'example' } })
+
+assert(not resp.err, 'unexpected error: ' .. (resp.err or ''))
+assert(resp.body.authorization:find('^AWS4%-HMAC%-SHA256 Credential=AKIDEXAMPLE/'),
+  'unexpected authorization: ' .. tostring(resp.body.authorization))
+
+minted = endpoint {
+  proto = http,
+  host = 'localhost:8000',
+  auth = jwt_auth { alg = 'HS256', key = 'secret', claims = { sub = 'test' }, reuse = true }
+}
+resp = send { minted.get '/1', minted.get '/2' }
+
+for _, r in ipairs(resp) do
+  assert(not r.err, 'unexpected error: ' .. (r.err or ''))
+  assert(r.body.authorization:find('^Bearer eyJhbGciOiJIUzI1NiIsInR5cCI6IkpXVCJ9%.'),
+    'unexpected authorization: ' .. tostring(r.body.authorization))
+end
+assert(resp[1].body.authorization == resp[2].body.authorization, 'token was not reused')
+
+flaky = endpoint { proto = http, host = 'localhost:8000', retry = { max = 3, delay = 0.01 } }
+resp = send { flaky.get '/flaky', flaky.get '/1' }
+
+assert(resp[1].status == 200, 'invalid response status: ' .. resp[1].status)
+assert(resp[1].attempts == 3, 'unexpected attempts: ' .. resp[1].attempts)
+assert(resp[2].attempts == 1, 'unexpected attempts: ' .. resp[2].attempts)
+
+resp = send(ep.get { path = '/1', hedge = { after = 0 } })
+
+assert(resp.status == 200, 'invalid response status: ' .. resp.status)
+assert(resp.hedges == 1, 'unexpected hedges: ' .. resp.hedges)
+
+resp = send({ flaky.get '/1' }, { deadline = 0 })
+
+assert(resp[1].err == 'deadline', 'unexpected error: ' .. tostring(resp[1].err))
+
+paced = endpoint { proto = http, host = 'localhost:8000', rate_limit = { rps = 10 } }
+resp = send({ paced.get '/1', paced.get '/2', paced.get '/3' }, { deadline = 0.15 })
+
+assert(resp[1].status == 200, 'invalid response status: ' .. tostring(resp[1].status))
+assert(resp[3].err == 'deadline', 'request was not delayed by rate limit')
+
+fragile = endpoint { proto = http, host = 'localhost:1', breaker = { failures = 1, cooldown = 60 } }
+resp = send { fragile.get '/', fragile.get '/' }
+
+assert(resp[1].err and resp[1].err ~= 'circuit_open', 'unexpected error: ' .. tostring(resp[1].err))
+resp = send(fragile.get '/')
+assert(resp.err == 'circuit_open', 'unexpected error: ' .. tostring(resp.err))
+
+cached = endpoint { proto = http, host = 'localhost:8000', cache = { size = 65536 } }
+resp = send(cached.get '/cached')
+
+assert(resp.status == 200, 'invalid response status: ' .. resp.status)
+assert(resp.cache == 'miss', 'unexpected cache: ' .. tostring(resp.cache))
+resp = send(cached.get '/cached')
+assert(resp.cache == 'hit', 'unexpected cache: ' .. tostring(resp.cache))
+resp = send { cached.get '/etag', cached.get { path = '/cached', cache = false } }
+assert(resp[2].cache == nil, 'unexpected cache: ' .. tostring(resp[2].cache))
+resp = send(cached.get '/etag')
+assert(resp.status == 200, 'invalid response status: ' .. resp.status)
+assert(resp.cache == 'revalidated', 'unexpected cache: ' .. tostring(resp.cache))
+resp = send { cached.get { path = '/vary', headers = { Accept = 'application/json' } } }
+resp = send { cached.get { path = '/vary', headers = { Accept = 'text/plain' } } }
+assert(resp[1].cache == 'miss', 'response for other Vary headers was used')
+resp = send { cached.get { path = '/vary', headers = { Accept = 'text/plain' } } }
+assert(resp[1].cache == 'hit', 'unexpected cache: ' .. tostring(resp[1].cache))
+
+dir = os.tmpname()
+os.remove(dir)
+stored = endpoint { proto = http, host = 'localhost:8000', disk_cache = { dir = dir } }
+resp = send(stored.post { path = '/1', body = { id = 1 } })
+
+assert(resp.cache == 'miss', 'unexpected cache: ' .. tostring(resp.cache))
+resp = send(stored.post { path = '/1', body = { id = 1 } })
+assert(resp.status == 200, 'invalid response status: ' .. resp.status)
+assert(resp.cache == 'disk', 'unexpected cache: ' .. tostring(resp.cache))
+assert(resp.body.title == 'example', 'unexpected body: ' .. tostring(resp.body.title))
+resp = send(stored.post { path = '/1', body = { id = 2 } })
+assert(resp.cache == 'miss', 'unexpected cache: ' .. tostring(resp.cache))
+
+if serve then
+  srv = serve { port = 0, threads = 2, routes = {
+    ['GET /items/:id'] = function(req) return { body = { id = req.params.id } } end,
+    ['GET /items/all'] = { status = 201, body = 'all' },
+  } }
+  local local_ep = endpoint { proto = http, host = 'localhost:' .. srv.port }
+  resp = send { local_ep.get '/items/7', local_ep.get '/items/all', local_ep.get '/none' }
+
+  assert(resp[1].status == 200, 'invalid response status: ' .. tostring(resp[1].status))
+  assert(resp[1].body.id == '7', 'unexpected body: ' .. to_json(resp[1].body))
+  assert(resp[2].status == 201 and resp[2].body == 'all', 'unexpected static response')
+  assert(resp[3].status == 404, 'invalid response status: ' .. tostring(resp[3].status))
+  srv:stop()
+end
+
+stats_ep = endpoint { proto = http, host = 'localhost:8000', stats = true }
+send { stats_ep.get '/1', stats_ep.get '/2' }
+stats = stats_ep:stats()
+assert(ep:stats() == nil, 'stats of endpoint without stats')
+assert(stats.requests == 2 and stats.in_flight == 0, 'unexpected requests: ' .. stats.requests)
+assert(stats.statuses['2xx'] == 2 and stats.latency_count == 2, 'unexpected statuses')
+assert(metrics():find('apinette_requests_total{endpoint="http://localhost:8000"} 2', 1, true),
+  'missing requests in metrics')
+
+assert(profile_report() == nil, 'profile report without --profile')
@@ -0,0 +1,88 @@
+/*
+ * Response bodies shared by the test servers
+ */
+
+#include <string.h>
+
+#include "test_body.h"
+
+/**
+ * test_parse_size - Parse size with optional K, M or G suffix
+ * @arg: Size string, ie. "1M"
+ * Returns: Size in bytes or (size_t)-1 if the string is invalid
+ */
+size_t test_parse_size(const char *arg) {
+  char *end;
+  size_t size = strtoul(arg, &end, 10);
+
+  switch (*end) {
+  case 'G':
+    size *= 1024;
+    // fall through
+  case 'M':
+    size *= 1024;
+    // fall through
+  case 'K':
+    size *= 1024;
+    end++;
+    break;
+  }
+  if (*end || end == arg) {
+    return (size_t)-1;
+  }
+  return size;
+}
+
+static json_t *test_item(void) {
+  json_t *item = json_object();
+
+  json_object_set_new(item, "title", json_string("example"));
+  json_object_set_new(item, "description",
+                      json_string("this is an example todo item"));
+  return item;
+}
+
+/**
+ * test_body - Create default response
+ * @shape: Shape of the response
+ * @authorization: Authorization header echoed by the item or %NULL
+ * Returns: Todo item or a list of shape->items items
+ *
+ * The item is padded by a "data" field to shape->size bytes, when it is
+ * encoded by json_dumps() without flags.
+ */
+json_t *test_body(const test_body_shape *shape, const char *authorization) {
+  json_t *body, *item;
+  char *tmp, *pad;
+  size_t len;
+  long i;
+
+  if (shape->items) {
+    body = json_array();
+    for (i = 0; i < shape->items; i++) {
+      item = test_item();
+      json_object_set_new(item, "id", json_integer(i + 1));
+      json_array_append_new(body, item);
+    }
+    return body;
+  }
+
+  body = test_item();
+  if (authorization) {
+    json_object_set_new(body, "authorization", json_string(authorization));
+  }
+  if (shape->size) {
+    tmp = json_dumps(body, 0);
+    // "data" field adds its name, quotes, colon, space and comma
+    len = strlen(tmp) + 12;
+    free(tmp);
+    if (shape->size > len) {
+      pad = malloc(shape->size - len + 1);
+      memset(pad, 'x', shape->size - len);
+      pad[shape->size - len] = 0;
+      json_object_set_new(body, "data", json_string(pad));
+      free(pad);
+    }
+  }
+  return body;
+}
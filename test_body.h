@@ -0,0 +1,22 @@
+/*
+ * Response bodies shared by the test servers
+ */
+
+#ifndef TEST_BODY_H
+#define TEST_BODY_H
+
+#include <stdlib.h>
+
+#include <jansson.h>
+
+/* Shape of the default response, a todo item padded to size bytes or a list
+ * of items */
+typedef struct {
+  size_t size;
+  long items;
+} test_body_shape;
+
+size_t test_parse_size(const char *arg);
+json_t *test_body(const test_body_shape *shape, const char *authorization);
+
+#endif /* TEST_BODY_H */
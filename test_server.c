@@ -1,6 +1,11 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -9,18 +14,137 @@
 
 #include <jansson.h>
 
+#include "compress.h"
+#include "test_body.h"
+
 #define PROG "test_server"
 #define DEFAULT_PORT 8000
 
-typedef enum option_type { OPTION_NONE, OPTION_PORT } option_type;
+#define TOKEN_PATH "/token"
+#define TOKEN "test-token"
+#define TOKEN_EXPIRES_IN 3600
+
+/* every FLAKY_FAILURES requests of FLAKY_PATH are followed by a success */
+#define FLAKY_PATH "/flaky"
+#define FLAKY_FAILURES 2
+
+/* CACHED_PATH is fresh for CACHED_MAX_AGE seconds, ETAG_PATH has to be
+ * revalidated, both respond 304 to a matching If-None-Match */
+#define CACHED_PATH "/cached"
+#define CACHED_MAX_AGE "max-age=1"
+#define ETAG_PATH "/etag"
+#define ETAG "\"v1\""
+
+/* cached like CACHED_PATH, separately for each Accept of the request */
+#define VARY_PATH "/vary"
+
+/* responds with the request body */
+#define ECHO_PATH "/echo"
+
+/* responds with gzip compressed body if the client accepts it, the body is
+ * padded to GZIP_SIZE bytes, so that it shrinks */
+#define GZIP_PATH "/gzip"
+#define GZIP_SIZE 4096
+
+#define TLS_PRIORITIES "NORMAL"
+#define TLS_NO_TICKETS ":%NO_TICKETS"
+
+typedef enum option_type {
+  OPTION_NONE,
+  OPTION_PORT,
+  OPTION_THREADS,
+  OPTION_BODY_SIZE,
+  OPTION_ITEMS,
+  OPTION_FAULT,
+  OPTION_FAULTS,
+  OPTION_SEED,
+  OPTION_TLS_CERT,
+  OPTION_TLS_KEY,
+  OPTION_TLS_PRIORITIES
+} option_type;
+
+static test_body_shape shape;
+static const test_body_shape gzip_shape = {GZIP_SIZE, 0};
+
+/* default response without authorization built once by --prebuilt */
+static char *prebuilt_body;
+static struct MHD_Response *prebuilt;
+
+static atomic_int flaky;
+
+typedef enum {
+  LATENCY_NONE,
+  LATENCY_FIXED,     // a milliseconds
+  LATENCY_UNIFORM,   // between a and b milliseconds
+  LATENCY_LOGNORMAL, // median a milliseconds, heavy tail by sigma b
+} latency_type;
+
+/* Misbehavior of requests whose path starts with prefix, rates are
+ * probabilities and times are in milliseconds */
+typedef struct {
+  char *prefix;
+  latency_type latency;
+  double latency_a, latency_b;
+  double rate_429, rate_500, rate_503;
+  int retry_after; // seconds or -1
+  double stall, stall_ms;
+  double reset;
+  size_t drip_bytes;
+  double drip_ms;
+} fault;
+
+/* first matching fault applies */
+static fault *faults;
+static size_t faults_len;
+
+/* shared random state, seeded by --seed for reproducible runs */
+static unsigned short fault_seed[3];
+static pthread_mutex_t fault_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Response body sent by fault_body_read() */
+typedef struct {
+  char *data;
+  size_t len;
+  int reset; // connection is reset in the middle of the body
+  const fault *f;
+} fault_body;
+
+/* Request body received by ECHO_PATH */
+typedef struct {
+  char *data;
+  size_t len;
+} upload;
 
 void usage(void) {
   fprintf(stderr,
           "Usage: %s [OPTIONS]\n\n"
           "Options:\n"
-          "\t-h|--help\tprint this help\n"
-          "\t-p|--port PORT\tset TCP port (default %d)\n\n",
-          PROG, DEFAULT_PORT);
+          "\t-h|--help\t\tprint this help\n"
+          "\t-p|--port PORT\t\tset TCP port (default %d)\n"
+          "\t-t|--threads N\t\tserve by a pool of N epoll threads\n"
+          "\t--prebuilt\t\treuse the default response built at start\n"
+          "\t--body-size SIZE\tpad the default response to SIZE bytes "
+          "(suffixes K, M, G)\n"
+          "\t--items N\t\trespond with a list of N todo items\n"
+          "\t--fault RULE\t\tmisbehave on requests matching RULE\n"
+          "\t--faults FILE\t\tread fault rules from FILE, one per line\n"
+          "\t--seed N\t\tseed random faults\n"
+          "\t--tls\t\t\tserve https by the certificate generated at build\n"
+          "\t--tls-cert FILE\t\tserve https by PEM certificate FILE\n"
+          "\t--tls-key FILE\t\tPEM private key of the certificate\n"
+          "\t--tls-priorities STR\tGnuTLS priorities (default %s)\n"
+          "\t--no-tickets\t\tdisable session tickets\n\n"
+          "Fault rule is a path prefix followed by comma or space separated\n"
+          "settings, e.g. \"/slow,latency=lognormal:20:1,503=0.1\":\n"
+          "\tlatency=fixed:MS|uniform:MIN:MAX|lognormal:MEDIAN:SIGMA\n"
+          "\t429=RATE, 500=RATE, 503=RATE\terror responses\n"
+          "\tretry-after=SECONDS\t\tof 429 and 503 responses\n"
+          "\tstall=RATE:MS\t\t\tdelay headers by MS more\n"
+          "\treset=RATE\t\t\treset connection in the middle of the body\n"
+          "\tdrip=BYTES:MS\t\t\tsend BYTES of the body every MS\n\n"
+          "Faults serve each connection by a thread, unless --threads is "
+          "given.\n",
+          PROG, DEFAULT_PORT, TLS_PRIORITIES);
 }
 
 void error(char *format, ...) {
@@ -35,33 +159,418 @@ void error(char *format, ...) {
   exit(EXIT_FAILURE);
 }
 
+/* Reads whole file into nul terminated string */
+static char *read_file(const char *path) {
+  FILE *file = fopen(path, "rb");
+  char *data;
+  long len;
+
+  if (!file) {
+    error("Cannot open %s", path);
+  }
+  fseek(file, 0, SEEK_END);
+  len = ftell(file);
+  rewind(file);
+  data = malloc(len + 1);
+  if (len < 0 || fread(data, 1, len, file) != (size_t)len) {
+    error("Cannot read %s", path);
+  }
+  data[len] = 0;
+  fclose(file);
+  return data;
+}
+
+static double fault_random(void) {
+  double r;
+
+  pthread_mutex_lock(&fault_mutex);
+  r = erand48(fault_seed);
+  pthread_mutex_unlock(&fault_mutex);
+  return r;
+}
+
+static void fault_sleep(double ms) {
+  struct timespec ts;
+
+  if (ms <= 0) {
+    return;
+  }
+  ts.tv_sec = (time_t)(ms / 1000);
+  ts.tv_nsec = (long)((ms - ts.tv_sec * 1000.0) * 1e6);
+  while (nanosleep(&ts, &ts) != 0) {
+  }
+}
+
+static double fault_latency(const fault *f) {
+  double u1, u2;
+
+  switch (f->latency) {
+  case LATENCY_NONE:
+    break;
+  case LATENCY_FIXED:
+    return f->latency_a;
+  case LATENCY_UNIFORM:
+    return f->latency_a + (f->latency_b - f->latency_a) * fault_random();
+  case LATENCY_LOGNORMAL:
+    // Box-Muller transform of uniform numbers to a standard normal one
+    u1 = 1.0 - fault_random();
+    u2 = fault_random();
+    return f->latency_a *
+           exp(f->latency_b * sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2));
+  }
+  return 0;
+}
+
+static double parse_rate(const char *prefix, const char *arg) {
+  char *end;
+  double rate = strtod(arg, &end);
+
+  if (*end || end == arg || rate < 0 || rate > 1) {
+    error("Invalid fault %s rate: %s", prefix, arg);
+  }
+  return rate;
+}
+
+/* Parses fault rule, the rule is modified */
+static void parse_fault(char *rule) {
+  fault f;
+  char *save, *key, *value;
+  int n = 0;
+
+  memset(&f, 0, sizeof(f));
+  f.retry_after = -1;
+  key = strtok_r(rule, " \t,", &save);
+  if (!key || *key != '/') {
+    error("Invalid fault, it has to start with a path: %s", key ? key : "");
+  }
+  f.prefix = strdup(key);
+  while ((key = strtok_r(NULL, " \t,", &save))) {
+    value = strchr(key, '=');
+    if (!value) {
+      error("Invalid fault %s setting: %s", f.prefix, key);
+    }
+    *value++ = 0;
+    n = -1;
+    if (strcmp(key, "latency") == 0) {
+      if (sscanf(value, "fixed:%lf%n", &f.latency_a, &n) == 1) {
+        f.latency = LATENCY_FIXED;
+      } else if (sscanf(value, "uniform:%lf:%lf%n", &f.latency_a,
+                        &f.latency_b, &n) == 2) {
+        f.latency = LATENCY_UNIFORM;
+      } else if (sscanf(value, "lognormal:%lf:%lf%n", &f.latency_a,
+                        &f.latency_b, &n) == 2) {
+        f.latency = LATENCY_LOGNORMAL;
+      }
+    } else if (strcmp(key, "429") == 0) {
+      f.rate_429 = parse_rate(f.prefix, value);
+      n = strlen(value);
+    } else if (strcmp(key, "500") == 0) {
+      f.rate_500 = parse_rate(f.prefix, value);
+      n = strlen(value);
+    } else if (strcmp(key, "503") == 0) {
+      f.rate_503 = parse_rate(f.prefix, value);
+      n = strlen(value);
+    } else if (strcmp(key, "retry-after") == 0) {
+      sscanf(value, "%d%n", &f.retry_after, &n);
+    } else if (strcmp(key, "stall") == 0) {
+      sscanf(value, "%lf:%lf%n", &f.stall, &f.stall_ms, &n);
+    } else if (strcmp(key, "reset") == 0) {
+      f.reset = parse_rate(f.prefix, value);
+      n = strlen(value);
+    } else if (strcmp(key, "drip") == 0) {
+      sscanf(value, "%zu:%lf%n", &f.drip_bytes, &f.drip_ms, &n);
+    } else {
+      error("Unknown fault %s setting: %s", f.prefix, key);
+    }
+    if (n < 0 || value[n]) {
+      error("Invalid fault %s %s: %s", f.prefix, key, value);
+    }
+  }
+  if (f.rate_429 + f.rate_500 + f.rate_503 > 1) {
+    error("Invalid fault %s, error rates exceed 1", f.prefix);
+  }
+
+  faults = realloc(faults, (faults_len + 1) * sizeof(fault));
+  faults[faults_len++] = f;
+}
+
+static void parse_faults(const char *path) {
+  FILE *file = fopen(path, "r");
+  char *line = NULL, *comment;
+  size_t len = 0;
+
+  if (!file) {
+    error("Cannot open %s", path);
+  }
+  while (getline(&line, &len, file) != -1) {
+    comment = strchr(line, '#');
+    if (comment) {
+      *comment = 0;
+    }
+    line[strcspn(line, "\r\n")] = 0;
+    if (line[strspn(line, " \t")]) {
+      parse_fault(line);
+    }
+  }
+  free(line);
+  fclose(file);
+}
+
+static const fault *find_fault(const char *url) {
+  size_t i;
+
+  for (i = 0; i < faults_len; i++) {
+    if (strncmp(url, faults[i].prefix, strlen(faults[i].prefix)) == 0) {
+      return &faults[i];
+    }
+  }
+  return NULL;
+}
+
+/* Delays the response by the fault latency and responds with an error at
+ * the fault rates. Returns 1 if the error response was queued. */
+static int fault_respond(struct MHD_Connection *connection, const fault *f,
+                         enum MHD_Result *ret) {
+  struct MHD_Response *response;
+  unsigned int status = 0;
+  double r;
+  char *tmp;
+  char retry_after[16];
+
+  if (!f) {
+    return 0;
+  }
+  fault_sleep(fault_latency(f));
+  if (f->stall > 0 && fault_random() < f->stall) {
+    fault_sleep(f->stall_ms);
+  }
+
+  r = fault_random();
+  if (r < f->rate_429) {
+    status = MHD_HTTP_TOO_MANY_REQUESTS;
+  } else if (r < f->rate_429 + f->rate_500) {
+    status = MHD_HTTP_INTERNAL_SERVER_ERROR;
+  } else if (r < f->rate_429 + f->rate_500 + f->rate_503) {
+    status = MHD_HTTP_SERVICE_UNAVAILABLE;
+  } else {
+    return 0;
+  }
+
+  tmp = strdup("{\"error\": \"injected fault\"}");
+  response = MHD_create_response_from_buffer(strlen(tmp), (void *)tmp,
+                                             MHD_RESPMEM_MUST_FREE);
+  MHD_add_response_header(response, "Content-Type", "application/json");
+  if (f->retry_after >= 0 && status != MHD_HTTP_INTERNAL_SERVER_ERROR) {
+    snprintf(retry_after, sizeof(retry_after), "%d", f->retry_after);
+    MHD_add_response_header(response, "Retry-After", retry_after);
+  }
+  *ret = MHD_queue_response(connection, status, response);
+  MHD_destroy_response(response);
+  return 1;
+}
+
+static ssize_t fault_body_read(void *cls, uint64_t pos, char *buf,
+                               size_t max) {
+  fault_body *b = cls;
+  size_t n = b->len - pos;
+
+  if (pos >= b->len) {
+    return MHD_CONTENT_READER_END_OF_STREAM;
+  }
+  if (b->reset) {
+    if (pos >= b->len / 2) {
+      return MHD_CONTENT_READER_END_WITH_ERROR;
+    }
+    n = b->len / 2 - pos;
+  }
+  if (b->f->drip_bytes) {
+    if (pos) {
+      fault_sleep(b->f->drip_ms);
+    }
+    if (n > b->f->drip_bytes) {
+      n = b->f->drip_bytes;
+    }
+  }
+  if (n > max) {
+    n = max;
+  }
+  memcpy(buf, b->data + pos, n);
+  return n;
+}
+
+static void fault_body_free(void *cls) {
+  fault_body *b = cls;
+
+  free(b->data);
+  free(b);
+}
+
+/* Creates response of the allocated data, which is sent slowly or cut off
+ * by the fault */
+static struct MHD_Response *create_response(const fault *f, char *data,
+                                            size_t len) {
+  fault_body *b;
+  int reset = f && f->reset > 0 && fault_random() < f->reset;
+
+  if (!reset && !(f && f->drip_bytes)) {
+    return MHD_create_response_from_buffer(len, (void *)data,
+                                           MHD_RESPMEM_MUST_FREE);
+  }
+  b = calloc(1, sizeof(fault_body));
+  b->data = data;
+  b->len = len;
+  b->reset = reset;
+  b->f = f;
+  return MHD_create_response_from_callback(
+      len, f->drip_bytes ? f->drip_bytes : 32 * 1024, fault_body_read, b,
+      fault_body_free);
+}
+
+static enum MHD_Result echo(struct MHD_Connection *connection,
+                            const fault *f, const char *upload_data,
+                            size_t *upload_data_size, void **con_cls) {
+  upload *u = *con_cls;
+  struct MHD_Response *response;
+  const char *content_type, *content_encoding;
+  enum MHD_Result ret;
+
+  if (!u) {
+    *con_cls = calloc(1, sizeof(upload));
+    return MHD_YES;
+  }
+  if (*upload_data_size) {
+    u->data = realloc(u->data, u->len + *upload_data_size);
+    memcpy(u->data + u->len, upload_data, *upload_data_size);
+    u->len += *upload_data_size;
+    *upload_data_size = 0;
+    return MHD_YES;
+  }
+
+  if (fault_respond(connection, f, &ret)) {
+    return ret;
+  }
+  response = create_response(f, u->data, u->len);
+  u->data = NULL;
+  content_type = MHD_lookup_connection_value(connection, MHD_HEADER_KIND,
+                                             "Content-Type");
+  if (content_type) {
+    MHD_add_response_header(response, "Content-Type", content_type);
+  }
+  // compressed body is sent back as is, so the client decodes it
+  content_encoding = MHD_lookup_connection_value(connection, MHD_HEADER_KIND,
+                                                 "Content-Encoding");
+  if (content_encoding) {
+    MHD_add_response_header(response, "Content-Encoding", content_encoding);
+  }
+  ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+  MHD_destroy_response(response);
+  return ret;
+}
+
+void completed_cb(void *cls, struct MHD_Connection *connection,
+                  void **con_cls, enum MHD_RequestTerminationCode toe) {
+  upload *u = *con_cls;
+
+  (void)cls;
+  (void)connection;
+  (void)toe;
+
+  if (u) {
+    free(u->data);
+    free(u);
+    *con_cls = NULL;
+  }
+}
+
 enum MHD_Result handler_cb(void *cls, struct MHD_Connection *connection,
                            const char *url, const char *method,
                            const char *version, const char *upload_data,
                            size_t *upload_data_size, void **con_cls) {
   struct MHD_Response *response;
-  int ret;
+  enum MHD_Result ret;
   json_t *body;
   char *tmp;
+  const char *authorization;
+  const char *cache_control = NULL, *etag, *accept_encoding;
+  unsigned char *compressed;
+  size_t len;
+  int gzip = 0;
+  unsigned int status = MHD_HTTP_OK;
+  const fault *f = find_fault(url);
 
   (void)cls;
-  (void)url;
-  (void)method;
   (void)version;
-  (void)upload_data;
-  (void)upload_data_size;
-  (void)con_cls;
+
+  if (strcmp(url, ECHO_PATH) == 0) {
+    return echo(connection, f, upload_data, upload_data_size, con_cls);
+  }
+  if (fault_respond(connection, f, &ret)) {
+    return ret;
+  }
+  authorization = MHD_lookup_connection_value(connection, MHD_HEADER_KIND,
+                                              "Authorization");
+  if (prebuilt && !f && !authorization && strcmp(url, TOKEN_PATH) != 0 &&
+      strcmp(url, FLAKY_PATH) != 0 && strcmp(url, CACHED_PATH) != 0 &&
+      strcmp(url, ETAG_PATH) != 0 && strcmp(url, VARY_PATH) != 0 &&
+      strcmp(url, GZIP_PATH) != 0) {
+    return MHD_queue_response(connection, MHD_HTTP_OK, prebuilt);
+  }
 
   body = json_object();
-  json_object_set_new(body, "title", json_string("example"));
-  json_object_set_new(body, "description",
-                      json_string("this is an example todo item"));
-  tmp = json_dumps(body, 0);
+  if ((strcmp(method, MHD_HTTP_METHOD_POST) == 0) &&
+      (strcmp(url, TOKEN_PATH) == 0)) {
+    // OAuth2 token endpoint, accepts any client credentials
+    json_object_set_new(body, "access_token", json_string(TOKEN));
+    json_object_set_new(body, "token_type", json_string("Bearer"));
+    json_object_set_new(body, "expires_in", json_integer(TOKEN_EXPIRES_IN));
+  } else if ((strcmp(url, FLAKY_PATH) == 0) &&
+             (atomic_fetch_add(&flaky, 1) % (FLAKY_FAILURES + 1) <
+              FLAKY_FAILURES)) {
+    status = MHD_HTTP_SERVICE_UNAVAILABLE;
+    json_object_set_new(body, "error", json_string("try again"));
+  } else if ((strcmp(url, CACHED_PATH) == 0) || (strcmp(url, ETAG_PATH) == 0) ||
+             (strcmp(url, VARY_PATH) == 0)) {
+    cache_control = strcmp(url, ETAG_PATH) != 0 ? CACHED_MAX_AGE : "no-cache";
+    etag = MHD_lookup_connection_value(connection, MHD_HEADER_KIND,
+                                       "If-None-Match");
+    if (etag && strcmp(etag, ETAG) == 0) {
+      status = MHD_HTTP_NOT_MODIFIED;
+    }
+    json_object_set_new(body, "title", json_string("cached"));
+  } else {
+    json_decref(body);
+    body = test_body(strcmp(url, GZIP_PATH) == 0 ? &gzip_shape : &shape,
+                     authorization);
+  }
+  tmp = status == MHD_HTTP_NOT_MODIFIED ? strdup("") : json_dumps(body, 0);
   json_decref(body);
-  response = MHD_create_response_from_buffer(strlen(tmp), (void *)tmp,
-                                             MHD_RESPMEM_MUST_FREE);
+  len = strlen(tmp);
+  if (strcmp(url, GZIP_PATH) == 0) {
+    accept_encoding = MHD_lookup_connection_value(connection, MHD_HEADER_KIND,
+                                                  "Accept-Encoding");
+    if (accept_encoding && strstr(accept_encoding, "gzip")) {
+      compressed = compress_gzip((unsigned char *)tmp, len,
+                                 COMPRESS_LEVEL_DEFAULT, &len);
+      if (compressed) {
+        free(tmp);
+        tmp = (char *)compressed;
+        gzip = 1;
+      }
+    }
+  }
+  response = create_response(f, tmp, len);
   ret = MHD_add_response_header(response, "Content-Type", "application/json");
-  ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+  if (cache_control) {
+    ret = MHD_add_response_header(response, "Cache-Control", cache_control);
+    ret = MHD_add_response_header(response, "ETag", ETAG);
+  }
+  if (strcmp(url, VARY_PATH) == 0) {
+    ret = MHD_add_response_header(response, "Vary", "Accept");
+  }
+  if (gzip) {
+    ret = MHD_add_response_header(response, "Content-Encoding", "gzip");
+  }
+  ret = MHD_queue_response(connection, status, response);
   MHD_destroy_response(response);
 
   return ret;
@@ -70,15 +579,49 @@ enum MHD_Result handler_cb(void *cls, struct MHD_Connection *connection,
 int main(int argc, char **argv) {
   char *arg;
   option_type opt = OPTION_NONE;
-  int port = DEFAULT_PORT;
+  int port = DEFAULT_PORT, threads = 0, use_prebuilt = 0;
+  unsigned long seed = time(NULL);
+  int tls = 0, tickets = 1;
+  const char *tls_cert = NULL, *tls_key = NULL;
+  const char *tls_priorities = TLS_PRIORITIES;
+  char *cert = NULL, *key = NULL, *priorities = NULL;
+  unsigned int flags = MHD_USE_INTERNAL_POLLING_THREAD;
+  struct MHD_OptionItem options[8];
+  int n = 0;
+  json_t *body;
+  struct MHD_Daemon *daemon;
 
   while (argc-- > 1) {
     arg = *(++argv);
     if ((strcmp(arg, "-h") == 0) || (strcmp(arg, "--help") == 0)) {
       usage();
       return 1;
-    } else if ((strcmp(arg, "-p") == 0) || (strcmp(arg, "-port") == 0)) {
+    } else if ((strcmp(arg, "-p") == 0) || (strcmp(arg, "--port") == 0)) {
       opt = OPTION_PORT;
+    } else if ((strcmp(arg, "-t") == 0) || (strcmp(arg, "--threads") == 0)) {
+      opt = OPTION_THREADS;
+    } else if (strcmp(arg, "--body-size") == 0) {
+      opt = OPTION_BODY_SIZE;
+    } else if (strcmp(arg, "--items") == 0) {
+      opt = OPTION_ITEMS;
+    } else if (strcmp(arg, "--fault") == 0) {
+      opt = OPTION_FAULT;
+    } else if (strcmp(arg, "--faults") == 0) {
+      opt = OPTION_FAULTS;
+    } else if (strcmp(arg, "--seed") == 0) {
+      opt = OPTION_SEED;
+    } else if (strcmp(arg, "--tls") == 0) {
+      tls = 1;
+    } else if (strcmp(arg, "--tls-cert") == 0) {
+      opt = OPTION_TLS_CERT;
+    } else if (strcmp(arg, "--tls-key") == 0) {
+      opt = OPTION_TLS_KEY;
+    } else if (strcmp(arg, "--tls-priorities") == 0) {
+      opt = OPTION_TLS_PRIORITIES;
+    } else if (strcmp(arg, "--no-tickets") == 0) {
+      tickets = 0;
+    } else if (strcmp(arg, "--prebuilt") == 0) {
+      use_prebuilt = 1;
     } else {
       switch (opt) {
       case OPTION_NONE:
@@ -90,13 +633,98 @@ int main(int argc, char **argv) {
           error("Invalid port number: %s", arg);
         }
         break;
+      case OPTION_THREADS:
+        threads = atoi(arg);
+        if (threads < 1) {
+          error("Invalid number of threads: %s", arg);
+        }
+        break;
+      case OPTION_BODY_SIZE:
+        shape.size = test_parse_size(arg);
+        if (shape.size == (size_t)-1) {
+          error("Invalid size: %s", arg);
+        }
+        break;
+      case OPTION_ITEMS:
+        shape.items = atol(arg);
+        if (shape.items < 1) {
+          error("Invalid number of items: %s", arg);
+        }
+        break;
+      case OPTION_FAULT:
+        parse_fault(arg);
+        break;
+      case OPTION_FAULTS:
+        parse_faults(arg);
+        break;
+      case OPTION_SEED:
+        seed = strtoul(arg, NULL, 10);
+        break;
+      case OPTION_TLS_CERT:
+        tls_cert = arg;
+        tls = 1;
+        break;
+      case OPTION_TLS_KEY:
+        tls_key = arg;
+        tls = 1;
+        break;
+      case OPTION_TLS_PRIORITIES:
+        tls_priorities = arg;
+        break;
       }
+      opt = OPTION_NONE;
     }
   }
 
-  struct MHD_Daemon *daemon;
-  daemon = MHD_start_daemon(MHD_USE_INTERNAL_POLLING_THREAD, port, NULL, NULL,
-                            handler_cb, NULL, MHD_OPTION_END);
+  fault_seed[0] = 0x330e;
+  fault_seed[1] = seed & 0xffff;
+  fault_seed[2] = (seed >> 16) & 0xffff;
+
+  if (use_prebuilt) {
+    body = test_body(&shape, NULL);
+    prebuilt_body = json_dumps(body, 0);
+    json_decref(body);
+    prebuilt = MHD_create_response_from_buffer(
+        strlen(prebuilt_body), prebuilt_body, MHD_RESPMEM_PERSISTENT);
+    MHD_add_response_header(prebuilt, "Content-Type", "application/json");
+  }
+
+  options[n++] = (struct MHD_OptionItem){MHD_OPTION_NOTIFY_COMPLETED,
+                                         (intptr_t)completed_cb, NULL};
+  if (threads) {
+    flags = MHD_USE_EPOLL_INTERNAL_THREAD;
+    options[n++] =
+        (struct MHD_OptionItem){MHD_OPTION_THREAD_POOL_SIZE, threads, NULL};
+  } else if (faults_len) {
+    // faults sleep, which would hold up other connections
+    flags |= MHD_USE_THREAD_PER_CONNECTION;
+  }
+
+  if (tls) {
+#ifdef TEST_SERVER_CERT
+    tls_cert = tls_cert ? tls_cert : TEST_SERVER_CERT;
+    tls_key = tls_key ? tls_key : TEST_SERVER_KEY;
+#endif
+    if (!tls_cert || !tls_key) {
+      error("TLS requires --tls-cert and --tls-key");
+    }
+    cert = read_file(tls_cert);
+    key = read_file(tls_key);
+    priorities = malloc(strlen(tls_priorities) + sizeof(TLS_NO_TICKETS));
+    strcpy(priorities, tls_priorities);
+    if (!tickets) {
+      strcat(priorities, TLS_NO_TICKETS);
+    }
+    flags |= MHD_USE_TLS;
+    options[n++] = (struct MHD_OptionItem){MHD_OPTION_HTTPS_MEM_CERT, 0, cert};
+    options[n++] = (struct MHD_OptionItem){MHD_OPTION_HTTPS_MEM_KEY, 0, key};
+    options[n++] =
+        (struct MHD_OptionItem){MHD_OPTION_HTTPS_PRIORITIES, 0, priorities};
+  }
+  options[n] = (struct MHD_OptionItem){MHD_OPTION_END, 0, NULL};
+
+  daemon = MHD_start_daemon(flags, port, NULL, NULL, handler_cb, NULL,
+                            MHD_OPTION_ARRAY, options, MHD_OPTION_END);
   if (!daemon) {
     return EXIT_FAILURE;
   }
@@ -104,5 +732,16 @@ int main(int argc, char **argv) {
   getchar();
 
   MHD_stop_daemon(daemon);
+  if (prebuilt) {
+    MHD_destroy_response(prebuilt);
+    free(prebuilt_body);
+  }
+  free(cert);
+  free(key);
+  free(priorities);
+  while (faults_len--) {
+    free(faults[faults_len].prefix);
+  }
+  free(faults);
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,518 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <nghttp2/nghttp2.h>
+
+#include <jansson.h>
+
+#include "test_body.h"
+
+#define PROG "test_server_h2"
+#define DEFAULT_PORT 8000
+
+/* responds with the request body */
+#define ECHO_PATH "/echo"
+
+#define MAX_EVENTS 64
+#define READ_BUFFER_SIZE 65536
+/* loops check for the end of the server this often */
+#define POLL_TIMEOUT_MS 100
+
+typedef enum option_type {
+  OPTION_NONE,
+  OPTION_PORT,
+  OPTION_THREADS,
+  OPTION_BODY_SIZE,
+  OPTION_ITEMS,
+  OPTION_MAX_STREAMS,
+  OPTION_WINDOW
+} option_type;
+
+static test_body_shape shape;
+static uint32_t max_streams = 100;
+static uint32_t window = NGHTTP2_INITIAL_WINDOW_SIZE;
+static int port = DEFAULT_PORT;
+
+static atomic_int stopping;
+static atomic_long connections_total;
+static atomic_long streams_total;
+
+/* Request and its response */
+typedef struct {
+  int32_t id;
+  char *path;
+  char *authorization;
+  char *content_type;
+  char *data; // request body, then response body
+  size_t len;
+  size_t pos; // sent bytes of the response body
+} h2_stream;
+
+typedef struct {
+  int fd;
+  long id;
+  nghttp2_session *session;
+  long streams;
+  int active;
+  int max_active; // most streams in flight at once
+} h2_connection;
+
+void usage(void) {
+  fprintf(stderr,
+          "Usage: %s [OPTIONS]\n\n"
+          "HTTP/2 server with prior knowledge (h2c)\n\n"
+          "Options:\n"
+          "\t-h|--help\t\tprint this help\n"
+          "\t-p|--port PORT\t\tset TCP port (default %d)\n"
+          "\t-t|--threads N\t\tserve by N epoll threads (default 1)\n"
+          "\t--body-size SIZE\tpad the default response to SIZE bytes "
+          "(suffixes K, M, G)\n"
+          "\t--items N\t\trespond with a list of N todo items\n"
+          "\t--max-streams N\t\tmaximum concurrent streams of a connection "
+          "(default %u)\n"
+          "\t--window SIZE\t\tinitial flow-control window of streams "
+          "(default %u)\n\n"
+          "Stream counts of each connection are printed when it closes.\n",
+          PROG, DEFAULT_PORT, max_streams, window);
+}
+
+void error(char *format, ...) {
+  va_list ap;
+
+  va_start(ap, format);
+  fprintf(stderr, "%s: ", PROG);
+  vfprintf(stderr, format, ap);
+  fprintf(stderr, "\n");
+  va_end(ap);
+
+  exit(EXIT_FAILURE);
+}
+
+static void stream_free(h2_stream *s) {
+  free(s->path);
+  free(s->authorization);
+  free(s->content_type);
+  free(s->data);
+  free(s);
+}
+
+static ssize_t send_cb(nghttp2_session *session, const uint8_t *data,
+                       size_t length, int flags, void *user_data) {
+  h2_connection *conn = user_data;
+  ssize_t n;
+
+  (void)session;
+  (void)flags;
+
+  do {
+    n = send(conn->fd, data, length, MSG_NOSIGNAL);
+  } while (n < 0 && errno == EINTR);
+  if (n < 0) {
+    return errno == EAGAIN || errno == EWOULDBLOCK ? NGHTTP2_ERR_WOULDBLOCK
+                                                   : NGHTTP2_ERR_CALLBACK_FAILURE;
+  }
+  return n;
+}
+
+static int begin_headers_cb(nghttp2_session *session, const nghttp2_frame *frame,
+                            void *user_data) {
+  h2_connection *conn = user_data;
+  h2_stream *s;
+
+  if (frame->hd.type != NGHTTP2_HEADERS ||
+      frame->headers.cat != NGHTTP2_HCAT_REQUEST) {
+    return 0;
+  }
+  s = calloc(1, sizeof(h2_stream));
+  s->id = frame->hd.stream_id;
+  nghttp2_session_set_stream_user_data(session, s->id, s);
+  conn->streams++;
+  conn->active++;
+  if (conn->active > conn->max_active) {
+    conn->max_active = conn->active;
+  }
+  return 0;
+}
+
+static int header_cb(nghttp2_session *session, const nghttp2_frame *frame,
+                     const uint8_t *name, size_t namelen, const uint8_t *value,
+                     size_t valuelen, uint8_t flags, void *user_data) {
+  h2_stream *s;
+  char **dst = NULL;
+
+  (void)flags;
+  (void)user_data;
+
+  s = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+  if (!s) {
+    return 0;
+  }
+  // names are lowercase in HTTP/2
+  if (namelen == 5 && memcmp(name, ":path", 5) == 0) {
+    dst = &s->path;
+  } else if (namelen == 13 && memcmp(name, "authorization", 13) == 0) {
+    dst = &s->authorization;
+  } else if (namelen == 12 && memcmp(name, "content-type", 12) == 0) {
+    dst = &s->content_type;
+  }
+  if (dst) {
+    free(*dst);
+    *dst = strndup((const char *)value, valuelen);
+  }
+  return 0;
+}
+
+static int data_chunk_recv_cb(nghttp2_session *session, uint8_t flags,
+                              int32_t stream_id, const uint8_t *data,
+                              size_t len, void *user_data) {
+  h2_stream *s = nghttp2_session_get_stream_user_data(session, stream_id);
+
+  (void)flags;
+  (void)user_data;
+
+  if (s) {
+    s->data = realloc(s->data, s->len + len);
+    memcpy(s->data + s->len, data, len);
+    s->len += len;
+  }
+  return 0;
+}
+
+static ssize_t body_read_cb(nghttp2_session *session, int32_t stream_id,
+                            uint8_t *buf, size_t length, uint32_t *data_flags,
+                            nghttp2_data_source *source, void *user_data) {
+  h2_stream *s = source->ptr;
+  size_t n = s->len - s->pos;
+
+  (void)session;
+  (void)stream_id;
+  (void)user_data;
+
+  if (n > length) {
+    n = length;
+  }
+  memcpy(buf, s->data + s->pos, n);
+  s->pos += n;
+  if (s->pos == s->len) {
+    *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+  }
+  return n;
+}
+
+#define make_nv(name, value)                                                   \
+  {                                                                            \
+    (uint8_t *)(name), (uint8_t *)(value), strlen(name), strlen(value),        \
+        NGHTTP2_NV_FLAG_NONE                                                   \
+  }
+
+/* Submits the response of a request, which was received whole */
+static int respond(nghttp2_session *session, h2_stream *s) {
+  const char *content_type = "application/json";
+  char content_length[32];
+  nghttp2_data_provider provider;
+  json_t *body;
+
+  if (s->path && strcmp(s->path, ECHO_PATH) == 0) {
+    if (s->content_type) {
+      content_type = s->content_type;
+    }
+  } else {
+    free(s->data);
+    body = test_body(&shape, s->authorization);
+    s->data = json_dumps(body, 0);
+    s->len = strlen(s->data);
+    json_decref(body);
+  }
+  snprintf(content_length, sizeof(content_length), "%zu", s->len);
+
+  nghttp2_nv headers[] = {make_nv(":status", "200"),
+                          make_nv("content-type", content_type),
+                          make_nv("content-length", content_length)};
+  provider.source.ptr = s;
+  provider.read_callback = body_read_cb;
+  return nghttp2_submit_response(session, s->id, headers,
+                                 sizeof(headers) / sizeof(headers[0]),
+                                 s->len ? &provider : NULL);
+}
+
+static int frame_recv_cb(nghttp2_session *session, const nghttp2_frame *frame,
+                         void *user_data) {
+  h2_stream *s;
+
+  (void)user_data;
+
+  if ((frame->hd.type != NGHTTP2_HEADERS && frame->hd.type != NGHTTP2_DATA) ||
+      !(frame->hd.flags & NGHTTP2_FLAG_END_STREAM)) {
+    return 0;
+  }
+  s = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+  if (!s) {
+    return 0;
+  }
+  return respond(session, s) == 0 ? 0 : NGHTTP2_ERR_CALLBACK_FAILURE;
+}
+
+static int stream_close_cb(nghttp2_session *session, int32_t stream_id,
+                           uint32_t error_code, void *user_data) {
+  h2_connection *conn = user_data;
+  h2_stream *s = nghttp2_session_get_stream_user_data(session, stream_id);
+
+  (void)error_code;
+
+  if (s) {
+    nghttp2_session_set_stream_user_data(session, stream_id, NULL);
+    stream_free(s);
+    conn->active--;
+  }
+  return 0;
+}
+
+static h2_connection *connection_new(int fd) {
+  nghttp2_session_callbacks *callbacks;
+  nghttp2_settings_entry settings[] = {
+      {NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, max_streams},
+      {NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE, window}};
+  h2_connection *conn = calloc(1, sizeof(h2_connection));
+
+  conn->fd = fd;
+  conn->id = atomic_fetch_add(&connections_total, 1) + 1;
+
+  nghttp2_session_callbacks_new(&callbacks);
+  nghttp2_session_callbacks_set_send_callback(callbacks, send_cb);
+  nghttp2_session_callbacks_set_on_begin_headers_callback(callbacks,
+                                                          begin_headers_cb);
+  nghttp2_session_callbacks_set_on_header_callback(callbacks, header_cb);
+  nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks,
+                                                            data_chunk_recv_cb);
+  nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks,
+                                                       frame_recv_cb);
+  nghttp2_session_callbacks_set_on_stream_close_callback(callbacks,
+                                                         stream_close_cb);
+  nghttp2_session_server_new(&conn->session, callbacks, conn);
+  nghttp2_session_callbacks_del(callbacks);
+
+  nghttp2_submit_settings(conn->session, NGHTTP2_FLAG_NONE, settings,
+                          sizeof(settings) / sizeof(settings[0]));
+  return conn;
+}
+
+static void connection_free(h2_connection *conn) {
+  fprintf(stderr, "%s: connection %ld closed, %ld streams, %d concurrent\n",
+          PROG, conn->id, conn->streams, conn->max_active);
+  atomic_fetch_add(&streams_total, conn->streams);
+  // closes the remaining streams
+  nghttp2_session_del(conn->session);
+  close(conn->fd);
+  free(conn);
+}
+
+/* Reads and writes what the socket allows. Returns -1 if the connection
+ * should be closed. */
+static int connection_io(h2_connection *conn, uint32_t events, char *buf) {
+  ssize_t n;
+
+  if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+    for (;;) {
+      n = recv(conn->fd, buf, READ_BUFFER_SIZE, 0);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        break;
+      }
+      if (n <= 0) {
+        return -1;
+      }
+      if (nghttp2_session_mem_recv(conn->session, (uint8_t *)buf, n) < 0) {
+        return -1;
+      }
+    }
+  }
+  if (nghttp2_session_send(conn->session) != 0) {
+    return -1;
+  }
+  if (!nghttp2_session_want_read(conn->session) &&
+      !nghttp2_session_want_write(conn->session)) {
+    return -1;
+  }
+  return 0;
+}
+
+static int listen_socket(void) {
+  struct sockaddr_in6 addr;
+  int fd, one = 1;
+
+  fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  // every thread listens on the port, the kernel balances connections
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+  memset(&addr, 0, sizeof(addr));
+  addr.sin6_family = AF_INET6;
+  addr.sin6_addr = in6addr_any;
+  addr.sin6_port = htons(port);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(fd, SOMAXCONN) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void *serve(void *arg) {
+  int lfd = *(int *)arg, ep, n, i, fd, one = 1;
+  struct epoll_event ev, events[MAX_EVENTS];
+  h2_connection *conn;
+  char *buf = malloc(READ_BUFFER_SIZE);
+
+  ep = epoll_create1(0);
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  epoll_ctl(ep, EPOLL_CTL_ADD, lfd, &ev);
+
+  while (!atomic_load(&stopping)) {
+    n = epoll_wait(ep, events, MAX_EVENTS, POLL_TIMEOUT_MS);
+    for (i = 0; i < n; i++) {
+      conn = events[i].data.ptr;
+      if (!conn) {
+        while ((fd = accept(lfd, NULL, NULL)) >= 0) {
+          fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+          setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+          ev.data.ptr = connection_new(fd);
+          ev.events = EPOLLIN | EPOLLOUT;
+          epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+        }
+        continue;
+      }
+      if (connection_io(conn, events[i].events, buf) != 0) {
+        epoll_ctl(ep, EPOLL_CTL_DEL, conn->fd, NULL);
+        connection_free(conn);
+        continue;
+      }
+      // wait for writability only while nghttp2 has data to send
+      ev.data.ptr = conn;
+      ev.events = EPOLLIN;
+      if (nghttp2_session_want_write(conn->session)) {
+        ev.events |= EPOLLOUT;
+      }
+      epoll_ctl(ep, EPOLL_CTL_MOD, conn->fd, &ev);
+    }
+  }
+
+  // connections still open are dropped
+  free(buf);
+  close(ep);
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  char *arg;
+  option_type opt = OPTION_NONE;
+  int threads = 1, i;
+  size_t size;
+  int *fds;
+  pthread_t *ths;
+
+  while (argc-- > 1) {
+    arg = *(++argv);
+    if ((strcmp(arg, "-h") == 0) || (strcmp(arg, "--help") == 0)) {
+      usage();
+      return 1;
+    } else if ((strcmp(arg, "-p") == 0) || (strcmp(arg, "--port") == 0)) {
+      opt = OPTION_PORT;
+    } else if ((strcmp(arg, "-t") == 0) || (strcmp(arg, "--threads") == 0)) {
+      opt = OPTION_THREADS;
+    } else if (strcmp(arg, "--body-size") == 0) {
+      opt = OPTION_BODY_SIZE;
+    } else if (strcmp(arg, "--items") == 0) {
+      opt = OPTION_ITEMS;
+    } else if (strcmp(arg, "--max-streams") == 0) {
+      opt = OPTION_MAX_STREAMS;
+    } else if (strcmp(arg, "--window") == 0) {
+      opt = OPTION_WINDOW;
+    } else {
+      switch (opt) {
+      case OPTION_NONE:
+        error("Uknown argument: %s", arg);
+        break;
+      case OPTION_PORT:
+        port = atoi(arg);
+        if (!port) {
+          error("Invalid port number: %s", arg);
+        }
+        break;
+      case OPTION_THREADS:
+        threads = atoi(arg);
+        if (threads < 1) {
+          error("Invalid number of threads: %s", arg);
+        }
+        break;
+      case OPTION_BODY_SIZE:
+        shape.size = test_parse_size(arg);
+        if (shape.size == (size_t)-1) {
+          error("Invalid size: %s", arg);
+        }
+        break;
+      case OPTION_ITEMS:
+        shape.items = atol(arg);
+        if (shape.items < 1) {
+          error("Invalid number of items: %s", arg);
+        }
+        break;
+      case OPTION_MAX_STREAMS:
+        max_streams = strtoul(arg, NULL, 10);
+        if (!max_streams) {
+          error("Invalid number of streams: %s", arg);
+        }
+        break;
+      case OPTION_WINDOW:
+        size = test_parse_size(arg);
+        if (size == (size_t)-1 || size > NGHTTP2_MAX_WINDOW_SIZE) {
+          error("Invalid window size: %s", arg);
+        }
+        window = size;
+        break;
+      }
+      opt = OPTION_NONE;
+    }
+  }
+
+  fds = calloc(threads, sizeof(int));
+  ths = calloc(threads, sizeof(pthread_t));
+  for (i = 0; i < threads; i++) {
+    fds[i] = listen_socket();
+    if (fds[i] < 0) {
+      error("Cannot listen on port %d: %s", port, strerror(errno));
+    }
+  }
+  for (i = 0; i < threads; i++) {
+    pthread_create(&ths[i], NULL, serve, &fds[i]);
+  }
+
+  getchar();
+
+  atomic_store(&stopping, 1);
+  for (i = 0; i < threads; i++) {
+    pthread_join(ths[i], NULL);
+    close(fds[i]);
+  }
+  fprintf(stderr, "%s: %ld connections, %ld streams\n", PROG,
+          atomic_load(&connections_total), atomic_load(&streams_total));
+  free(fds);
+  free(ths);
+  return EXIT_SUCCESS;
+}
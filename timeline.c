@@ -0,0 +1,185 @@
+/*
+ * In-memory timeline of events written as Chrome trace events
+ */
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "timeline.h"
+
+/* Complete slice or counter. Names are copied, categories are static. */
+typedef struct {
+  char name[TIMELINE_NAME_LEN];
+  const char *cat;
+  char ph; // 'X' slice, 'C' counter
+  int tid;
+  double ts;
+  double dur;
+  long value; // status of a slice (0 if none) or value of a counter
+  atomic_int ready;
+} timeline_event;
+
+/* Ring of preallocated events. Writers claim a slot by incrementing head, so
+ * they never wait for each other, the oldest events are overwritten when the
+ * ring is full. */
+struct timeline {
+  timeline_event *events;
+  size_t capacity;
+  atomic_size_t head;
+};
+
+/**
+ * timeline_new - Allocate timeline
+ * @capacity: Number of kept events
+ * Returns: Allocated timeline or %NULL on failure
+ *
+ * Caller is responsible for freeing the timeline by timeline_free().
+ */
+timeline *timeline_new(size_t capacity) {
+  timeline *t;
+
+  if (!capacity) {
+    return NULL;
+  }
+  t = calloc(1, sizeof(timeline));
+  if (!t) {
+    return NULL;
+  }
+  t->events = calloc(capacity, sizeof(timeline_event));
+  if (!t->events) {
+    free(t);
+    return NULL;
+  }
+  t->capacity = capacity;
+  atomic_init(&t->head, 0);
+  return t;
+}
+
+/**
+ * timeline_free - Free timeline
+ * @t: Timeline created by timeline_new() or %NULL
+ */
+void timeline_free(timeline *t) {
+  if (t) {
+    free(t->events);
+    free(t);
+  }
+}
+
+static timeline_event *timeline_claim(timeline *t) {
+  size_t i = atomic_fetch_add_explicit(&t->head, 1, memory_order_relaxed);
+  timeline_event *e = &t->events[i % t->capacity];
+
+  atomic_store_explicit(&e->ready, 0, memory_order_relaxed);
+  return e;
+}
+
+/**
+ * timeline_slice - Add complete slice
+ * @t: Timeline
+ * @name: Name of the slice, it is truncated to TIMELINE_NAME_LEN - 1 bytes
+ * @cat: Category, a string valid until the timeline is written
+ * @tid: Row of the slice, slices in a row must nest
+ * @start: Start in seconds of the clock of the origin
+ * @end: End in seconds
+ * @status: Status shown in the arguments of the slice, 0 for none
+ */
+void timeline_slice(timeline *t, const char *name, const char *cat, int tid,
+                    double start, double end, long status) {
+  timeline_event *e = timeline_claim(t);
+
+  strncpy(e->name, name, TIMELINE_NAME_LEN - 1);
+  e->name[TIMELINE_NAME_LEN - 1] = 0;
+  e->cat = cat;
+  e->ph = 'X';
+  e->tid = tid;
+  e->ts = start;
+  e->dur = end > start ? end - start : 0;
+  e->value = status;
+  atomic_store_explicit(&e->ready, 1, memory_order_release);
+}
+
+/**
+ * timeline_counter - Add sample of a counter
+ * @t: Timeline
+ * @name: Name of the counter
+ * @ts: Time in seconds of the clock of the origin
+ * @value: Value of the counter
+ */
+void timeline_counter(timeline *t, const char *name, double ts, long value) {
+  timeline_event *e = timeline_claim(t);
+
+  strncpy(e->name, name, TIMELINE_NAME_LEN - 1);
+  e->name[TIMELINE_NAME_LEN - 1] = 0;
+  e->cat = "counter";
+  e->ph = 'C';
+  e->tid = 0;
+  e->ts = ts;
+  e->dur = 0;
+  e->value = value;
+  atomic_store_explicit(&e->ready, 1, memory_order_release);
+}
+
+static void timeline_write_string(FILE *f, const char *s) {
+  fputc('"', f);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\') {
+      fprintf(f, "\\%c", *s);
+    } else if ((unsigned char)*s < 0x20) {
+      fprintf(f, "\\u%04x", *s);
+    } else {
+      fputc(*s, f);
+    }
+  }
+  fputc('"', f);
+}
+
+/**
+ * timeline_write - Write events to a file in Chrome trace event format
+ * @t: Timeline
+ * @path: Path to the file, existing file is truncated
+ * @origin: Time of the start of the timeline in seconds
+ * Returns: 0 on success, -1 on failure (errno is set)
+ *
+ * The file is loaded by chrome://tracing and https://ui.perfetto.dev.
+ * Events still being added by other threads are skipped.
+ */
+int timeline_write(timeline *t, const char *path, double origin) {
+  size_t head = atomic_load(&t->head), i;
+  timeline_event *e;
+  int first = 1, ok;
+  FILE *f = fopen(path, "w");
+
+  if (!f) {
+    return -1;
+  }
+  fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+  i = head > t->capacity ? head - t->capacity : 0;
+  for (; i < head; i++) {
+    e = &t->events[i % t->capacity];
+    if (!atomic_load_explicit(&e->ready, memory_order_acquire)) {
+      continue;
+    }
+    fprintf(f, "%s{\"name\": ", first ? "" : ",\n");
+    first = 0;
+    timeline_write_string(f, e->name);
+    fprintf(f, ", \"cat\": ");
+    timeline_write_string(f, e->cat);
+    fprintf(f, ", \"ph\": \"%c\", \"ts\": %.3f, \"pid\": 1, \"tid\": %d",
+            e->ph, (e->ts - origin) * 1e6, e->tid);
+    if (e->ph == 'X') {
+      fprintf(f, ", \"dur\": %.3f", e->dur * 1e6);
+      if (e->value) {
+        fprintf(f, ", \"args\": {\"status\": %ld}", e->value);
+      }
+    } else {
+      fprintf(f, ", \"args\": {\"value\": %ld}", e->value);
+    }
+    fputc('}', f);
+  }
+  fprintf(f, "%s],\n\"otherData\": {\"dropped_events\": %zu}}\n",
+          first ? "" : "\n", head > t->capacity ? head - t->capacity : 0);
+  ok = !ferror(f);
+  return fclose(f) == 0 && ok ? 0 : -1;
+}
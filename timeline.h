@@ -0,0 +1,21 @@
+/*
+ * In-memory timeline of events written as Chrome trace events
+ */
+
+#ifndef TIMELINE_H
+#define TIMELINE_H
+
+#include <stdlib.h>
+
+#define TIMELINE_NAME_LEN 96
+
+typedef struct timeline timeline;
+
+timeline *timeline_new(size_t capacity);
+void timeline_free(timeline *t);
+void timeline_slice(timeline *t, const char *name, const char *cat, int tid,
+                    double start, double end, long status);
+void timeline_counter(timeline *t, const char *name, double ts, long value);
+int timeline_write(timeline *t, const char *path, double origin);
+
+#endif /* TIMELINE_H */
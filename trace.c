@@ -0,0 +1,196 @@
+/*
+ * Append-only binary trace of HTTP exchanges
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define TRACE_MAGIC "APITRC1\n"
+#define TRACE_MAGIC_LEN 8
+
+/* Record is this header followed by the fields. Times are in microseconds. */
+typedef struct {
+  uint64_t sent;
+  uint64_t duration;
+  int32_t status;
+  uint32_t lens[TRACE_FIELDS];
+} trace_header;
+
+struct trace_writer {
+  FILE *f;
+};
+
+struct trace_reader {
+  char *data;
+  size_t len;
+  size_t pos;
+};
+
+/**
+ * trace_writer_open - Create trace file
+ * @path: Path to the file, existing file is truncated
+ * Returns: Allocated writer or %NULL on failure (errno is set)
+ *
+ * Caller is responsible for closing the writer by trace_writer_close().
+ */
+trace_writer *trace_writer_open(const char *path) {
+  trace_writer *w;
+  FILE *f = fopen(path, "wb");
+
+  if (!f) {
+    return NULL;
+  }
+  if (fwrite(TRACE_MAGIC, TRACE_MAGIC_LEN, 1, f) != 1 || fflush(f) != 0) {
+    fclose(f);
+    return NULL;
+  }
+  w = calloc(1, sizeof(trace_writer));
+  w->f = f;
+  return w;
+}
+
+/**
+ * trace_write - Append record
+ * @w: Writer
+ * @rec: Record
+ * Returns: 0 on success, -1 on failure
+ *
+ * The record is flushed, so that a crashed process leaves complete records
+ * behind. A partially written record is ignored by trace_read().
+ */
+int trace_write(trace_writer *w, const trace_record *rec) {
+  trace_header h;
+  int i;
+
+  memset(&h, 0, sizeof(h));
+  h.sent = rec->sent > 0 ? (uint64_t)(rec->sent * 1e6) : 0;
+  h.duration = rec->duration > 0 ? (uint64_t)(rec->duration * 1e6) : 0;
+  h.status = rec->status;
+  for (i = 0; i < TRACE_FIELDS; i++) {
+    if (rec->lens[i] > UINT32_MAX) {
+      return -1;
+    }
+    h.lens[i] = (uint32_t)rec->lens[i];
+  }
+
+  if (fwrite(&h, sizeof(h), 1, w->f) != 1) {
+    return -1;
+  }
+  for (i = 0; i < TRACE_FIELDS; i++) {
+    if (rec->lens[i] && fwrite(rec->fields[i], rec->lens[i], 1, w->f) != 1) {
+      return -1;
+    }
+  }
+  return fflush(w->f) == 0 ? 0 : -1;
+}
+
+/**
+ * trace_writer_close - Close trace file
+ * @w: Writer created by trace_writer_open() or %NULL
+ */
+void trace_writer_close(trace_writer *w) {
+  if (w) {
+    fclose(w->f);
+    free(w);
+  }
+}
+
+/**
+ * trace_reader_open - Map trace file into memory
+ * @path: Path to the file
+ * Returns: Allocated reader or %NULL on failure (errno is set)
+ *
+ * Caller is responsible for closing the reader by trace_reader_close().
+ */
+trace_reader *trace_reader_open(const char *path) {
+  trace_reader *r;
+  struct stat st;
+  void *data;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return NULL;
+  }
+  if (st.st_size < TRACE_MAGIC_LEN) {
+    close(fd);
+    errno = EINVAL;
+    return NULL;
+  }
+  data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return NULL;
+  }
+  if (memcmp(data, TRACE_MAGIC, TRACE_MAGIC_LEN) != 0) {
+    munmap(data, st.st_size);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  r = calloc(1, sizeof(trace_reader));
+  r->data = data;
+  r->len = st.st_size;
+  r->pos = TRACE_MAGIC_LEN;
+  return r;
+}
+
+/**
+ * trace_read - Read next record
+ * @r: Reader
+ * @rec: Record, its fields point into the mapped file
+ * Returns: 1 if a record was read, 0 at the end of the trace
+ *
+ * Fields are valid until the reader is closed.
+ */
+int trace_read(trace_reader *r, trace_record *rec) {
+  trace_header h;
+  size_t pos = r->pos, len = 0;
+  int i;
+
+  if (r->len - pos < sizeof(h)) {
+    return 0;
+  }
+  memcpy(&h, r->data + pos, sizeof(h));
+  pos += sizeof(h);
+  for (i = 0; i < TRACE_FIELDS; i++) {
+    len += h.lens[i];
+  }
+  if (r->len - pos < len) {
+    return 0;
+  }
+
+  rec->sent = h.sent / 1e6;
+  rec->duration = h.duration / 1e6;
+  rec->status = h.status;
+  for (i = 0; i < TRACE_FIELDS; i++) {
+    rec->fields[i] = r->data + pos;
+    rec->lens[i] = h.lens[i];
+    pos += h.lens[i];
+  }
+  r->pos = pos;
+  return 1;
+}
+
+/**
+ * trace_reader_close - Unmap trace file
+ * @r: Reader created by trace_reader_open() or %NULL
+ */
+void trace_reader_close(trace_reader *r) {
+  if (r) {
+    munmap(r->data, r->len);
+    free(r);
+  }
+}
@@ -0,0 +1,40 @@
+/*
+ * Append-only binary trace of HTTP exchanges
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdlib.h>
+
+typedef enum {
+  TRACE_METHOD,
+  TRACE_URL,
+  TRACE_REQUEST_HEADERS, // header lines separated by nul characters
+  TRACE_REQUEST_BODY,
+  TRACE_RESPONSE_HEADERS,
+  TRACE_RESPONSE_BODY,
+  TRACE_ERROR,
+  TRACE_FIELDS
+} trace_field;
+
+/* Exchange of a request and its response. Fields aren't nul terminated. */
+typedef struct {
+  double sent;     // seconds since the start of the trace
+  double duration; // seconds
+  int status;
+  const char *fields[TRACE_FIELDS];
+  size_t lens[TRACE_FIELDS];
+} trace_record;
+
+typedef struct trace_writer trace_writer;
+typedef struct trace_reader trace_reader;
+
+trace_writer *trace_writer_open(const char *path);
+int trace_write(trace_writer *w, const trace_record *rec);
+void trace_writer_close(trace_writer *w);
+trace_reader *trace_reader_open(const char *path);
+int trace_read(trace_reader *r, trace_record *rec);
+void trace_reader_close(trace_reader *r);
+
+#endif /* TRACE_H */